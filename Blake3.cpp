@@ -0,0 +1,210 @@
+// BLAKE3 hash, ported from the reference implementation
+// (https://github.com/BLAKE3-team/BLAKE3/blob/master/reference_impl)
+
+#include <cstring>
+#include "Blake3.h"
+
+namespace {
+
+const size_t BLOCK_LEN = 64;
+const size_t CHUNK_LEN = 1024;
+
+const uint32_t CHUNK_START = 1 << 0;
+const uint32_t CHUNK_END = 1 << 1;
+const uint32_t PARENT = 1 << 2;
+const uint32_t ROOT = 1 << 3;
+
+const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+const unsigned MSG_PERMUTATION[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
+inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+inline void g(uint32_t s[16], int a, int b, int c, int d, uint32_t mx, uint32_t my) {
+    s[a] = s[a] + s[b] + mx;
+    s[d] = rotr(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = rotr(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + my;
+    s[d] = rotr(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = rotr(s[b] ^ s[c], 7);
+}
+
+void round_fn(uint32_t s[16], const uint32_t m[16]) {
+    // columns
+    g(s, 0, 4, 8, 12, m[0], m[1]);
+    g(s, 1, 5, 9, 13, m[2], m[3]);
+    g(s, 2, 6, 10, 14, m[4], m[5]);
+    g(s, 3, 7, 11, 15, m[6], m[7]);
+    // diagonals
+    g(s, 0, 5, 10, 15, m[8], m[9]);
+    g(s, 1, 6, 11, 12, m[10], m[11]);
+    g(s, 2, 7, 8, 13, m[12], m[13]);
+    g(s, 3, 4, 9, 14, m[14], m[15]);
+}
+
+void compress(const uint32_t cv[8], const uint32_t block_words[16], uint64_t counter,
+              uint32_t block_len, uint32_t flags, uint32_t out[16]) {
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags,
+    };
+    uint32_t m[16];
+    memcpy(m, block_words, sizeof(m));
+    for (int r = 0; r < 7; ++r) {
+        round_fn(s, m);
+        if (r == 6) break;
+        uint32_t p[16];
+        for (int i = 0; i < 16; ++i) p[i] = m[MSG_PERMUTATION[i]];
+        memcpy(m, p, sizeof(m));
+    }
+    for (int i = 0; i < 8; ++i) {
+        s[i] ^= s[i + 8];
+        s[i + 8] ^= cv[i];
+    }
+    memcpy(out, s, sizeof(s));
+}
+
+void words_from_le(const unsigned char *bytes, size_t nwords, uint32_t *words) {
+    for (size_t i = 0; i < nwords; ++i) {
+        const unsigned char *b = bytes + 4 * i;
+        words[i] = (uint32_t)b[0] | ((uint32_t)b[1] << 8) |
+                   ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+    }
+}
+
+// Everything needed to produce either a chaining value or the root output
+struct Output {
+    uint32_t input_cv[8];
+    uint32_t block_words[16];
+    uint64_t counter;
+    uint32_t block_len;
+    uint32_t flags;
+
+    void chaining_value(uint32_t out[8]) const {
+        uint32_t full[16];
+        compress(input_cv, block_words, counter, block_len, flags, full);
+        memcpy(out, full, 8 * sizeof(uint32_t));
+    }
+
+    void root_bytes(unsigned char out[32]) const {
+        uint32_t words[16];
+        compress(input_cv, block_words, 0, block_len, flags | ROOT, words);
+        for (int i = 0; i < 8; ++i) {
+            out[4 * i] = (unsigned char)words[i];
+            out[4 * i + 1] = (unsigned char)(words[i] >> 8);
+            out[4 * i + 2] = (unsigned char)(words[i] >> 16);
+            out[4 * i + 3] = (unsigned char)(words[i] >> 24);
+        }
+    }
+};
+
+Output parent_output(const uint32_t left[8], const uint32_t right[8]) {
+    Output o;
+    memcpy(o.input_cv, IV, sizeof(o.input_cv));
+    memcpy(o.block_words, left, 8 * sizeof(uint32_t));
+    memcpy(o.block_words + 8, right, 8 * sizeof(uint32_t));
+    o.counter = 0;
+    o.block_len = BLOCK_LEN;
+    o.flags = PARENT;
+    return o;
+}
+
+} // namespace
+
+void Blake3::ChunkState::reset(const uint32_t key[8], uint64_t counter) {
+    memcpy(cv, key, sizeof(cv));
+    chunk_counter = counter;
+    memset(block, 0, sizeof(block));
+    block_len = 0;
+    blocks_compressed = 0;
+}
+
+size_t Blake3::ChunkState::len() const {
+    return BLOCK_LEN * blocks_compressed + block_len;
+}
+
+void Blake3::ChunkState::update(const unsigned char *input, size_t len) {
+    while (len > 0) {
+        // Only compress a full block once we know more input follows;
+        // the last block of a chunk needs the CHUNK_END flag.
+        if (block_len == BLOCK_LEN) {
+            uint32_t words[16], out[16];
+            words_from_le(block, 16, words);
+            uint32_t start = blocks_compressed == 0 ? CHUNK_START : 0;
+            compress(cv, words, chunk_counter, BLOCK_LEN, start, out);
+            memcpy(cv, out, sizeof(cv));
+            blocks_compressed++;
+            memset(block, 0, sizeof(block));
+            block_len = 0;
+        }
+        size_t take = BLOCK_LEN - block_len;
+        if (take > len) take = len;
+        memcpy(block + block_len, input, take);
+        block_len += (uint8_t)take;
+        input += take;
+        len -= take;
+    }
+}
+
+Blake3::Blake3() : cv_stack_len(0) {
+    chunk.reset(IV, 0);
+}
+
+void Blake3::push_chunk_cv(uint32_t cv[8], uint64_t total_chunks) {
+    // Merge completed subtrees: one merge per trailing zero bit of the chunk count
+    while ((total_chunks & 1) == 0) {
+        cv_stack_len--;
+        parent_output(cv_stack[cv_stack_len], cv).chaining_value(cv);
+        total_chunks >>= 1;
+    }
+    memcpy(cv_stack[cv_stack_len], cv, 8 * sizeof(uint32_t));
+    cv_stack_len++;
+}
+
+void Blake3::update(const void *data, size_t len) {
+    const unsigned char *input = static_cast<const unsigned char*>(data);
+    while (len > 0) {
+        if (chunk.len() == CHUNK_LEN) {
+            Output o;
+            memcpy(o.input_cv, chunk.cv, sizeof(o.input_cv));
+            words_from_le(chunk.block, 16, o.block_words);
+            o.counter = chunk.chunk_counter;
+            o.block_len = chunk.block_len;
+            o.flags = CHUNK_END | (chunk.blocks_compressed == 0 ? CHUNK_START : 0);
+            uint32_t cv[8];
+            o.chaining_value(cv);
+            uint64_t total_chunks = chunk.chunk_counter + 1;
+            push_chunk_cv(cv, total_chunks);
+            chunk.reset(IV, total_chunks);
+        }
+        size_t take = CHUNK_LEN - chunk.len();
+        if (take > len) take = len;
+        chunk.update(input, take);
+        input += take;
+        len -= take;
+    }
+}
+
+void Blake3::finalize(unsigned char out[OUT_LEN]) const {
+    Output o;
+    memcpy(o.input_cv, chunk.cv, sizeof(o.input_cv));
+    words_from_le(chunk.block, 16, o.block_words);
+    o.counter = chunk.chunk_counter;
+    o.block_len = chunk.block_len;
+    o.flags = CHUNK_END | (chunk.blocks_compressed == 0 ? CHUNK_START : 0);
+
+    for (size_t i = cv_stack_len; i > 0; --i) {
+        uint32_t right[8];
+        o.chaining_value(right);
+        o = parent_output(cv_stack[i - 1], right);
+    }
+    o.root_bytes(out);
+}
@@ -0,0 +1,38 @@
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Portable BLAKE3 (default hash mode only, 32 byte output).
+// Straight port of the reference implementation - no SIMD, but it is
+// still faster than SHA-256 without SHA-NI and needs no extra library.
+class Blake3 {
+public:
+    static const size_t OUT_LEN = 32;
+
+    Blake3();
+    void update(const void *data, size_t len);
+    void finalize(unsigned char out[OUT_LEN]) const;
+
+private:
+    struct ChunkState {
+        uint32_t cv[8];
+        uint64_t chunk_counter;
+        unsigned char block[64];
+        uint8_t block_len;
+        uint8_t blocks_compressed;
+
+        void reset(const uint32_t key[8], uint64_t counter);
+        size_t len() const;
+        void update(const unsigned char *input, size_t len);
+    };
+
+    ChunkState chunk;
+    uint32_t cv_stack[54][8];
+    uint8_t cv_stack_len;
+
+    void push_chunk_cv(uint32_t cv[8], uint64_t total_chunks);
+};
+
+#endif // BLAKE3_H
@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cmath>
+#include <unistd.h>
+#include <unordered_map>
+#include "Delta.h"
+using namespace std;
+
+enum : uint32_t { OP_END = 0, OP_COPY = 1, OP_LITERAL = 2 };
+
+// Largest piece of literal data or copied blocks handled at once
+static const size_t DELTA_CHUNK = 1 << 20;
+
+// rsync's checksum: a = sum of bytes, b = sum of bytes weighted by their
+// distance from the end of the window, both mod 2^16. Kept in 32 bits
+// and masked on the way out, which gives the same digest.
+struct Rolling {
+    uint32_t a = 0, b = 0;
+    void init(const unsigned char *p, size_t n) {
+        a = b = 0;
+        for (size_t i = 0; i < n; ++i) {
+            a += p[i];
+            b += (uint32_t)(n - i) * p[i];
+        }
+    }
+    void roll(unsigned char out, unsigned char in, size_t n) {
+        a += in - out;
+        b += a - (uint32_t)n * out;
+    }
+    uint32_t digest() const { return (a & 0xffff) | (b << 16); }
+};
+
+static string block_hash(Hasher &hasher, const void *data, size_t len) {
+    hasher.reset();
+    hasher.update(data, len);
+    return hasher.final_hex().substr(0, 32);
+}
+
+uint32_t delta_block_size(uint64_t file_size) {
+    uint64_t b = (uint64_t)sqrt((double)file_size);
+    b = min<uint64_t>(max<uint64_t>(b, 2048), 128 * 1024);
+    return (uint32_t)(b & ~7ull);
+}
+
+bool compute_signature(int fd, uint64_t size, HashAlgo algo, BlockSignature &sig) {
+    sig.block_size = delta_block_size(size);
+    sig.weak.clear();
+    sig.strong.clear();
+    Hasher hasher(algo);
+    vector<unsigned char> block(sig.block_size);
+    for (uint64_t off = 0; off + sig.block_size <= size; off += sig.block_size) {
+        for (size_t got = 0; got < sig.block_size;) {
+            ssize_t n = pread(fd, block.data() + got, sig.block_size - got, off + got);
+            if (n <= 0) return false;
+            got += n;
+        }
+        Rolling r;
+        r.init(block.data(), sig.block_size);
+        sig.weak.push_back(r.digest());
+        sig.strong.push_back(block_hash(hasher, block.data(), sig.block_size));
+    }
+    return true;
+}
+
+static void append_u32(string &buf, uint32_t v) {
+    v = htonl(v);
+    buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void append_signature(string &buf, const BlockSignature &sig) {
+    append_u32(buf, sig.block_size);
+    append_u32(buf, sig.weak.size());
+    for (size_t i = 0; i < sig.weak.size(); ++i) {
+        append_u32(buf, sig.weak[i]);
+        buf.append(sig.strong[i]);
+    }
+}
+
+static bool read_u32(const DeltaRead &in, uint32_t &v) {
+    if (!in(&v, sizeof(v))) return false;
+    v = ntohl(v);
+    return true;
+}
+
+bool read_signature(const DeltaRead &in, BlockSignature &sig) {
+    uint32_t count;
+    if (!read_u32(in, sig.block_size) || !read_u32(in, count) || sig.block_size == 0) return false;
+    sig.weak.resize(count);
+    sig.strong.assign(count, string(32, '\0'));
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!read_u32(in, sig.weak[i]) || !in(&sig.strong[i][0], 32)) return false;
+    }
+    return true;
+}
+
+bool encode_delta(const char *data, uint64_t len, const BlockSignature &sig, HashAlgo algo,
+                  const DeltaWrite &out, DeltaStats *stats) {
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+    const size_t n = sig.block_size;
+    unordered_map<uint32_t, vector<uint32_t>> blocks;
+    for (uint32_t i = 0; i < sig.weak.size(); ++i) blocks[sig.weak[i]].push_back(i);
+
+    // Ops are small; batch them and flush before anything big
+    string ops;
+    uint32_t run_start = 0, run_len = 0;
+    auto flush_run = [&]() {
+        if (run_len == 0) return;
+        append_u32(ops, OP_COPY);
+        append_u32(ops, run_start);
+        append_u32(ops, run_len);
+        if (stats) stats->copied += (uint64_t)run_len * n;
+        run_len = 0;
+    };
+    auto flush_literal = [&](uint64_t from, uint64_t to) {
+        flush_run();
+        for (uint64_t off = from; off < to;) {
+            size_t piece = (size_t)min<uint64_t>(to - off, DELTA_CHUNK);
+            append_u32(ops, OP_LITERAL);
+            append_u32(ops, piece);
+            if (!out(ops.data(), ops.size()) || !out(data + off, piece)) return false;
+            ops.clear();
+            off += piece;
+        }
+        if (stats) stats->literal += to - from;
+        return true;
+    };
+
+    Hasher hasher(algo);
+    Rolling roll;
+    uint64_t pos = 0, literal_start = 0;
+    if (n > 0 && !blocks.empty() && len >= n) roll.init(p, n);
+    while (n > 0 && !blocks.empty() && pos + n <= len) {
+        auto it = blocks.find(roll.digest());
+        if (it != blocks.end()) {
+            string strong = block_hash(hasher, p + pos, n);
+            // Prefer the block that continues the current run
+            int64_t match = -1;
+            for (uint32_t b : it->second) {
+                if (sig.strong[b] != strong) continue;
+                if (match < 0 || (run_len && b == run_start + run_len)) match = b;
+            }
+            if (match >= 0) {
+                if (literal_start < pos && !flush_literal(literal_start, pos)) return false;
+                if (run_len && (uint32_t)match == run_start + run_len) {
+                    run_len++;
+                } else {
+                    flush_run();
+                    run_start = (uint32_t)match;
+                    run_len = 1;
+                }
+                pos += n;
+                literal_start = pos;
+                if (pos + n <= len) roll.init(p + pos, n);
+                if (ops.size() >= 64 * 1024) {
+                    if (!out(ops.data(), ops.size())) return false;
+                    ops.clear();
+                }
+                continue;
+            }
+        }
+        if (pos + n < len) roll.roll(p[pos], p[pos + n], n);
+        pos++;
+    }
+    if (!flush_literal(literal_start, len)) return false;
+    flush_run();
+    append_u32(ops, OP_END);
+    return out(ops.data(), ops.size());
+}
+
+int apply_delta(int old_fd, uint64_t old_size, uint32_t block_size, const DeltaRead &in,
+                const DeltaWrite &out) {
+    vector<char> buf(DELTA_CHUNK);
+    bool writing = true;
+    auto emit = [&](const char *data, size_t len) {
+        if (writing && !out(data, len)) writing = false;
+    };
+    while (true) {
+        uint32_t op;
+        if (!read_u32(in, op)) return -1;
+        if (op == OP_END) return writing ? 1 : 0;
+        if (op == OP_COPY) {
+            uint32_t first, count;
+            if (!read_u32(in, first) || !read_u32(in, count)) return -1;
+            uint64_t off = (uint64_t)first * block_size, end = off + (uint64_t)count * block_size;
+            if (block_size == 0 || end > old_size) return -1;
+            while (off < end) {
+                size_t piece = (size_t)min<uint64_t>(end - off, buf.size());
+                ssize_t got = pread(old_fd, buf.data(), piece, off);
+                if (got <= 0) {
+                    // Old version unreadable: this file is lost, the stream isn't
+                    writing = false;
+                    break;
+                }
+                emit(buf.data(), got);
+                off += got;
+            }
+        } else if (op == OP_LITERAL) {
+            uint32_t len;
+            if (!read_u32(in, len) || len > DELTA_CHUNK) return -1;
+            if (!in(buf.data(), len)) return -1;
+            emit(buf.data(), len);
+        } else {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "Hash.h"
+
+// rsync-style deltas, so a big file that changed a little is re-sent as
+// the changes plus references to what the receiver already has.
+//
+// The side with the old version cuts it into fixed-size blocks and sends
+// a signature: a cheap rolling checksum and a strong hash per block. The
+// side with the new version slides a block-sized window over it a byte at
+// a time; where the rolling checksum, and then the strong hash, match an
+// old block it says "copy that block" instead of sending the bytes.
+//
+// Signature: u32 block size, u32 count, then per block u32 rolling
+// checksum and 32 hex digits of its hash. Only whole blocks are listed.
+// Delta: a run of ops, integers big-endian:
+//   u32 1, u32 first block, u32 count   copy blocks of the old version
+//   u32 2, u32 length, <length bytes>   literal data
+//   u32 0                               end
+struct BlockSignature {
+    uint32_t block_size = 0;
+    std::vector<uint32_t> weak;
+    std::vector<std::string> strong;
+};
+
+using DeltaWrite = std::function<bool(const void *data, size_t len)>;
+using DeltaRead = std::function<bool(void *data, size_t len)>;
+
+// ~sqrt(size), so signature and per-block overhead stay small together
+uint32_t delta_block_size(uint64_t file_size);
+
+// Signature of the first size bytes of an open file
+bool compute_signature(int fd, uint64_t size, HashAlgo algo, BlockSignature &sig);
+void append_signature(std::string &buf, const BlockSignature &sig);
+bool read_signature(const DeltaRead &in, BlockSignature &sig);
+
+struct DeltaStats {
+    uint64_t copied = 0;   // bytes covered by block copies
+    uint64_t literal = 0;  // bytes sent as they are
+};
+
+// Delta turning the old version behind sig into data[0, len); false if
+// out failed
+bool encode_delta(const char *data, uint64_t len, const BlockSignature &sig, HashAlgo algo,
+                  const DeltaWrite &out, DeltaStats *stats = nullptr);
+
+// Rebuild a file from its old version (old_fd, whole blocks of
+// block_size) and a delta read through in, writing it through out.
+// 1 = done, 0 = out failed (the delta was still read to the end so the
+// stream stays usable), -1 = the delta was malformed or in failed.
+int apply_delta(int old_fd, uint64_t old_size, uint32_t block_size, const DeltaRead &in,
+                const DeltaWrite &out);
+
+#endif // DELTA_H
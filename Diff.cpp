@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Diff.h"
+using namespace std;
+
+bool looks_binary(const char *data, size_t len) {
+    return memchr(data, 0, min<size_t>(len, 8000)) != nullptr;
+}
+
+// Eight bytes at a time; seeded so a collision can be retried away
+static uint64_t line_hash(const char *p, size_t n, uint64_t seed) {
+    uint64_t h = seed ^ n;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+// Offsets of the lines in data[from, to) (found with memchr), then to; a
+// last line without a newline still counts
+static void split_lines(const char *data, size_t from, size_t to, vector<size_t> &bounds) {
+    bounds.clear();
+    bounds.reserve((to - from) / 32 + 2);
+    for (size_t pos = from; pos < to;) {
+        bounds.push_back(pos);
+        const void *nl = memchr(data + pos, '\n', to - pos);
+        pos = nl ? static_cast<const char*>(nl) - data + 1 : to;
+    }
+    bounds.push_back(to);
+}
+
+// Newlines in data[0, len), eight bytes at a time
+static size_t count_newlines(const char *data, size_t len) {
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL, newlines = 0x0a0a0a0a0a0a0a0aULL;
+    size_t count = 0, i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        uint64_t x = w ^ newlines;  // zero bytes where the newlines were
+        count += __builtin_popcountll(~(((x & low7) + low7) | x | low7));
+    }
+    for (; i < len; ++i) count += data[i] == '\n';
+    return count;
+}
+
+// Bytes a and b (n each at most) agree on from the start, or from the end
+static size_t common_prefix(const char *a, const char *b, size_t n) {
+    const size_t block = 4096;
+    size_t i = 0;
+    while (i + block <= n && memcmp(a + i, b + i, block) == 0) i += block;
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
+
+static size_t common_suffix(const char *a_end, const char *b_end, size_t n) {
+    const size_t block = 4096;
+    size_t i = 0;
+    while (i + block <= n && memcmp(a_end - i - block, b_end - i - block, block) == 0) i += block;
+    while (i < n && a_end[-(long)i - 1] == b_end[-(long)i - 1]) ++i;
+    return i;
+}
+
+static void hash_lines(const char *data, const vector<size_t> &bounds, size_t from, size_t to,
+                       uint64_t seed, vector<uint64_t> &hashes) {
+    hashes.resize(to - from);
+    for (size_t i = from; i < to; ++i) hashes[i - from] = line_hash(data + bounds[i], bounds[i + 1] - bounds[i], seed);
+}
+
+// Gives each distinct line hash an id (from 1). Lines are told apart by
+// their 64-bit hash alone, so a lookup touches one slot, fetched ahead of
+// time; the lines a diff ends up matching are compared for real afterwards.
+class LineTable {
+public:
+    explicit LineTable(size_t lines) {
+        size_t cap = 16;
+        while (cap < lines * 2) cap <<= 1;
+        slots.resize(cap);
+        mask = cap - 1;
+    }
+
+    void intern(const vector<uint64_t> &hashes, vector<uint32_t> &ids) {
+        const size_t ahead = 16;
+        ids.resize(hashes.size());
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            if (i + ahead < hashes.size()) __builtin_prefetch(&slots[hashes[i + ahead] & mask]);
+            ids[i] = intern(hashes[i]);
+        }
+    }
+    size_t size() const { return next_id; }
+
+private:
+    uint32_t intern(uint64_t h) {
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            Slot &s = slots[i];
+            if (s.id == 0) {
+                s.hash = h;
+                s.id = next_id++;
+                return s.id;
+            }
+            if (s.hash == h) return s.id;
+        }
+    }
+
+    struct Slot {
+        uint64_t hash = 0;
+        uint32_t id = 0;
+    };
+    vector<Slot> slots;
+    size_t mask;
+    uint32_t next_id = 1;
+};
+
+// Myers' algorithm over interned lines, marking what isn't in the longest
+// common subsequence. a/b are the lines that can match at all; at/bt map
+// their positions back to the full files whose flags get set.
+class Myers {
+public:
+    Myers(const vector<uint32_t> &a, const vector<uint32_t> &b, const vector<size_t> &at,
+          const vector<size_t> &bt, vector<char> &a_changed, vector<char> &b_changed)
+        : A(a), B(b), a_to(at), b_to(bt), ca(a_changed), cb(b_changed) {
+        // Like GNU diff: past ~sqrt(N) edits on one split, settle for a
+        // good split instead of the best one
+        too_expensive = max<long>(256, (long)sqrt((double)(a.size() + b.size())));
+    }
+
+    void compare(long a0, long a1, long b0, long b1) {
+        while (a0 < a1 && b0 < b1 && A[a0] == B[b0]) ++a0, ++b0;
+        while (a0 < a1 && b0 < b1 && A[a1 - 1] == B[b1 - 1]) --a1, --b1;
+        long x, y;
+        if (a0 == a1 || b0 == b1 || !bisect(a0, a1, b0, b1, x, y)) {
+            for (long i = a0; i < a1; ++i) ca[a_to[i]] = 1;
+            for (long j = b0; j < b1; ++j) cb[b_to[j]] = 1;
+            return;
+        }
+        compare(a0, x, b0, y);
+        compare(x, a1, y, b1);
+    }
+
+private:
+    // Where the forward and backward searches for a shortest edit script
+    // of a[a0,a1) -> b[b0,b1) first overlap (or, when that's too costly to
+    // find, the furthest forward one got); false if nothing matches
+    bool bisect(long a0, long a1, long b0, long b1, long &split_a, long &split_b) {
+        const long n = a1 - a0, m = b1 - b0;
+        const long max_d = (n + m + 1) / 2, off = max_d, len = 2 * max_d + 2;
+        v1.assign(len, -1);
+        v2.assign(len, -1);
+        v1[off + 1] = 0;
+        v2[off + 1] = 0;
+        const long delta = n - m;
+        const bool front = (delta & 1) != 0;  // odd: forward paths close the overlap
+        long k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+        long best_x = 0, best_y = 0;
+        for (long d = 0; d < max_d; ++d) {
+            if (d > too_expensive) {
+                if (best_x + best_y == 0 || (best_x == n && best_y == m)) return false;
+                split_a = a0 + best_x;
+                split_b = b0 + best_y;
+                return true;
+            }
+            for (long k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+                long k1o = off + k1;
+                long x1 = (k1 == -d || (k1 != d && v1[k1o - 1] < v1[k1o + 1])) ? v1[k1o + 1] : v1[k1o - 1] + 1;
+                long y1 = x1 - k1;
+                while (x1 < n && y1 < m && A[a0 + x1] == B[b0 + y1]) ++x1, ++y1;
+                v1[k1o] = x1;
+                if (x1 > n) {
+                    k1end += 2;
+                } else if (y1 > m) {
+                    k1start += 2;
+                } else if (x1 + y1 > best_x + best_y) {
+                    best_x = x1;
+                    best_y = y1;
+                }
+                if (x1 <= n && y1 <= m && front) {
+                    long k2o = off + delta - k1;
+                    if (k2o >= 0 && k2o < len && v2[k2o] != -1 && x1 >= n - v2[k2o]) {
+                        split_a = a0 + x1;
+                        split_b = b0 + y1;
+                        return true;
+                    }
+                }
+            }
+            for (long k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+                long k2o = off + k2;
+                long x2 = (k2 == -d || (k2 != d && v2[k2o - 1] < v2[k2o + 1])) ? v2[k2o + 1] : v2[k2o - 1] + 1;
+                long y2 = x2 - k2;
+                while (x2 < n && y2 < m && A[a1 - x2 - 1] == B[b1 - y2 - 1]) ++x2, ++y2;
+                v2[k2o] = x2;
+                if (x2 > n) {
+                    k2end += 2;
+                } else if (y2 > m) {
+                    k2start += 2;
+                } else if (!front) {
+                    long k1o = off + delta - k2;
+                    if (k1o >= 0 && k1o < len && v1[k1o] != -1) {
+                        long x1 = v1[k1o];
+                        if (x1 >= n - x2) {
+                            split_a = a0 + x1;
+                            split_b = b0 + off + x1 - k1o;
+                            return true;
+                        }
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    const vector<uint32_t> &A, &B;
+    const vector<size_t> &a_to, &b_to;
+    vector<char> &ca, &cb;
+    vector<long> v1, v2;
+    long too_expensive;
+};
+
+static void append_range(string &out, size_t start, size_t count) {
+    // 1-based; an empty range names the line before it
+    if (count == 1) {
+        out += to_string(start + 1);
+    } else {
+        out += to_string(count == 0 ? start : start + 1);
+        out += ',';
+        out += to_string(count);
+    }
+}
+
+// Flag the lines of a[a0,a1) and b[b0,b1) that aren't in a longest common
+// subsequence of the two. false if two lines the diff matched turn out
+// different after all (a hash collision).
+static bool mark_changes(const char *a, const vector<size_t> &a_bounds, size_t a0, size_t a1,
+                         const char *b, const vector<size_t> &b_bounds, size_t b0, size_t b1,
+                         uint64_t seed, vector<char> &a_changed, vector<char> &b_changed) {
+    vector<uint64_t> a_hashes, b_hashes;
+    hash_lines(a, a_bounds, a0, a1, seed, a_hashes);
+    hash_lines(b, b_bounds, b0, b1, seed, b_hashes);
+    LineTable table(a_hashes.size() + b_hashes.size());
+    vector<uint32_t> a_ids, b_ids;
+    table.intern(a_hashes, a_ids);
+    table.intern(b_hashes, b_ids);
+
+    // A line missing from the other side is a change whatever else happens
+    vector<char> in_a(table.size()), in_b(table.size());
+    for (uint32_t id : a_ids) in_a[id] = 1;
+    for (uint32_t id : b_ids) in_b[id] = 1;
+    vector<uint32_t> a_keep, b_keep;
+    vector<size_t> a_at, b_at;
+    a_keep.reserve(a_ids.size());
+    a_at.reserve(a_ids.size());
+    b_keep.reserve(b_ids.size());
+    b_at.reserve(b_ids.size());
+    for (size_t i = a0; i < a1; ++i) {
+        uint32_t id = a_ids[i - a0];
+        a_changed[i] = !in_b[id];
+        if (in_b[id]) a_keep.push_back(id), a_at.push_back(i);
+    }
+    for (size_t j = b0; j < b1; ++j) {
+        uint32_t id = b_ids[j - b0];
+        b_changed[j] = !in_a[id];
+        if (in_a[id]) b_keep.push_back(id), b_at.push_back(j);
+    }
+    Myers(a_keep, b_keep, a_at, b_at, a_changed, b_changed).compare(0, a_keep.size(), 0, b_keep.size());
+
+    // Unchanged lines pair up in order; one pass over both checks them
+    for (size_t i = a0, j = b0; i < a1 && j < b1;) {
+        if (a_changed[i]) {
+            ++i;
+        } else if (b_changed[j]) {
+            ++j;
+        } else {
+            size_t len = a_bounds[i + 1] - a_bounds[i];
+            if (len != b_bounds[j + 1] - b_bounds[j] || memcmp(a + a_bounds[i], b + b_bounds[j], len) != 0)
+                return false;
+            ++i, ++j;
+        }
+    }
+    return true;
+}
+
+string unified_diff(const char *a, size_t a_len, const char *b, size_t b_len, const string &label_a,
+                    const string &label_b, unsigned context, DiffStats *stats) {
+    if (a_len == b_len && (a_len == 0 || memcmp(a, b, a_len) == 0)) return "";
+
+    // Identical head and tail, cut back to whole lines, need no diffing,
+    // and only the lines context reaches into are split out of them: an
+    // edit in a big file costs little more than a memcmp of it
+    auto line_start = [](const char *data, size_t pos) { return pos == 0 || data[pos - 1] == '\n'; };
+    size_t head = common_prefix(a, b, min(a_len, b_len));
+    while (!line_start(a, head)) --head;
+    size_t tail = common_suffix(a + a_len, b + b_len, min(a_len, b_len) - head);
+    while (tail > 0 && !(line_start(a, a_len - tail) && line_start(b, b_len - tail))) --tail;
+    size_t from = head, lead = 0;
+    while (lead < context && from > 0) {
+        for (--from; !line_start(a, from); --from) {}
+        ++lead;
+    }
+    auto context_end = [context](const char *data, size_t pos, size_t len) {
+        for (unsigned n = 0; n < context && pos < len; ++n) {
+            const void *nl = memchr(data + pos, '\n', len - pos);
+            pos = nl ? static_cast<const char*>(nl) - data + 1 : len;
+        }
+        return pos;
+    };
+
+    // Line i of the window is line base + i of either file
+    const size_t base = count_newlines(a, from);
+    vector<size_t> a_bounds, b_bounds;
+    split_lines(a, from, context_end(a, a_len - tail, a_len), a_bounds);
+    split_lines(b, from, context_end(b, b_len - tail, b_len), b_bounds);
+    const size_t na = a_bounds.size() - 1, nb = b_bounds.size() - 1;
+    size_t a_mid_end = lower_bound(a_bounds.begin(), a_bounds.end(), a_len - tail) - a_bounds.begin();
+    size_t b_mid_end = lower_bound(b_bounds.begin(), b_bounds.end(), b_len - tail) - b_bounds.begin();
+
+    vector<char> a_changed(na), b_changed(nb);
+    bool matched = false;
+    for (uint64_t seed = 0x9e3779b97f4a7c15ULL; !matched && seed < 0x9e3779b97f4a7c18ULL; ++seed) {
+        matched = mark_changes(a, a_bounds, lead, a_mid_end, b, b_bounds, lead, b_mid_end, seed,
+                               a_changed, b_changed);
+    }
+    if (!matched) {
+        // Can't happen in practice; everything changed is still a true diff
+        fill(a_changed.begin() + lead, a_changed.begin() + a_mid_end, 1);
+        fill(b_changed.begin() + lead, b_changed.begin() + b_mid_end, 1);
+    }
+
+    // Runs of changes, at matching positions in both files
+    struct Block {
+        size_t a, b, a_len, b_len;
+    };
+    vector<Block> blocks;
+    for (size_t i = 0, j = 0; i < na || j < nb;) {
+        if ((i < na && a_changed[i]) || (j < nb && b_changed[j])) {
+            Block bl{i, j, 0, 0};
+            while (i < na && a_changed[i]) ++i;
+            while (j < nb && b_changed[j]) ++j;
+            bl.a_len = i - bl.a;
+            bl.b_len = j - bl.b;
+            blocks.push_back(bl);
+        } else {
+            ++i, ++j;
+        }
+    }
+    if (blocks.empty()) return "";
+
+    string out = "--- " + label_a + "\n+++ " + label_b + "\n";
+    auto emit = [&](char tag, const char *data, const vector<size_t> &bounds, size_t line) {
+        out += tag;
+        out.append(data + bounds[line], bounds[line + 1] - bounds[line]);
+        if (out.back() != '\n') out += "\n\\ No newline at end of file\n";
+    };
+    for (size_t first = 0; first < blocks.size();) {
+        // Blocks whose contexts touch share a hunk
+        size_t last = first;
+        while (last + 1 < blocks.size() &&
+               blocks[last + 1].a - (blocks[last].a + blocks[last].a_len) <= 2 * (size_t)context)
+            ++last;
+        const Block &f = blocks[first], &l = blocks[last];
+        size_t before = min<size_t>(context, f.a);
+        size_t a_start = f.a - before, b_start = f.b - before;
+        size_t trail = min<size_t>(context, na - (l.a + l.a_len));
+        size_t a_end = l.a + l.a_len + trail, b_end = l.b + l.b_len + trail;
+
+        out += "@@ -";
+        append_range(out, base + a_start, a_end - a_start);
+        out += " +";
+        append_range(out, base + b_start, b_end - b_start);
+        out += " @@\n";
+        size_t i = a_start;
+        for (size_t k = first; k <= last; ++k) {
+            const Block &bl = blocks[k];
+            for (; i < bl.a; ++i) emit(' ', a, a_bounds, i);
+            for (size_t n = 0; n < bl.a_len; ++n) emit('-', a, a_bounds, bl.a + n);
+            for (size_t n = 0; n < bl.b_len; ++n) emit('+', b, b_bounds, bl.b + n);
+            i = bl.a + bl.a_len;
+            if (stats) {
+                stats->removed += bl.a_len;
+                stats->added += bl.b_len;
+            }
+        }
+        for (; i < a_end; ++i) emit(' ', a, a_bounds, i);
+        first = last + 1;
+    }
+    return out;
+}
+
+// Whole file mapped read-only; empty (and fine) for a missing path
+class MappedFile {
+public:
+    ~MappedFile() {
+        if (base) munmap(base, len);
+    }
+    bool open(const string &path) {
+        if (path.empty()) return true;
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ok = false;
+            } else {
+                base = p;
+                len = st.st_size;
+                madvise(base, len, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+        return ok;
+    }
+    const char *data() const { return base ? static_cast<const char*>(base) : ""; }
+    size_t size() const { return len; }
+
+private:
+    void *base = nullptr;
+    size_t len = 0;
+};
+
+static string diff_pair(const DiffPair &p, unsigned context, DiffStats &stats) {
+    MappedFile old_map, new_map;
+    if (!old_map.open(p.old_file) || !new_map.open(p.new_file)) return "Can't read " + p.path + "\n";
+    string label_a = p.old_file.empty() ? "/dev/null" : "a/" + p.path;
+    string label_b = p.new_file.empty() ? "/dev/null" : "b/" + p.path;
+    if (looks_binary(old_map.data(), old_map.size()) || looks_binary(new_map.data(), new_map.size())) {
+        bool same = old_map.size() == new_map.size() &&
+                    (old_map.size() == 0 || memcmp(old_map.data(), new_map.data(), old_map.size()) == 0);
+        return same ? "" : "Binary files " + label_a + " and " + label_b + " differ\n";
+    }
+    return unified_diff(old_map.data(), old_map.size(), new_map.data(), new_map.size(), label_a, label_b,
+                        context, &stats);
+}
+
+vector<string> diff_files(const vector<DiffPair> &pairs, unsigned context, DiffStats *stats) {
+    vector<string> result(pairs.size());
+    vector<DiffStats> counts(pairs.size());
+    size_t workers = thread::hardware_concurrency();
+    if (workers == 0) workers = 1;
+    if (workers > pairs.size()) workers = pairs.size();
+
+    atomic<size_t> next{0};
+    auto work = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < pairs.size()) result[i] = diff_pair(pairs[i], context, counts[i]);
+    };
+    vector<thread> pool;
+    for (size_t t = 1; t < workers; ++t) pool.emplace_back(work);
+    if (!pairs.empty()) work();
+    for (auto &t : pool) t.join();
+
+    if (stats) {
+        for (const auto &c : counts) {
+            stats->added += c.added;
+            stats->removed += c.removed;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,47 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Line diffs for `vcp diff`, printed in unified format.
+//
+// The identical head and tail of the two versions are found with memcmp
+// and skipped. The rest is split into lines with memchr (vectorised in
+// libc) and every distinct line is interned to a small integer by its
+// hash, so the diff itself only compares integers. Lines that don't occur
+// on the other side can't be part of any match and are set aside, and
+// Myers' O(ND) algorithm (its linear space, middle snake form) finds a
+// shortest edit script for what's left, settling for a near-shortest one
+// when that gets expensive, as GNU diff does.
+
+// Git's test: a NUL byte in the first 8000 bytes
+bool looks_binary(const char *data, size_t len);
+
+struct DiffStats {
+    size_t added = 0;
+    size_t removed = 0;
+};
+
+// Unified diff turning a into b with context lines around each change,
+// headed "--- <label_a>" / "+++ <label_b>"; "" if they're the same
+std::string unified_diff(const char *a, size_t a_len, const char *b, size_t b_len,
+                         const std::string &label_a, const std::string &label_b,
+                         unsigned context = 3, DiffStats *stats = nullptr);
+
+// One file to diff. An empty old_file/new_file stands for a file that
+// doesn't exist on that side (added/deleted).
+struct DiffPair {
+    std::string path;
+    std::string old_file;
+    std::string new_file;
+};
+
+// Diff each pair across worker threads; result i is the output for
+// pairs[i] ("" if unchanged, a "Binary files ..." line for binaries).
+// stats (if given) gets the totals.
+std::vector<std::string> diff_files(const std::vector<DiffPair> &pairs, unsigned context = 3,
+                                    DiffStats *stats = nullptr);
+
+#endif // DIFF_H
@@ -1,47 +1,243 @@
 // A bit rough around the edges, but gets the job done
 // Client for sending project files to remote server
-// TODO: Add proper timeout handling for slow networks
 
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
-#include <iomanip>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <filesystem>
 #include <regex>
+#include <set>
+#include <unordered_set>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <vector>
 #include "FTP.h"
+#include "Net.h"
+#include "Delta.h"
+#include "FileReader.h"
+#include "Merkle.h"
+#include "ObjectCache.h"
+#include "Pipeline.h"
 using namespace std;
 namespace fs = std::filesystem;
 
 #define SERVER_PORT 8080  
-#define BUFFER_SIZE 1024 
-#define TRACKER_FILE ".vcp/tracker.txt"
 
 // file-local helper used by clone/list routines
 static bool recv_all(int sock, char *buffer, size_t len) {
     size_t total = 0;
     while(total < len) {
-        ssize_t r = recv(sock, buffer + total, len - total, 0);
+        ssize_t r = net_recv(sock, buffer + total, len - total);
         if(r <= 0) return false;
         total += r;
     }
     return true;
 }
 
-// Implementations for FileTransfer declared in FTP.h
+// Protocol values queued in a buffer, to go out in one send
+static void append_u32(string &buf, uint32_t v) {
+    v = htonl(v);
+    buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+static void append_string(string &buf, const string &str) {
+    append_u32(buf, str.size());
+    buf.append(str);
+}
+
+static bool send_buffer(int sock, const string &buf) {
+    for(size_t off = 0; off < buf.size();) {
+        ssize_t n = net_send(sock, buf.data() + off, buf.size() - off);
+        if(n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+static int env_seconds(const char *name, int fallback, ostream &err) {
+    const char *env = getenv(name);
+    if(!env || !*env) return fallback;
+    char *end;
+    long v = strtol(env, &end, 10);
+    if(*end != '\0' || v < 0) {
+        err << "Ignoring bad " << name << "=" << env << " (want seconds)\n";
+        return fallback;
+    }
+    return (int)v;
+}
+
+// Server to talk to: $VCP_SERVER ("host[:port]"), local server by default
+static string server_address() {
+    const char *env = getenv("VCP_SERVER");
+    return env && *env ? env : "127.0.0.1";
+}
+
+// $VCP_TIMEOUT is how long a stalled transfer waits before giving up and
+// $VCP_KEEPALIVE how long an idle connection goes unprobed (seconds, 0 = never).
+static int connect_server(const string &addr, ostream &err) {
+    int sock = net_connect(addr, SERVER_PORT);
+    if(sock < 0) {
+        err << "Connection to " << addr << " failed - make sure server is running\n";
+        return -1;
+    }
+    net_tune(sock, env_seconds("VCP_TIMEOUT", 60, err), env_seconds("VCP_KEEPALIVE", 30, err));
+
+    // VCP_TLS=1 (or VCP_TLS_CA=<file> for a private CA) wraps it in TLS;
+    // a Unix socket never leaves the machine, so it goes as it is
+    const char *tls = getenv("VCP_TLS");
+    const char *ca = getenv("VCP_TLS_CA");
+    if(((tls && *tls && string(tls) != "0") || (ca && *ca)) && !net_is_local(sock)) {
+        string host;
+        int port;
+        parse_host_port(addr, host, port, SERVER_PORT);
+        // One line with the reason, so it's what a Reporter's last_error() says
+        ostringstream why;
+        if(!tls_init_client(ca ? ca : "", why) || !tls_connect(sock, host, why)) {
+            string reason, line;
+            istringstream lines(why.str());
+            while(getline(lines, line)) reason += (reason.empty() ? ": " : "; ") + line;
+            err << "Secure connection to " << addr << " failed" << reason << "\n";
+            net_close(sock);
+            return -1;
+        }
+    }
+    return sock;
+}
+
+ConnectionPool::ConnectionPool(size_t max_idle, int idle_seconds)
+    : max_idle(max_idle), idle_time(idle_seconds) {}
+
+ConnectionPool::~ConnectionPool() {
+    for(const auto &c : idle) net_close(c.sock);
+}
+
+// Closes connections idle too long, so they don't hold one of the
+// server's client slots (it ends idle sessions itself after a while)
+void ConnectionPool::expire() {
+    auto now = chrono::steady_clock::now();
+    for(auto it = idle.begin(); it != idle.end();) {
+        if(now - it->since < idle_time) {
+            ++it;
+            continue;
+        }
+        net_close(it->sock);
+        it = idle.erase(it);
+    }
+}
+
+int ConnectionPool::take(ostream &err) {
+    string addr = server_address();
+    bool sessions_known = false, session_ok = false;
+    {
+        lock_guard<mutex> hold(mutex_);
+        expire();
+        // Most recently used first; one the server has since closed reads
+        // as ready (EOF) and is dropped
+        for(size_t i = idle.size(); i-- > 0;) {
+            if(idle[i].addr != addr) continue;
+            int sock = idle[i].sock;
+            idle.erase(idle.begin() + i);
+            if(net_readable(sock, 0)) {
+                net_close(sock);
+                continue;
+            }
+            lent[sock] = addr;
+            return sock;
+        }
+        auto it = sessions.find(addr);
+        if(it != sessions.end()) {
+            sessions_known = true;
+            session_ok = it->second;
+        }
+    }
+
+    int sock = connect_server(addr, err);
+    if(sock < 0 || (sessions_known && !session_ok)) return sock;
+    string request;
+    append_string(request, "SESSION");
+    uint32_t ack = 0;
+    if(!send_buffer(sock, request) || !recv_all(sock, reinterpret_cast<char*>(&ack), sizeof(ack))) {
+        // An older server may just hang up on a command it doesn't know
+        ack = 0;
+    }
+    bool ok = ntohl(ack) == 1;
+    lock_guard<mutex> hold(mutex_);
+    sessions[addr] = ok;
+    if(ok) {
+        lent[sock] = addr;
+        return sock;
+    }
+    net_close(sock);
+    return connect_server(addr, err);
+}
+
+void ConnectionPool::give_back(int sock) {
+    lock_guard<mutex> hold(mutex_);
+    auto it = lent.find(sock);
+    if(it == lent.end()) {
+        net_close(sock);  // no session: the server is done with it
+        return;
+    }
+    idle.push_back(Idle{sock, it->second, chrono::steady_clock::now()});
+    lent.erase(it);
+    expire();
+    while(idle.size() > max_idle) {
+        net_close(idle.front().sock);
+        idle.erase(idle.begin());
+    }
+}
+
+void ConnectionPool::discard(int sock) {
+    lock_guard<mutex> hold(mutex_);
+    lent.erase(sock);
+    net_close(sock);
+}
+
+FileTransfer::FileTransfer(const string &dir, Reporter *rep, ConnectionPool *pool)
+    : dir(dir), rep(rep ? rep : &console), pool(pool) {}
+
+string FileTransfer::local(const string &rel) const {
+    return dir.empty() ? rel : dir + "/" + rel;
+}
+
+int FileTransfer::open_connection() {
+    return pool ? pool->take(rep->err()) : connect_server(server_address(), rep->err());
+}
+
+void FileTransfer::done_with(int sock) {
+    if(pool) pool->give_back(sock);
+    else net_close(sock);
+}
+
+void FileTransfer::drop(int sock) {
+    if(pool) pool->discard(sock);
+    else net_close(sock);
+}
+
+bool FileTransfer::recv_string(int sock, string &str) {
+    uint32_t len;
+    if(!recv_all(sock, reinterpret_cast<char*>(&len), sizeof(len))) return false;
+    len = ntohl(len);
+    str.assign(len, '\0');
+    return len == 0 || recv_all(sock, &str[0], len);
+}
+
 bool FileTransfer::send_chunk(int sock, const void* data, size_t length) {
     size_t bytes_sent = 0;
     while(bytes_sent < length) {
-        ssize_t result = send(sock,
-                            static_cast<const char*>(data) + bytes_sent,
-                            length - bytes_sent,
-                            0);
+        ssize_t result = net_send(sock,
+                                static_cast<const char*>(data) + bytes_sent,
+                                length - bytes_sent);
         if(result <= 0) {
-            cerr << "Network hiccup sending data (err " << errno << ")\n";
+            rep->err() << "Network hiccup sending data (err " << errno << ")\n";
             return false;
         }
         bytes_sent += result;
@@ -59,295 +255,905 @@ void FileTransfer::send_string(int sock, const string &str) {
     }
 }
 
-bool FileTransfer::pump_file(int sock, const string &path) {
-    ifstream file(path, ios::binary | ios::ate);
-    if(!file) {
-        cerr << "Couldn't open " << path << " - skipping\n";
+bool FileTransfer::get_confirmation(int sock) {
+    uint32_t response;
+    ssize_t bytes = net_recv(sock, &response, sizeof(response));
+    if(bytes != sizeof(response)) {
+        rep->err() << "Server hung up during confirmation!\n";
         return false;
     }
+    return ntohl(response) == 1;
+}
 
-    auto file_size = file.tellg();
-    file.seekg(0);
-
-    uint64_t net_size = htonll(file_size);
-    if(!send_chunk(sock, &net_size, sizeof(net_size))) {
-        cerr << "Size header failed for " << path << endl;
+// Send a file as a delta against the server's version of it (see Delta.h);
+// sent gets the bytes that went over the wire
+bool FileTransfer::send_delta(int sock, const ManifestEntry &f, const BlockSignature &sig,
+                              HashAlgo algo, uint64_t &sent) {
+    int fd = open(local(f.path).c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        rep->err() << "Couldn't read " << f.path << " - aborting\n";
+        if(fd >= 0) close(fd);
         return false;
     }
-
-    char buffer[BUFFER_SIZE];
-    uint64_t total_size = static_cast<uint64_t>(file_size);
-    uint64_t sent_so_far = 0;
-    while(file_size > 0) {
-        size_t read_size;
-        if ((streamsize)BUFFER_SIZE < file_size)
-            read_size  = (streamsize)BUFFER_SIZE;
-        else
-            read_size = file_size;
-
-        file.read(buffer, read_size);
-        if(!send_chunk(sock, buffer, read_size)) {
-            cerr << "Aborting " << path << " transfer mid-stream\n";
+    uint64_t size = st.st_size;
+    const char *data = nullptr;
+    if(size > 0) {
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED) {
+            rep->err() << "Couldn't map " << f.path << " - aborting\n";
+            close(fd);
             return false;
         }
-        sent_so_far += read_size;
-        double pct = (total_size > 0) ? (100.0 * sent_so_far / total_size) : 100.0;
-        cout << "Uploading: " << path << " - " << sent_so_far << "/" << total_size
-             << " bytes (" << fixed << setprecision(1) << pct << "% )\r";
-        cout.flush();
+        data = static_cast<const char*>(map);
+    }
+    close(fd);
 
-        file_size -= read_size;
+    uint64_t net_size = htonll(size);
+    DeltaStats stats;
+    sent = sizeof(net_size);
+    bool ok = send_chunk(sock, &net_size, sizeof(net_size)) &&
+              encode_delta(data, size, sig, algo, [&](const void *p, size_t len) {
+                  sent += len;
+                  return send_chunk(sock, p, len);
+              }, &stats);
+    if(ok) {
+        rep->out() << "Delta: " << f.path << " - " << stats.literal << " of " << size
+             << " bytes changed, " << sent << " sent\n";
+        Hasher hasher(algo);
+        hasher.update(data, size);
+        if(hasher.final_hex() != f.hash) {
+            rep->out() << "Note: " << f.path << " changed while uploading\n";
+        }
+    } else {
+        rep->err() << "Aborting " << f.path << " delta mid-stream\n";
     }
-    cout << endl;
-    return true;
+    if(data) munmap(const_cast<char*>(data), size);
+    return ok;
 }
 
-bool FileTransfer::get_confirmation(int sock) {
-    uint32_t response;
-    ssize_t bytes = recv(sock, &response, sizeof(response), 0);
-    if(bytes != sizeof(response)) {
-        cerr << "Server hung up during confirmation!\n";
-        return false;
+// Every file is offered as (path, hash, size) up front and the server
+// answers all the offers at once, asking only for content it hasn't stored
+// for any project yet. The files it wants then go out back to back, read
+// ahead by a FilePrefetcher so the disk and the socket are busy together.
+// Files of at least delta_min bytes (0 = never) the server has an older
+// version of go as deltas instead. Over a Unix socket the server is on
+// this machine, so it gets open files to read rather than their bytes.
+int FileTransfer::push_files(const string &project_name, const vector<ManifestEntry> &files,
+                             HashAlgo algo, uint64_t delta_min, size_t unchanged) {
+    int sock = open_connection();
+    if(sock < 0) return 1;
+    bool same_host = net_is_local(sock);
+    if(same_host) delta_min = 0;  // reading the whole file is as cheap as a delta
+
+    try {
+        uint64_t net_delta_min = htonll(delta_min);
+        send_string(sock, "PUSH");
+        send_string(sock, project_name);
+        send_string(sock, hash_algo_name(algo));
+        if(!send_chunk(sock, &net_delta_min, sizeof(net_delta_min))) {
+            throw runtime_error("Failed to send delta cutoff");
+        }
+    } catch(const exception &e) {
+        rep->err() << "Project name send failed: " << e.what() << endl;
+        drop(sock);
+        return 1;
     }
-    return ntohl(response) == 1;
-}
 
-int FileTransfer::submit() {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock < 0) {
-        cerr << "Something went wrong\n";
+    if(!get_confirmation(sock)) {
+        rep->err() << "Server rejected project '" << project_name << "'\n";
+        drop(sock);
         return 1;
     }
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-    if(connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        cerr << "Connection failed - make sure server is running\n";
-        close(sock);
+
+    // All offers in one write, all replies in one read
+    string offers;
+    for(const auto& f : files) {
+        uint64_t net_size = htonll(f.size);
+        append_string(offers, f.path);
+        append_string(offers, f.hash);
+        offers.append(reinterpret_cast<const char*>(&net_size), sizeof(net_size));
+    }
+    append_string(offers, "");
+    vector<uint32_t> replies(files.size());
+    if(!send_chunk(sock, offers.data(), offers.size()) ||
+       !recv_all(sock, reinterpret_cast<char*>(replies.data()), replies.size() * sizeof(uint32_t))) {
+        rep->err() << "Server hung up while going through the file list\n";
+        drop(sock);
         return 1;
     }
 
-    ifstream tracker(TRACKER_FILE);
-    if(!tracker) {
-        cerr << "Can't find tracker file \n";
-        close(sock);
+    vector<const ManifestEntry*> needed, deltas;
+    size_t skipped = 0;
+    for(size_t i = 0; i < files.size(); ++i) {
+        uint32_t reply = ntohl(replies[i]);
+        if(reply == 0) rep->err() << "Server rejected " << files[i].path << "\n";
+        else if(reply == 2) skipped++;
+        else if(reply == 3) deltas.push_back(&files[i]);
+        else needed.push_back(&files[i]);
+    }
+    // A block signature of the server's version follows for every delta
+    vector<BlockSignature> sigs(deltas.size());
+    for(auto& sig : sigs) {
+        if(!read_signature([this, sock](void *p, size_t len) {
+               return recv_all(sock, static_cast<char*>(p), len);
+           }, sig)) {
+            rep->err() << "Server hung up while sending block signatures\n";
+            drop(sock);
+            return 1;
+        }
+    }
+
+    if(same_host) {
+        if(!pass_files(sock, needed)) {
+            drop(sock);
+            return 1;
+        }
+        if(!get_confirmation(sock)) {
+            rep->err() << "Server reported transfer issues\n";
+            drop(sock);
+            return 1;
+        }
+        rep->out() << "All files delivered successfully! (" << needed.size() << " handed to the local server; "
+                   << skipped + unchanged << " already on server)\n";
+        done_with(sock);
+        return 0;
+    }
+
+    vector<string> paths;
+    for(const auto *f : needed) paths.push_back(local(f->path));
+    FilePrefetcher reader(paths);
+    Hasher hasher(algo);
+    uint64_t uploaded_bytes = 0, sent_so_far = 0;
+    FilePrefetcher::Chunk c;
+    while(reader.next(c)) {
+        const ManifestEntry &f = *needed[c.file];
+        // The server expects exactly the bytes it asked for, in order; a
+        // file we can't read would leave the stream out of step, so give up
+        if(c.error) {
+            rep->err() << "Couldn't read " << f.path << " - aborting\n";
+            drop(sock);
+            return 1;
+        }
+        if(c.first) {
+            uint64_t net_size = htonll(c.file_size);
+            hasher.reset();
+            sent_so_far = 0;
+            if(!send_chunk(sock, &net_size, sizeof(net_size))) {
+                rep->err() << "Size header failed for " << f.path << endl;
+                drop(sock);
+                return 1;
+            }
+        }
+        hasher.update(c.data, c.len);
+        if(!send_chunk(sock, c.data, c.len)) {
+            rep->err() << "Aborting " << f.path << " transfer mid-stream\n";
+            drop(sock);
+            return 1;
+        }
+        sent_so_far += c.len;
+        rep->transfer(ProgressEvent::UPLOAD, f.path, sent_so_far, c.file_size);
+        if(c.last) {
+            if(hasher.final_hex() != f.hash) {
+                rep->out() << "Note: " << f.path << " changed while uploading\n";
+            }
+            uploaded_bytes += c.file_size;
+        }
+        reader.release(c);
+    }
+    for(size_t i = 0; i < deltas.size(); ++i) {
+        uint64_t sent;
+        if(!send_delta(sock, *deltas[i], sigs[i], algo, sent)) {
+            drop(sock);
+            return 1;
+        }
+        uploaded_bytes += sent;
+    }
+
+    if(!get_confirmation(sock)) {
+        rep->err() << "Server reported transfer issues\n";
+        drop(sock);
         return 1;
     }
+    rep->out() << "All files delivered successfully! (" << needed.size() + deltas.size() << " uploaded, "
+               << uploaded_bytes << " bytes; " << skipped + unchanged << " already on server)\n";
+    done_with(sock);
+    return 0;
+}
 
-    string project_name;
-    getline(tracker, project_name);
+// Local submit: per file its u64 size, with the open file attached, for
+// the server to copy from directly
+bool FileTransfer::pass_files(int sock, const vector<const ManifestEntry*> &files) {
+    for(const auto *f : files) {
+        int fd = open(local(f->path).c_str(), O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0) {
+            // Same as a stream: the server is waiting for this one, in order
+            rep->err() << "Couldn't read " << f->path << " - aborting\n";
+            if(fd >= 0) close(fd);
+            return false;
+        }
+        uint64_t net_size = htonll(st.st_size);
+        bool sent = net_send_fd(sock, fd, &net_size, sizeof(net_size));
+        close(fd);
+        if(!sent) {
+            rep->err() << "Couldn't hand " << f->path << " to the server\n";
+            return false;
+        }
+        rep->out() << "Passed: " << f->path << " (" << st.st_size << " bytes)\n";
+    }
+    return true;
+}
+
+// Compare our Merkle tree with the server's copy of the project, asking for
+// one level of differing directories per round trip (see Merkle.h).
+// 1 = compared, 0 = the server has nothing to compare against (offer
+// everything), -1 = couldn't reach the server
+int FileTransfer::tree_changes(const string &project_name, const vector<ManifestEntry> &files,
+                                HashAlgo algo, vector<string> &changed, size_t &rounds) {
+    Manifest m;
+    m.algo = algo;
+    for(const auto& f : files) m.files[f.path] = f;
+    MerkleTree tree;
+    tree.build(m);
+
+    int sock = open_connection();
+    if(sock < 0) return -1;
+    string remote_root;
+    try {
+        send_string(sock, "TREE");
+        send_string(sock, project_name);
+        send_string(sock, hash_algo_name(algo));
+    } catch(const exception &e) {
+        drop(sock);
+        return 0;
+    }
+    if(!get_confirmation(sock) || !recv_string(sock, remote_root)) {
+        drop(sock);
+        return 0;
+    }
+    auto fetch = [this, sock](const vector<string> &dirs, vector<MerkleTree::Children> &listings) {
+        string request;
+        append_u32(request, dirs.size());
+        for(const auto& d : dirs) append_string(request, d);
+        if(!send_chunk(sock, request.data(), request.size())) return false;
+        listings.assign(dirs.size(), MerkleTree::Children());
+        for(auto& listing : listings) {
+            uint32_t n;
+            if(!recv_all(sock, reinterpret_cast<char*>(&n), sizeof(n))) return false;
+            for(n = ntohl(n); n > 0; --n) {
+                string name;
+                MerkleNode node;
+                uint32_t is_dir;
+                if(!recv_string(sock, name) || !recv_string(sock, node.hash) ||
+                   !recv_all(sock, reinterpret_cast<char*>(&is_dir), sizeof(is_dir)))
+                    return false;
+                node.dir = ntohl(is_dir) != 0;
+                listing[name] = node;
+            }
+        }
+        return true;
+    };
+    bool ok = merkle_diff(tree, remote_root, fetch, changed, &rounds);
+    uint32_t done = 0;
+    if(ok && send_chunk(sock, &done, sizeof(done))) done_with(sock);
+    else drop(sock);
+    return ok ? 1 : 0;
+}
+
+// Offers only what differs from the server's copy when the trees can be
+// compared, everything otherwise
+int FileTransfer::submit(const string &project_name, const vector<ManifestEntry> &files,
+                         HashAlgo algo, uint64_t delta_min) {
     std::regex valid_name("^[A-Za-z0-9._-]{1,100}$");
     if (!std::regex_match(project_name, valid_name)) {
-        cerr << "Invalid project name in tracker: " << project_name << "\n";
-        close(sock);
+        rep->err() << "Invalid project name in tracker: " << project_name << "\n";
         return 1;
     }
-    if(project_name.empty()) {
-        cerr << "Tracker file corrupted - missing project name\n";
-        close(sock);
-        return 1;
+
+    vector<string> changed;
+    size_t rounds = 0;
+    int compared = tree_changes(project_name, files, algo, changed, rounds);
+    if(compared < 0) return 1;
+    if(compared == 0) {
+        changed.clear();
+        return push_files(project_name, files, algo, delta_min, 0);
     }
+    if(changed.empty()) {
+        rep->out() << "Server is already up to date (" << files.size() << " files)\n";
+        return 0;
+    }
+    unordered_set<string> differs(changed.begin(), changed.end());
+    vector<ManifestEntry> subset;
+    for(const auto& f : files) {
+        if(differs.count(f.path)) subset.push_back(f);
+    }
+    rep->out() << subset.size() << " of " << files.size() << " files differ from the server ("
+         << rounds << " round trips to compare)\n";
+    return push_files(project_name, subset, algo, delta_min, files.size() - subset.size());
+}
 
+// 1 = got it, 0 = server refused, -1 = couldn't reach the server
+int FileTransfer::fetch_manifest(const string &project_name, const vector<string> &paths, Manifest &m) {
+    int sock = open_connection();
+    if(sock < 0) return -1;
     try {
-        send_string(sock, "SUBMIT");
+        send_string(sock, "MANIFEST");
         send_string(sock, project_name);
+        for(const auto &p : paths) send_string(sock, p);
+        send_string(sock, "");
     } catch(const exception &e) {
-        cerr << "Project name send failed: " << e.what() << endl;
-        close(sock);
-        return 1;
+        drop(sock);
+        return -1;
     }
+    string algo;
+    if(!get_confirmation(sock) || !recv_string(sock, algo) || !parse_hash_algo(algo, m.algo)) {
+        drop(sock);
+        return 0;
+    }
+    m.files.clear();
+    while(true) {
+        ManifestEntry e;
+        uint64_t net_size;
+        if(!recv_string(sock, e.path)) {
+            rep->err() << "Connection lost while receiving manifest\n";
+            drop(sock);
+            return -1;
+        }
+        if(e.path.empty()) break;
+        if(!recv_string(sock, e.hash) ||
+           !recv_all(sock, reinterpret_cast<char*>(&net_size), sizeof(net_size))) {
+            rep->err() << "Connection lost while receiving manifest\n";
+            drop(sock);
+            return -1;
+        }
+        e.size = ntohll(net_size);
+        m.files[e.path] = e;
+    }
+    done_with(sock);
+    return 1;
+}
 
-    if(!get_confirmation(sock)) {
-        cerr << "Server rejected project '" << project_name << "'\n";
-        close(sock);
-        return 1;
+bool FileTransfer::fetch_objects(const string &project_name,
+                                 const vector<const ManifestEntry*> &wanted, ObjectCache &cache) {
+    int sock = open_connection();
+    if(sock < 0) return false;
+    try {
+        send_string(sock, "FETCH");
+        send_string(sock, project_name);
+        if(!get_confirmation(sock)) {
+            rep->err() << "Server refused to send objects for '" << project_name << "'\n";
+            drop(sock);
+            return false;
+        }
+        for(const auto *e : wanted) send_string(sock, e->path);
+        send_string(sock, "");
+    } catch(const exception &e) {
+        rep->err() << "Failed to send fetch request: " << e.what() << endl;
+        drop(sock);
+        return false;
     }
 
-    string line;
-    while(getline(tracker, line)) {
-        istringstream iss(line);
-        string file_path;
-        iss >> file_path;
-        if(file_path.empty()) continue;
-        try {
-            send_string(sock, file_path);
-            if(!pump_file(sock, file_path)) {
-                cerr << "Skipping " << file_path << " due to errors\n";
-                continue;
-            }
-        } catch(const exception &e) {
-            cerr << "Critical failure sending " << file_path << ": " 
-                 << e.what() << endl;
-            close(sock);
-            return 1;
+    // This thread only receives; writing, hashing and committing to the
+    // cache happen behind it on the writer thread, whose complaints are
+    // reported from here once it's done
+    vector<string> temps(wanted.size());
+    atomic<bool> ok{true};
+    mutex problems_mutex;
+    vector<string> problems;
+    WriteBehind writer(cache.algo(), [&](size_t i, bool written, const string &hash) {
+        const ManifestEntry *e = wanted[i];
+        string problem;
+        if(!written) {
+            problem = "Couldn't write " + e->path + " to the object cache";
+            unlink(temps[i].c_str());
+        } else if(hash != e->hash) {
+            // Never let a bad object into a cache other clones trust
+            problem = e->path + " changed on the server mid-clone - try again";
+            unlink(temps[i].c_str());
+        } else if(!cache.commit(temps[i], e->hash)) {
+            problem = "Couldn't store " + e->path + " in the object cache";
         }
+        if(problem.empty()) return;
+        ok = false;
+        lock_guard<mutex> hold(problems_mutex);
+        problems.push_back(problem);
+    });
+    auto report_problems = [&]() {
+        for(const auto &p : problems) rep->err() << p << "\n";
+    };
+    for(size_t i = 0; i < wanted.size(); ++i) {
         if(!get_confirmation(sock)) {
-            cerr << "Server rejected " << file_path << " - aborting\n";
-            close(sock);
-            return 1;
+            rep->err() << "Server couldn't send " << wanted[i]->path << endl;
+            ok = false;
+            continue;
+        }
+        temps[i] = cache.temp_path();
+        if(!receive_file_from_server(sock, writer, i, temps[i], wanted[i]->path)) {
+            rep->err() << "Failed to receive file: " << wanted[i]->path << endl;
+            writer.finish();
+            report_problems();
+            unlink(temps[i].c_str());
+            drop(sock);
+            return false;
         }
     }
+    writer.finish();
+    report_problems();
+    done_with(sock);
+    return ok;
+}
 
-    uint32_t end_marker = htonl(0);
-    send_chunk(sock, &end_marker, sizeof(end_marker));
-
-    if(get_confirmation(sock)) {
-        cout << "All files delivered successfully!\n";
-    } else {
-        cerr << "Server reported transfer issues\n";
+// Distinct objects among entries that the cache doesn't have yet
+static vector<const ManifestEntry*> missing_objects(const vector<const ManifestEntry*> &entries,
+                                                   const ObjectCache &cache, uint64_t &bytes) {
+    vector<const ManifestEntry*> missing;
+    unordered_set<string> queued;
+    bytes = 0;
+    for(const auto *e : entries) {
+        if(cache.has(e->hash, e->size) || !queued.insert(e->hash).second) continue;
+        missing.push_back(e);
+        bytes += e->size;
     }
+    return missing;
+}
 
-    close(sock);
-    return 0;
+// .vcp files write_clone_metadata() generates
+static bool clone_writes(const string &path) {
+    return path == ".vcp/tracker.txt" || path == ".vcp/config.txt" || path == ".vcp/index" ||
+           path == LAZY_LIST;
+}
+
+// Stat index entry for e from the file as actually written at local_path,
+// so `vcp state` can trust its hash without reading
+static void index_written(const ManifestEntry &e, const string &local_path, Manifest &index) {
+    struct stat st;
+    if(e.path.rfind(".vcp/", 0) == 0 || stat(local_path.c_str(), &st) != 0) return;
+    ManifestEntry ie = e;
+    ie.size = st.st_size;
+#ifdef __APPLE__
+    ie.mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    ie.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    ie.ino = st.st_ino;
+    index.files[e.path] = ie;
+}
+
+// Check entries out of the cache under root, indexing each
+static bool checkout_entries(const string &root, const vector<const ManifestEntry*> &entries,
+                             ObjectCache &cache, Manifest &index, ostream &err) {
+    for(const auto *e : entries) {
+        string local_path = root + "/" + e->path;
+        fs::path parent = fs::path(local_path).parent_path();
+        std::error_code ec;
+        fs::create_directories(parent, ec);
+        if(!cache.checkout(e->hash, local_path)) {
+            err << "Failed to check out " << e->path << endl;
+            return false;
+        }
+        index_written(*e, local_path, index);
+    }
+    return true;
 }
 
-int FileTransfer::clone_project(const string &project_name) {
+// Manifest first, then only the objects this machine hasn't seen before;
+// the working tree is checked out from the shared cache. With paths only
+// files under them are cloned; lazy leaves everything outside .vcp/ to be
+// checked out on first use (see fetch_lazy).
+int FileTransfer::clone_project(const string &project_name, const vector<string> &paths, bool lazy) {
     std::regex valid_name("^[A-Za-z0-9._-]{1,100}$");
     if (!std::regex_match(project_name, valid_name)) {
-        cerr << "Invalid project name for clone: " << project_name << endl;
+        rep->err() << "Invalid project name for clone: " << project_name << endl;
         return 1;
     }
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock < 0) {
-        cerr << "Socket creation failed\n";
+
+    Manifest m;
+    int got = fetch_manifest(project_name, paths, m);
+    if(got < 0) return 1;
+    if(got == 0) {
+        // Older server, or no such project - the plain CLONE path reports which
+        if(lazy) {
+            rep->err() << "Server doesn't have project '" << project_name << "' or can't do lazy clones\n";
+            return 1;
+        }
+        return clone_streaming(project_name, paths);
+    }
+    ObjectCache cache(m.algo);
+    if(!cache.available()) {
+        if(lazy) {
+            rep->err() << "Lazy clones need the object cache, and there's no usable one\n";
+            return 1;
+        }
+        rep->err() << "No usable object cache - cloning without it\n";
+        return clone_streaming(project_name, paths, m.algo);
+    }
+    for(const auto& item : m.files) {
+        const string &p = item.first;
+        if(!safe_relative_path(p)) {
+            rep->err() << "Server sent unsafe path " << p << " - aborting\n";
+            return 1;
+        }
+    }
+    string local_dir = local(project_name);
+    if(fs::exists(local_dir)) {
+        rep->err() << "Project '" << project_name << "' already exists locally\n";
+        return 1;
+    }
+    if(m.files.empty() && !paths.empty()) {
+        rep->err() << "Nothing in '" << project_name << "' under the given paths\n";
+        return 1;
+    }
+
+    // The submitter's tracker, config, index and pending list are about to
+    // be rewritten for this clone, so they aren't checked out at all
+    vector<const ManifestEntry*> now;
+    Manifest later;
+    later.algo = m.algo;
+    for(const auto& item : m.files) {
+        if(clone_writes(item.first)) continue;
+        if(lazy && item.first.rfind(".vcp/", 0) != 0) later.files[item.first] = item.second;
+        else now.push_back(&item.second);
+    }
+
+    uint64_t fetch_bytes = 0;
+    vector<const ManifestEntry*> missing = missing_objects(now, cache, fetch_bytes);
+    rep->out() << "Cloning project '" << project_name << "' (" << m.files.size() << " files";
+    if(!paths.empty()) rep->out() << " under " << paths.size() << (paths.size() == 1 ? " path" : " paths");
+    rep->out() << ", " << missing.size() << " to download, " << fetch_bytes << " bytes";
+    if(lazy) rep->out() << ", " << later.files.size() << " fetched on demand";
+    rep->out() << ")...\n";
+    if(!missing.empty() && !fetch_objects(project_name, missing, cache)) {
+        rep->err() << "Clone failed while downloading objects\n";
         return 1;
     }
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-    if(connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        cerr << "Connection failed - make sure server is running\n";
-        close(sock);
+
+    if(!fs::create_directory(local_dir)) {
+        rep->err() << "Failed to create local project directory\n";
         return 1;
     }
+    Manifest index;
+    index.algo = m.algo;
+    if(!checkout_entries(local_dir, now, cache, index, rep->err())) return 1;
+    if(!write_clone_metadata(local_dir, project_name, m, index, later)) {
+        rep->err() << "Cloned files, but couldn't write .vcp metadata\n";
+        return 1;
+    }
+    rep->out() << "Clone completed successfully!\n";
+    return 0;
+}
+
+int FileTransfer::fetch_lazy(const string &root, const vector<string> &paths) {
+    string lazy_file = root + "/" + LAZY_LIST;
+    Manifest lazy;
+    if(!read_manifest(lazy_file, lazy)) return 0;  // not a lazy clone, or all fetched
+    vector<const ManifestEntry*> wanted, checkout;
+    for(const auto& item : lazy.files) {
+        if(!path_selected(item.first, paths)) continue;
+        wanted.push_back(&item.second);
+        // Something the user put there since the clone wins
+        if(!fs::exists(root + "/" + item.first)) checkout.push_back(&item.second);
+    }
+    if(wanted.empty()) return 0;
+
+    ifstream tracker(root + "/.vcp/tracker.txt");
+    string project_name;
+    getline(tracker, project_name);
+    ObjectCache cache(lazy.algo);
+    if(project_name.empty() || !cache.available()) {
+        rep->err() << "Can't fetch: " << (project_name.empty() ? "no project here" : "no usable object cache") << "\n";
+        return -1;
+    }
+
+    uint64_t fetch_bytes = 0;
+    vector<const ManifestEntry*> missing = missing_objects(checkout, cache, fetch_bytes);
+    rep->out() << "Fetching " << checkout.size() << " files (" << missing.size() << " to download, "
+         << fetch_bytes << " bytes)...\n";
+    if(!missing.empty() && !fetch_objects(project_name, missing, cache)) {
+        rep->err() << "Fetch failed while downloading objects\n";
+        return -1;
+    }
+
+    // Index last, as in a clone: its mtime must be newer than the files
+    string index_file = root + "/.vcp/index";
+    Manifest index;
+    if(!read_manifest(index_file, index) || index.algo != lazy.algo) {
+        index.files.clear();
+        index.algo = lazy.algo;
+    }
+    if(!checkout_entries(root, checkout, cache, index, rep->err())) return -1;
+    vector<string> done;
+    for(const auto *e : wanted) done.push_back(e->path);
+    for(const auto &p : done) lazy.files.erase(p);
+    bool saved = lazy.files.empty() ? unlink(lazy_file.c_str()) == 0 : write_manifest(lazy_file, lazy);
+    if(!saved || !write_manifest(index_file, index)) {
+        rep->err() << "Fetched files, but couldn't update .vcp metadata\n";
+        return -1;
+    }
+    return (int)checkout.size();
+}
+
+int FileTransfer::cache_versions(const string &project_name, const map<string, string> &wanted,
+                                 ObjectCache &cache) {
+    vector<string> paths;
+    size_t cached = 0;
+    for(const auto& w : wanted) {
+        if(access(cache.object_path(w.second).c_str(), F_OK) == 0) cached++;
+        else paths.push_back(w.first);
+    }
+    if(paths.empty()) return (int)cached;
+    if(!cache.available()) {
+        rep->err() << "No usable object cache\n";
+        return -1;
+    }
+
+    // FETCH sends what the server has now, so only ask for paths it still
+    // has at the version we want
+    Manifest m;
+    int got = fetch_manifest(project_name, paths, m);
+    if(got <= 0) {
+        rep->err() << "Couldn't get the manifest of '" << project_name << "' from the server\n";
+        return -1;
+    }
+    vector<const ManifestEntry*> fetch;
+    for(const auto& p : paths) {
+        auto it = m.files.find(p);
+        if(it != m.files.end() && m.algo == cache.algo() && it->second.hash == wanted.at(p)) fetch.push_back(&it->second);
+    }
+    uint64_t bytes = 0;
+    vector<const ManifestEntry*> missing = missing_objects(fetch, cache, bytes);
+    // Callers print what they do with these versions on stdout
+    rep->progress_to_err = true;
+    bool ok = missing.empty() || fetch_objects(project_name, missing, cache);
+    rep->progress_to_err = false;
+    return ok ? (int)(cached + fetch.size()) : -1;
+}
+
+// Replace file with text through a rename, never writing into the old
+// inode (which may be a hardlink into the object cache)
+static bool write_replacing(const string &file, const string &text) {
+    string tmp = file + ".tmp";
+    {
+        ofstream out(tmp, ios::trunc);
+        if(!out || !(out << text).flush()) return false;
+    }
+    return rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+// Tracker listing every cloned file (and its directories), the repo's hash
+// algorithm, the stat index, and for a lazy clone what isn't checked out
+// yet. Index goes last so its mtime is newer than every file it describes.
+bool FileTransfer::write_clone_metadata(const string &local_dir, const string &project_name,
+                                        const Manifest &m, const Manifest &index, const Manifest &lazy) {
+    string vcp_dir = local_dir + "/.vcp";
+    std::error_code ec;
+    fs::create_directories(vcp_dir, ec);
+
+    ostringstream tracker;
+    tracker << project_name << "\n";
+    set<string> dirs;
+    for(const auto& item : m.files) {
+        const string &p = item.first;
+        if(p.rfind(".vcp/", 0) == 0) continue;
+        tracker << p << " " << item.second.hash << "\n";
+        for(size_t slash = p.find('/'); slash != string::npos; slash = p.find('/', slash + 1)) {
+            dirs.insert(p.substr(0, slash + 1));
+        }
+    }
+    for(const auto& d : dirs) tracker << d << " -\n";
+    if(!write_replacing(vcp_dir + "/tracker.txt", tracker.str())) return false;
+    if(!write_replacing(vcp_dir + "/config.txt", "hash=" + string(hash_algo_name(m.algo)) + "\n")) return false;
+    if(!lazy.files.empty() && !write_manifest(local_dir + "/" + LAZY_LIST, lazy)) return false;
+
+    return write_manifest(vcp_dir + "/index", index);
+}
+
+// Old style clone: server streams every file
+// Files are hashed as they're written (with algo, unless the project's
+// config says otherwise), so the tracker and stat index come out as they
+// do for a cached clone.
+int FileTransfer::clone_streaming(const string &project_name, const vector<string> &paths, HashAlgo algo) {
+    int sock = open_connection();
+    if(sock < 0) return 1;
     try {
         send_string(sock, "CLONE");
         send_string(sock, project_name);
+        for(const auto &p : paths) send_string(sock, p);
+        send_string(sock, "");
     } catch(const exception &e) {
-        cerr << "Failed to send clone request: " << e.what() << endl;
-        close(sock);
+        rep->err() << "Failed to send clone request: " << e.what() << endl;
+        drop(sock);
         return 1;
     }
     if(!get_confirmation(sock)) {
-        cerr << "Server doesn't have project '" << project_name << "' or clone failed\n";
-        close(sock);
+        rep->err() << "Server doesn't have project '" << project_name << "' or clone failed\n";
+        drop(sock);
         return 1;
     }
-    if(fs::exists(project_name)) {
-        cerr << "Project '" << project_name << "' already exists locally\n";
-        close(sock);
+    string local_dir = local(project_name);
+    if(fs::exists(local_dir)) {
+        rep->err() << "Project '" << project_name << "' already exists locally\n";
+        drop(sock);
         return 1;
     }
-    if(!fs::create_directory(project_name)) {
-        cerr << "Failed to create local project directory\n";
-        close(sock);
+    if(!fs::create_directory(local_dir)) {
+        rep->err() << "Failed to create local project directory\n";
+        drop(sock);
         return 1;
     }
-    cout << "Cloning project '" << project_name << "'...\n";
-    while(true) {
+    rep->out() << "Cloning project '" << project_name << "'...\n";
+    vector<string> names, hashes;
+    mutex hashes_mutex;
+    WriteBehind writer(algo, [&](size_t file, bool ok, const string &hash) {
+        lock_guard<mutex> hold(hashes_mutex);
+        if(hashes.size() <= file) hashes.resize(file + 1);
+        hashes[file] = ok ? hash : "";
+    });
+    bool complete = false;
+    for(size_t file = 0;; ++file) {
         string filename;
         uint32_t len;
-        if(recv(sock, &len, sizeof(len), 0) != sizeof(len)) {
-            cerr << "Connection lost while receiving filename length\n";
+        if(net_recv(sock, &len, sizeof(len)) != sizeof(len)) {
+            rep->err() << "Connection lost while receiving filename length\n";
             break;
         }
         len = ntohl(len);
-        if(len == 0) break;
+        if(len == 0) {
+            complete = true;
+            break;
+        }
         std::vector<char> buffer(len + 1);
         if(!recv_all(sock, buffer.data(), len)) {
-            cerr << "Failed to receive filename\n";
+            rep->err() << "Failed to receive filename\n";
             break;
         }
         buffer[len] = '\0';
         filename = buffer.data();
-        string local_path = project_name + "/" + filename;
-        cout << "Receiving: " << filename << endl;
-        if(!receive_file_from_server(sock, local_path)) {
-            cerr << "Failed to receive file: " << filename << endl;
+        if(!safe_relative_path(filename)) {
+            rep->err() << "Server sent unsafe path " << filename << " - aborting\n";
+            break;
+        }
+        names.push_back(filename);
+        rep->out() << "Receiving: " << filename << endl;
+        if(!receive_file_from_server(sock, writer, file, local_dir + "/" + filename, project_name + "/" + filename)) {
+            rep->err() << "Failed to receive file: " << filename << endl;
             break;
         }
     }
-    cout << "Clone completed successfully!\n";
-    close(sock);
-    return 0;
-}
-
-int FileTransfer::list_projects() {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock < 0) {
-        cerr << "Socket creation failed\n";
+    writer.finish();
+    if(!complete) {
+        drop(sock);
         return 1;
     }
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-    if(connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        cerr << "Connection failed - make sure server is running\n";
-        close(sock);
+    done_with(sock);
+
+    // The project's own hash algorithm, if it says one
+    HashAlgo repo_algo = algo;
+    ifstream cfg(local_dir + "/.vcp/config.txt");
+    for(string line; getline(cfg, line);) {
+        if(line.rfind("hash=", 0) == 0) parse_hash_algo(line.substr(5), repo_algo);
+    }
+    hashes.resize(names.size());
+    if(repo_algo != algo) {
+        vector<string> full;
+        for(const auto &n : names) full.push_back(local_dir + "/" + n);
+        hashes = hash_files(full, repo_algo, rep->err());
+    }
+    Manifest m, index, lazy;
+    m.algo = index.algo = lazy.algo = repo_algo;
+    for(size_t i = 0; i < names.size(); ++i) {
+        if(clone_writes(names[i])) continue;
+        if(hashes[i].empty()) {
+            rep->err() << "Failed to write " << names[i] << endl;
+            return 1;
+        }
+        ManifestEntry &e = m.files[names[i]];
+        e.path = names[i];
+        e.hash = hashes[i];
+        index_written(e, local_dir + "/" + names[i], index);
+    }
+    if(!write_clone_metadata(local_dir, project_name, m, index, lazy)) {
+        rep->err() << "Cloned files, but couldn't write .vcp metadata\n";
         return 1;
     }
+    rep->out() << "Clone completed successfully!\n";
+    return 0;
+}
+
+int FileTransfer::list_projects(vector<string> &projects) {
+    int sock = open_connection();
+    if(sock < 0) return 1;
     try {
         send_string(sock, "LIST");
     } catch(const exception &e) {
-        cerr << "Failed to send list request: " << e.what() << endl;
-        close(sock);
+        rep->err() << "Failed to send list request: " << e.what() << endl;
+        drop(sock);
         return 1;
     }
-    cout << "Available projects on server:\n";
+    projects.clear();
     while(true) {
         string project_name;
-        uint32_t len;
-        if(recv(sock, &len, sizeof(len), 0) != sizeof(len)) {
-            break;
-        }
-        len = ntohl(len);
-        if(len == 0) break;
-        std::vector<char> buffer(len + 1);
-        if(!recv_all(sock, buffer.data(), len)) {
-            break;
+        if(!recv_string(sock, project_name)) {
+            rep->err() << "Connection lost while receiving the project list\n";
+            drop(sock);
+            return 1;
         }
-        buffer[len] = '\0';
-        project_name = buffer.data();
-        cout << "  - " << project_name << endl;
+        if(project_name.empty()) break;
+        projects.push_back(project_name);
     }
-    close(sock);
+    done_with(sock);
     return 0;
 }
 
-bool FileTransfer::receive_file_from_server(int sock, const string &save_path) {
-    uint64_t net_size;
-    if(recv(sock, &net_size, sizeof(net_size), 0) != sizeof(net_size)) {
-        return false;
+int FileTransfer::server_status(string &status) {
+    int sock = open_connection();
+    if(sock < 0) return 1;
+    try {
+        send_string(sock, "STATUS");
+    } catch(const exception &e) {
+        rep->err() << "Failed to send status request: " << e.what() << endl;
+        drop(sock);
+        return 1;
     }
-    uint64_t file_size = ntohll(net_size);
-    fs::path parent_path = fs::path(save_path).parent_path();
-    if(!parent_path.empty() && !fs::exists(parent_path)) {
-        fs::create_directories(parent_path);
+    if(!recv_string(sock, status)) {
+        rep->err() << "Server didn't answer the status request\n";
+        drop(sock);
+        return 1;
     }
-    ofstream outfile(save_path, ios::binary);
-    if(!outfile) {
-        cerr << "Cannot create file: " << save_path << endl;
+    status += "Transport: " + net_describe(sock) + "\n";
+    done_with(sock);
+    return 0;
+}
+
+int FileTransfer::server_admin(const string &command, string &reply) {
+    int sock = open_connection();
+    if(sock < 0) return 1;
+    try {
+        send_string(sock, "ADMIN");
+        send_string(sock, command);
+    } catch(const exception &e) {
+        rep->err() << "Failed to send admin command: " << e.what() << endl;
+        drop(sock);
+        return 1;
+    }
+    if(!recv_string(sock, reply)) {
+        rep->err() << "Server didn't answer the admin command\n";
+        drop(sock);
+        return 1;
+    }
+    done_with(sock);
+    return 0;
+}
+
+// Hands the file to writer as it arrives; writer does the disk side
+bool FileTransfer::receive_file_from_server(int sock, WriteBehind &writer, size_t file,
+                                            const string &save_path, const string &label) {
+    const string &shown = label.empty() ? save_path : label;
+    uint64_t net_size;
+    if(!recv_all(sock, reinterpret_cast<char*>(&net_size), sizeof(net_size))) {
         return false;
     }
-    char buffer[BUFFER_SIZE];
-    uint64_t remaining = file_size;
-    uint64_t total_size = file_size;
+    uint64_t total_size = ntohll(net_size);
     uint64_t received = 0;
-    while(remaining > 0) {
-        size_t to_read = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
-        ssize_t r = recv(sock, buffer, to_read, 0);
-        if(r <= 0) return false;
-        outfile.write(buffer, r);
-        remaining -= r;
-        received += r;
-        double pct = (total_size > 0) ? (100.0 * received / total_size) : 100.0;
-        cout << "Downloading: " << save_path << " - " << received << "/" << total_size
-             << " bytes (" << fixed << setprecision(1) << pct << "% )\r";
-        cout.flush();
-    }
-    cout << endl;
+    writer.begin_file(file, save_path);
+    do {
+        // Fill a whole buffer per hand-off rather than passing on every recv()
+        char *buf = writer.buffer();
+        size_t len = 0;
+        while(len < writer.buffer_size() && received + len < total_size) {
+            size_t want = (size_t)min<uint64_t>(writer.buffer_size() - len, total_size - received - len);
+            ssize_t r = net_recv(sock, buf + len, want);
+            if(r <= 0) {
+                writer.write(buf, len);
+                writer.end_file();
+                return false;
+            }
+            len += r;
+        }
+        writer.write(buf, len);
+        received += len;
+        rep->transfer(ProgressEvent::DOWNLOAD, shown, received, total_size);
+    } while(received < total_size);
+    writer.end_file();
     return true;
 }
@@ -1,19 +1,118 @@
 #ifndef FTP_H
 #define FTP_H
 
+#include <chrono>
+#include <map>
+#include <mutex>
 #include <string>
+#include <vector>
+#include "Hash.h"
+#include "Manifest.h"
+#include "Progress.h"
+
+// Manifest of a lazy clone's files not checked out yet
+#define LAZY_LIST ".vcp/lazy"
+
+class ObjectCache;
+class WriteBehind;
+struct BlockSignature;
+
+// Connections to the server kept open between operations, for a process
+// that runs many of them (see VCPClient.h). A new connection starts with
+// SESSION, after which the server takes any number of commands on it; an
+// older server refuses, and then every connection serves one command as
+// before. Safe to share between threads.
+class ConnectionPool {
+public:
+    // Keeps up to max_idle connections, each for up to idle_seconds unused
+    explicit ConnectionPool(size_t max_idle = 2, int idle_seconds = 20);
+    ~ConnectionPool();
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+    // A connection to $VCP_SERVER, reused if one is idle; -1 (reason on err) if none
+    int take(std::ostream &err);
+    // After a complete exchange: the connection can carry the next one
+    void give_back(int sock);
+    // After a failed exchange: close it
+    void discard(int sock);
+
+private:
+    struct Idle {
+        int sock;
+        std::string addr;
+        std::chrono::steady_clock::time_point since;
+    };
+    void expire();
+    std::mutex mutex_;
+    std::vector<Idle> idle;
+    std::map<int, std::string> lent;       // session connections out, by socket
+    std::map<std::string, bool> sessions;  // server address -> takes SESSION
+    size_t max_idle;
+    std::chrono::seconds idle_time;
+};
 
 class FileTransfer {
 private:
+    std::string dir;
+    Reporter console;
+    Reporter *rep;
+    ConnectionPool *pool;
+    // Path of a local file named relative to dir
+    std::string local(const std::string &rel) const;
+    int open_connection();
+    // Connection finished with: after a complete exchange, or after a failure
+    void done_with(int sock);
+    void drop(int sock);
+    bool recv_string(int sock, std::string &str);
     bool send_chunk(int sock, const void* data, size_t length);
     void send_string(int sock, const std::string &str);
-    bool pump_file(int sock, const std::string &path);
-    bool receive_file_from_server(int sock, const std::string &save_path);
+    bool receive_file_from_server(int sock, WriteBehind &writer, size_t file,
+                                  const std::string &save_path, const std::string &label = "");
+    bool send_delta(int sock, const ManifestEntry &f, const BlockSignature &sig, HashAlgo algo,
+                    uint64_t &sent);
+    bool pass_files(int sock, const std::vector<const ManifestEntry*> &files);
+    int push_files(const std::string &project_name, const std::vector<ManifestEntry> &files,
+                   HashAlgo algo, uint64_t delta_min, size_t unchanged);
+    int tree_changes(const std::string &project_name, const std::vector<ManifestEntry> &files,
+                     HashAlgo algo, std::vector<std::string> &changed, size_t &rounds);
+    int fetch_manifest(const std::string &project_name, const std::vector<std::string> &paths,
+                       Manifest &m);
+    bool fetch_objects(const std::string &project_name,
+                       const std::vector<const ManifestEntry*> &wanted, ObjectCache &cache);
+    int clone_streaming(const std::string &project_name, const std::vector<std::string> &paths,
+                        HashAlgo algo = HashAlgo::SHA256);
+    bool write_clone_metadata(const std::string &local_dir, const std::string &project_name,
+                              const Manifest &m, const Manifest &index, const Manifest &lazy);
     bool get_confirmation(int sock);
 public:
-    int submit();
-    int clone_project(const std::string &project_name);
-    int list_projects();
+    // Local paths are relative to dir ("" = the current directory). Output
+    // goes to rep (stdout/stderr when null), connections come from pool
+    // (a new one per request when null).
+    explicit FileTransfer(const std::string &dir = "", Reporter *rep = nullptr, ConnectionPool *pool = nullptr);
+    FileTransfer(const FileTransfer &) = delete;
+    FileTransfer &operator=(const FileTransfer &) = delete;
+
+    // Files of at least delta_min bytes (0 = never) go as deltas when the
+    // server has an older version
+    int submit(const std::string &project_name, const std::vector<ManifestEntry> &files,
+               HashAlgo algo, uint64_t delta_min);
+    // Into directory project_name under dir. paths: only files under these
+    // (all if empty); lazy: check out only .vcp/ now and the rest on demand
+    int clone_project(const std::string &project_name, const std::vector<std::string> &paths = {},
+                      bool lazy = false);
+    // Lazy clone at root: check out pending files under paths (all if
+    // empty). Number checked out, 0 if none were pending, -1 on failure.
+    int fetch_lazy(const std::string &root, const std::vector<std::string> &paths);
+    // Get the content each path had at its hash (path -> hash) into the
+    // object cache, downloading what it lacks. Paths whose server copy has
+    // moved on since are left out. Number cached, -1 on failure.
+    int cache_versions(const std::string &project_name, const std::map<std::string, std::string> &wanted,
+                       ObjectCache &cache);
+    int list_projects(std::vector<std::string> &projects);
+    // Role and replication state, then how the connection is carried
+    int server_status(std::string &status);
+    int server_admin(const std::string &command, std::string &reply);
 };
 
 #endif // FTP_H
@@ -0,0 +1,115 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "FileReader.h"
+using namespace std;
+
+#define READ_CHUNK (1024 * 1024)            // read() size, and the big-file cutoff
+#define BIG_READ_CHUNK (4 * 1024 * 1024)    // read() size for big mutable files
+#define MAP_WINDOW (64 * 1024 * 1024)       // bytes mapped at once
+#define MAP_CHUNK (4 * 1024 * 1024)         // handed out per next()
+#define DROP_BEHIND_MIN (256ULL * 1024 * 1024)
+
+FileReader::~FileReader() {
+    close();
+}
+
+bool FileReader::open(const string &path, bool immutable) {
+    close();
+    error = false;
+    offset = 0;
+
+    file_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) return false;
+    struct stat st;
+    if (fstat(file_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close();
+        return false;
+    }
+    file_size = st.st_size;
+    use_mmap = immutable && file_size >= READ_CHUNK;
+    drop_behind = file_size >= DROP_BEHIND_MIN;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (!use_mmap && file_size > 0)
+        posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return true;
+}
+
+void FileReader::unmap() {
+    if (!map_base) return;
+    // Done with these pages - don't let them hang around in our RSS
+    madvise(map_base, map_len, MADV_DONTNEED);
+    munmap(map_base, map_len);
+#ifdef POSIX_FADV_DONTNEED
+    if (drop_behind)
+        posix_fadvise(file_fd, map_offset, map_len, POSIX_FADV_DONTNEED);
+#endif
+    map_base = nullptr;
+    map_len = 0;
+}
+
+void FileReader::close() {
+    unmap();
+    if (file_fd >= 0) ::close(file_fd);
+    file_fd = -1;
+    file_size = 0;
+}
+
+bool FileReader::next(const char *&data, size_t &len) {
+    if (file_fd < 0 || error || offset >= file_size) return false;
+
+    if (use_mmap) {
+        if (!map_base || offset >= map_offset + map_len) {
+            unmap();
+            map_offset = offset;  // always window aligned, so page aligned too
+            uint64_t left = file_size - offset;
+            map_len = left < MAP_WINDOW ? (size_t)left : MAP_WINDOW;
+            void *p = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, file_fd, map_offset);
+            if (p == MAP_FAILED) {
+                map_len = 0;
+                error = true;
+                return false;
+            }
+            map_base = p;
+            madvise(map_base, map_len, MADV_SEQUENTIAL);
+        }
+        size_t in_window = (size_t)(offset - map_offset);
+        len = map_len - in_window;
+        if (len > MAP_CHUNK) len = MAP_CHUNK;
+        data = static_cast<const char*>(map_base) + in_window;
+        offset += len;
+        return true;
+    }
+
+    uint64_t left = file_size - offset;
+    size_t chunk = file_size >= READ_CHUNK ? BIG_READ_CHUNK : READ_CHUNK;
+    size_t want = left < chunk ? (size_t)left : chunk;
+    if (buffer.size() < want) buffer.resize(want);
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = read(file_fd, buffer.data() + got, want - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            error = true;
+            return false;
+        }
+        if (n == 0) break;  // file shrank under us
+        got += n;
+    }
+    if (got == 0) {
+        error = true;  // shorter than when we opened it
+        return false;
+    }
+#ifdef POSIX_FADV_DONTNEED
+    if (drop_behind)
+        posix_fadvise(file_fd, offset, got, POSIX_FADV_DONTNEED);
+#endif
+    data = buffer.data();
+    len = got;
+    offset += got;
+    return true;
+}
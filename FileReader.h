@@ -0,0 +1,57 @@
+#ifndef FILE_READER_H
+#define FILE_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Sequential reader shared by hashing and both upload/download senders.
+//
+// Small files are read() in one go into a reused buffer. Big files that
+// can't change while we read them (stored blobs) are mapped a window at a
+// time with MADV_SEQUENTIAL; windows we're done with are released with
+// MADV_DONTNEED. Other big files (the working tree, where an editor or a
+// build may truncate them mid-read, which would SIGBUS through a mapping)
+// are read() in large chunks with POSIX_FADV_SEQUENTIAL. Either way, for
+// huge files the page cache behind us is dropped so one multi-GB asset
+// doesn't evict everything else. Callers just loop on next() and never
+// see which path was taken.
+class FileReader {
+public:
+    FileReader() = default;
+    ~FileReader();
+    FileReader(const FileReader&) = delete;
+    FileReader &operator=(const FileReader&) = delete;
+
+    // immutable: nothing modifies the file while it's open, so it may be mapped
+    bool open(const std::string &path, bool immutable = false);
+    void close();
+
+    uint64_t size() const { return file_size; }
+    int fd() const { return file_fd; }
+
+    // Next chunk of the file; data stays valid until the next call.
+    // Returns false at end of file or on error (check failed()).
+    bool next(const char *&data, size_t &len);
+    bool failed() const { return error; }
+
+private:
+    int file_fd = -1;
+    uint64_t file_size = 0;
+    uint64_t offset = 0;
+    bool error = false;
+    bool use_mmap = false;
+    bool drop_behind = false;
+
+    // current mmap window
+    void *map_base = nullptr;
+    size_t map_len = 0;
+    uint64_t map_offset = 0;
+
+    std::vector<char> buffer;
+
+    void unmap();
+};
+
+#endif // FILE_READER_H
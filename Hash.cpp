@@ -0,0 +1,144 @@
+// Content hashing for the tracker.
+// SHA-256 goes through OpenSSL EVP, which already picks SHA-NI / AVX2 code
+// paths at runtime from CPUID, so we don't carry our own dispatch here.
+
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <openssl/evp.h>
+#include "Hash.h"
+#include "FileReader.h"
+using namespace std;
+
+const char *hash_algo_name(HashAlgo algo) {
+    return algo == HashAlgo::BLAKE3 ? "blake3" : "sha256";
+}
+
+bool parse_hash_algo(const string &name, HashAlgo &algo) {
+    if (name == "sha256") { algo = HashAlgo::SHA256; return true; }
+    if (name == "blake3") { algo = HashAlgo::BLAKE3; return true; }
+    return false;
+}
+
+string to_hex(const unsigned char *data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    string out(len * 2, '\0');
+    for (size_t i = 0; i < len; ++i) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 0x0f];
+    }
+    return out;
+}
+
+Hasher::Hasher(HashAlgo a) : algo(a), ctx(nullptr) {
+    if (algo == HashAlgo::SHA256) {
+        ctx = EVP_MD_CTX_new();
+        if (!ctx) cerr << "Failed to create OpenSSL digest context" << endl;
+    }
+    reset();
+}
+
+Hasher::~Hasher() {
+    if (ctx) EVP_MD_CTX_free(ctx);
+}
+
+bool Hasher::reset() {
+    if (algo == HashAlgo::BLAKE3) {
+        b3 = Blake3();
+        return true;
+    }
+    if (!ctx) return false;
+    if (1 != EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr)) {
+        cerr << "EVP_DigestInit_ex failed" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool Hasher::update(const void *data, size_t len) {
+    if (algo == HashAlgo::BLAKE3) {
+        b3.update(data, len);
+        return true;
+    }
+    if (!ctx || 1 != EVP_DigestUpdate(ctx, data, len)) {
+        cerr << "EVP_DigestUpdate failed" << endl;
+        return false;
+    }
+    return true;
+}
+
+string Hasher::final_hex() {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    if (algo == HashAlgo::BLAKE3) {
+        b3.finalize(md);
+        return to_hex(md, Blake3::OUT_LEN);
+    }
+    unsigned int md_len = 0;
+    if (!ctx || 1 != EVP_DigestFinal_ex(ctx, md, &md_len)) {
+        cerr << "EVP_DigestFinal_ex failed" << endl;
+        return "";
+    }
+    return to_hex(md, md_len);
+}
+
+// Hash path with a caller owned hasher and reader; why says what went wrong
+static string hash_with(Hasher &h, FileReader &reader, const string &path, bool immutable,
+                        string &why) {
+    if (!reader.open(path, immutable)) {
+        why = "Can't read " + path + " (permissions? missing?)";
+        return "";
+    }
+    if (!h.reset()) return "";
+    const char *data;
+    size_t len;
+    while (reader.next(data, len)) {
+        if (!h.update(data, len)) return "";
+    }
+    if (reader.failed()) {
+        why = "Read error on " + path;
+        return "";
+    }
+    reader.close();
+    return h.final_hex();
+}
+
+string hash_file(const string &path, HashAlgo algo, ostream &err, bool immutable) {
+    Hasher h(algo);
+    FileReader reader;
+    string why;
+    string hash = hash_with(h, reader, path, immutable, why);
+    if (!why.empty()) err << why << endl;
+    return hash;
+}
+
+vector<string> hash_files(const vector<string> &paths, HashAlgo algo, ostream &err, bool immutable) {
+    vector<string> result(paths.size());
+    if (paths.empty()) return result;
+
+    // Not worth spinning up threads for a handful of files
+    size_t workers = thread::hardware_concurrency();
+    if (workers == 0) workers = 1;
+    size_t by_count = (paths.size() + 15) / 16;
+    if (workers > by_count) workers = by_count;
+
+    vector<string> why(paths.size());
+    atomic<size_t> next{0};
+    auto work = [&]() {
+        Hasher h(algo);
+        FileReader reader;
+        size_t i;
+        while ((i = next.fetch_add(1)) < paths.size()) {
+            result[i] = hash_with(h, reader, paths[i], immutable, why[i]);
+        }
+    };
+
+    vector<thread> pool;
+    for (size_t t = 1; t < workers; ++t) pool.emplace_back(work);
+    work();
+    for (auto &t : pool) t.join();
+    // err needn't be thread safe (a Reporter's isn't)
+    for (const auto &w : why) {
+        if (!w.empty()) err << w << endl;
+    }
+    return result;
+}
@@ -0,0 +1,56 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Blake3.h"
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+// Content hash used for tracker entries. SHA-256 is the default, BLAKE3 is
+// picked per repository at init time and recorded in .vcp/config.txt
+enum class HashAlgo { SHA256, BLAKE3 };
+
+const char *hash_algo_name(HashAlgo algo);
+bool parse_hash_algo(const std::string &name, HashAlgo &algo);
+
+// Lowercase hex, table driven
+std::string to_hex(const unsigned char *data, size_t len);
+
+// Incremental hasher, for callers that already have the bytes in hand
+// (e.g. while streaming a file somewhere else)
+class Hasher {
+public:
+    explicit Hasher(HashAlgo algo = HashAlgo::SHA256);
+    ~Hasher();
+    Hasher(const Hasher&) = delete;
+    Hasher &operator=(const Hasher&) = delete;
+
+    // Start over with the same algorithm; cheaper than a new Hasher
+    bool reset();
+    bool update(const void *data, size_t len);
+    // Hex digest, empty string on failure
+    std::string final_hex();
+
+private:
+    HashAlgo algo;
+    EVP_MD_CTX *ctx;
+    Blake3 b3;
+};
+
+// Hash one file, "" if it can't be read (why goes to err). immutable as
+// for FileReader::open.
+std::string hash_file(const std::string &path, HashAlgo algo = HashAlgo::SHA256,
+                      std::ostream &err = std::cerr, bool immutable = false);
+
+// Hash a batch of files across worker threads. Result i belongs to paths[i]
+// ("" for unreadable files; why goes to err, in path order, once all are
+// done). Each worker keeps one digest context and one FileReader for its
+// whole share, so small files cost a single read().
+std::vector<std::string> hash_files(const std::vector<std::string> &paths,
+                                    HashAlgo algo = HashAlgo::SHA256,
+                                    std::ostream &err = std::cerr, bool immutable = false);
+
+#endif // HASH_H
@@ -0,0 +1,237 @@
+// Compiled .vcpignore matcher
+
+#include <algorithm>
+#include <fstream>
+#include "Ignore.h"
+using namespace std;
+
+bool IgnoreMatcher::load(const string &ignore_file) {
+    ifstream in(ignore_file);
+    if (!in) return false;
+    string line;
+    while (getline(in, line)) add_pattern(line);
+    return true;
+}
+
+void IgnoreMatcher::add_pattern(const string &raw) {
+    string line = raw;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    // Trailing spaces don't count unless escaped
+    while (!line.empty() && line.back() == ' ' &&
+           !(line.size() > 1 && line[line.size() - 2] == '\\'))
+        line.pop_back();
+    if (line.empty() || line[0] == '#') return;
+
+    Rule rule;
+    if (line[0] == '!') {
+        rule.negate = true;
+        line.erase(0, 1);
+    } else if (line[0] == '\\' && line.size() > 1 && (line[1] == '!' || line[1] == '#')) {
+        line.erase(0, 1);
+    }
+    if (!line.empty() && line.back() == '/') {
+        rule.dir_only = true;
+        line.pop_back();
+    }
+    if (!line.empty() && line[0] == '/') {
+        rule.anchored = true;
+        line.erase(0, 1);
+    }
+    if (line.empty()) return;
+    if (line.find('/') != string::npos) rule.anchored = true;
+
+    int idx = (int)rules.size();
+    bool literal = line.find_first_of("*?[\\") == string::npos;
+    if (literal && !rule.anchored) {
+        by_name[line].push_back(idx);
+    } else if (literal) {
+        TrieNode *node = &anchored_root;
+        size_t start = 0;
+        while (start <= line.size()) {
+            size_t slash = line.find('/', start);
+            if (slash == string::npos) slash = line.size();
+            string part = line.substr(start, slash - start);
+            if (!part.empty()) {
+                auto &child = node->children[part];
+                if (!child) child.reset(new TrieNode);
+                node = child.get();
+            }
+            start = slash + 1;
+        }
+        node->rules.push_back(idx);
+    } else {
+        rule.glob = compile(line);
+        glob_rules.push_back(idx);
+    }
+    rules.push_back(std::move(rule));
+}
+
+unique_ptr<IgnoreMatcher::Glob> IgnoreMatcher::compile(const string &p) {
+    unique_ptr<Glob> g(new Glob);
+    size_t i = 0;
+    while (i < p.size()) {
+        Token t;
+        char ch = p[i];
+        if (ch == '\\' && i + 1 < p.size()) {
+            t.kind = Token::CHAR;
+            t.c = p[i + 1];
+            i += 2;
+        } else if (ch == '*') {
+            bool at_component_start = (i == 0 || p[i - 1] == '/');
+            if (i + 1 < p.size() && p[i + 1] == '*' && at_component_start) {
+                if (i + 2 == p.size()) {
+                    // "dir/**" - everything below
+                    t.kind = Token::DSTAR;
+                    i += 2;
+                } else if (p[i + 2] == '/') {
+                    // "**/" - zero or more whole directories
+                    t.kind = Token::DSTAR_DIRS;
+                    i += 3;
+                } else {
+                    t.kind = Token::STAR;
+                    i += 2;
+                }
+            } else {
+                t.kind = Token::STAR;
+                while (i < p.size() && p[i] == '*') i++;
+            }
+        } else if (ch == '?') {
+            t.kind = Token::ANY;
+            i++;
+        } else if (ch == '[' && p.find(']', i + 2) != string::npos) {
+            t.kind = Token::CLASS;
+            size_t j = i + 1;
+            if (p[j] == '!' || p[j] == '^') {
+                t.negated = true;
+                j++;
+            }
+            // A ']' right after the opening bracket is a literal
+            bool first = true;
+            while (j < p.size() && (first || p[j] != ']')) {
+                char lo = p[j];
+                char hi = lo;
+                if (j + 2 < p.size() && p[j + 1] == '-' && p[j + 2] != ']') {
+                    hi = p[j + 2];
+                    j += 2;
+                }
+                t.ranges.push_back({lo, hi});
+                j++;
+                first = false;
+            }
+            i = j + 1;
+        } else {
+            t.kind = Token::CHAR;
+            t.c = ch;
+            i++;
+        }
+        g->tokens.push_back(std::move(t));
+    }
+    return g;
+}
+
+// Thompson-style simulation: at[i] means "about to match token i",
+// in_dir[i] means "part way through a directory name swallowed by **/".
+// No backtracking, so cost is O(len(s) * tokens) whatever the pattern.
+bool IgnoreMatcher::Glob::matches(const string &s) const {
+    size_t n = tokens.size();
+    vector<char> at(n + 1, 0), in_dir(n + 1, 0);
+    vector<char> next_at(n + 1), next_in(n + 1);
+    at[0] = 1;
+
+    auto closure = [&](vector<char> &a) {
+        for (size_t i = 0; i < n; ++i) {
+            if (!a[i]) continue;
+            Token::Kind k = tokens[i].kind;
+            if (k == Token::STAR || k == Token::DSTAR || k == Token::DSTAR_DIRS) a[i + 1] = 1;
+        }
+    };
+    closure(at);
+
+    for (char ch : s) {
+        fill(next_at.begin(), next_at.end(), 0);
+        fill(next_in.begin(), next_in.end(), 0);
+        bool any = false;
+        for (size_t i = 0; i < n; ++i) {
+            if (in_dir[i]) {
+                if (ch == '/') next_at[i] = 1; else next_in[i] = 1;
+                any = true;
+            }
+            if (!at[i]) continue;
+            const Token &t = tokens[i];
+            switch (t.kind) {
+            case Token::CHAR:
+                if (ch == t.c) { next_at[i + 1] = 1; any = true; }
+                break;
+            case Token::ANY:
+                if (ch != '/') { next_at[i + 1] = 1; any = true; }
+                break;
+            case Token::STAR:
+                if (ch != '/') { next_at[i] = 1; any = true; }
+                break;
+            case Token::DSTAR:
+                next_at[i] = 1;
+                any = true;
+                break;
+            case Token::DSTAR_DIRS:
+                if (ch != '/') { next_in[i] = 1; any = true; }
+                break;
+            case Token::CLASS: {
+                if (ch == '/') break;
+                bool hit = false;
+                for (const auto &r : t.ranges)
+                    if (ch >= r.first && ch <= r.second) { hit = true; break; }
+                if (hit != t.negated) { next_at[i + 1] = 1; any = true; }
+                break;
+            }
+            }
+        }
+        if (!any) return false;
+        at.swap(next_at);
+        in_dir.swap(next_in);
+        closure(at);
+    }
+    return at[n] != 0;
+}
+
+bool IgnoreMatcher::match(const string &path, bool is_dir) const {
+    if (rules.empty()) return false;
+
+    size_t slash = path.rfind('/');
+    string name = (slash == string::npos) ? path : path.substr(slash + 1);
+    int best = -1;
+    auto consider = [&](int idx) {
+        if (idx > best && (!rules[idx].dir_only || is_dir)) best = idx;
+    };
+
+    auto it = by_name.find(name);
+    if (it != by_name.end())
+        for (int idx : it->second) consider(idx);
+
+    const TrieNode *node = &anchored_root;
+    size_t start = 0;
+    while (node && start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == string::npos) end = path.size();
+        auto child = node->children.find(path.substr(start, end - start));
+        node = (child == node->children.end()) ? nullptr : child->second.get();
+        start = end + 1;
+    }
+    if (node)
+        for (int idx : node->rules) consider(idx);
+
+    for (int idx : glob_rules) {
+        if (idx <= best) continue;
+        const Rule &r = rules[idx];
+        if (r.dir_only && !is_dir) continue;
+        if (r.glob->matches(r.anchored ? path : name)) best = idx;
+    }
+    return best >= 0 && !rules[best].negate;
+}
+
+bool IgnoreMatcher::match_path(const string &path, bool is_dir) const {
+    if (rules.empty()) return false;
+    for (size_t slash = path.find('/'); slash != string::npos; slash = path.find('/', slash + 1)) {
+        if (match(path.substr(0, slash), true)) return true;
+    }
+    return match(path, is_dir);
+}
@@ -0,0 +1,59 @@
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// .vcpignore support (gitignore syntax: globs, **, !negation, trailing /
+// for directories, leading or inner / to anchor at the repo root).
+//
+// Patterns are compiled once. Plain names go into a hash map keyed by
+// basename, plain anchored paths into a trie of path components, and only
+// real globs get a small NFA. The last matching pattern wins, as in git.
+class IgnoreMatcher {
+public:
+    // Load patterns from a file; a missing file just means no patterns
+    bool load(const std::string &ignore_file);
+    void add_pattern(const std::string &line);
+    bool empty() const { return rules.empty(); }
+
+    // Is this entry itself ignored? Parents are assumed to be checked
+    // already - this is what the walker calls before opening a directory.
+    bool match(const std::string &path, bool is_dir) const;
+    // Same, but also true when any parent directory is ignored
+    bool match_path(const std::string &path, bool is_dir) const;
+
+private:
+    struct Token {
+        enum Kind { CHAR, ANY, STAR, DSTAR, DSTAR_DIRS, CLASS } kind;
+        char c = 0;
+        bool negated = false;
+        std::vector<std::pair<char, char>> ranges;
+    };
+    struct Glob {
+        std::vector<Token> tokens;
+        bool matches(const std::string &s) const;
+    };
+    struct Rule {
+        bool negate = false;
+        bool dir_only = false;
+        bool anchored = false;
+        std::unique_ptr<Glob> glob;   // null for literal patterns
+    };
+    struct TrieNode {
+        std::map<std::string, std::unique_ptr<TrieNode>> children;
+        std::vector<int> rules;
+    };
+
+    std::vector<Rule> rules;
+    std::unordered_map<std::string, std::vector<int>> by_name;
+    TrieNode anchored_root;
+    std::vector<int> glob_rules;
+
+    static std::unique_ptr<Glob> compile(const std::string &pattern);
+};
+
+#endif // IGNORE_H
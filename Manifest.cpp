@@ -0,0 +1,112 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+#include "Manifest.h"
+#include "Walker.h"
+using namespace std;
+
+bool read_manifest(const string &file, Manifest &m) {
+    ifstream in(file);
+    if (!in) return false;
+    string magic, algo;
+    int version = 0;
+    if (!(in >> magic >> version >> algo) || magic != "vcpmanifest" || version != 1)
+        return false;
+    if (!parse_hash_algo(algo, m.algo)) return false;
+
+    m.files.clear();
+    string line;
+    getline(in, line);
+    while (getline(in, line)) {
+        istringstream iss(line);
+        ManifestEntry e;
+        if (!(iss >> e.hash >> e.size >> e.mtime_ns >> e.ino)) continue;
+        iss.get();  // the space before the path
+        getline(iss, e.path);
+        if (e.path.empty()) continue;
+        m.files[e.path] = e;
+    }
+    return true;
+}
+
+bool write_manifest(const string &file, const Manifest &m) {
+    string tmp = file + ".tmp";
+    {
+        ofstream out(tmp, ios::trunc);
+        if (!out) return false;
+        out << "vcpmanifest 1 " << hash_algo_name(m.algo) << "\n";
+        for (const auto &item : m.files) {
+            const ManifestEntry &e = item.second;
+            out << e.hash << " " << e.size << " " << e.mtime_ns << " " << e.ino
+                << " " << e.path << "\n";
+        }
+        if (!out.flush()) return false;
+    }
+    return rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+int refresh_manifest(const string &root, Manifest &m, bool skip_hidden) {
+    WalkOptions opts;
+    opts.skip_hidden = skip_hidden;
+    opts.want_stat = true;
+    vector<WalkEntry> entries;
+    if (!walk_tree(root, entries, opts)) return -1;
+
+    int changed = 0;
+    map<string, ManifestEntry> fresh;
+    vector<string> stale, abs_paths;
+    for (const auto &e : entries) {
+        if (e.type != WalkEntry::FILE) continue;
+        auto it = m.files.find(e.path);
+        if (it != m.files.end() && it->second.size == e.size &&
+            it->second.mtime_ns == e.mtime_ns && it->second.ino == e.ino) {
+            fresh[e.path] = it->second;
+            continue;
+        }
+        ManifestEntry me;
+        me.path = e.path;
+        me.size = e.size;
+        me.mtime_ns = e.mtime_ns;
+        me.ino = e.ino;
+        fresh[e.path] = me;
+        stale.push_back(e.path);
+        abs_paths.push_back(root + "/" + e.path);
+    }
+
+    // Server project trees: every file is a link to a stored blob
+    vector<string> hashes = hash_files(abs_paths, m.algo, cerr, true);
+    for (size_t i = 0; i < stale.size(); ++i) {
+        if (hashes[i].empty()) {
+            fresh.erase(stale[i]);  // unreadable - leave it out
+            continue;
+        }
+        fresh[stale[i]].hash = hashes[i];
+        changed++;
+    }
+    for (const auto &item : m.files) {
+        if (!fresh.count(item.first)) changed++;
+    }
+    m.files.swap(fresh);
+    return changed;
+}
+
+bool safe_relative_path(const string &path) {
+    std::filesystem::path p(path);
+    if (path.empty() || p.is_absolute()) return false;
+    for (const auto &part : p) {
+        if (part == "..") return false;
+    }
+    return true;
+}
+
+bool path_selected(const string &path, const vector<string> &prefixes) {
+    if (prefixes.empty()) return true;
+    for (const auto &p : prefixes) {
+        if (path.compare(0, p.size(), p) == 0 && (path.size() == p.size() || path[p.size()] == '/'))
+            return true;
+    }
+    return false;
+}
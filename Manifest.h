@@ -0,0 +1,48 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "Hash.h"
+
+// (path, size, hash) listing of a project, plus the stat data the hash was
+// taken from so it can be refreshed without rehashing unchanged files.
+// On disk:
+//
+//   vcpmanifest 1 <algo>
+//   <hash> <size> <mtime_ns> <inode> <path>
+//   ...
+struct ManifestEntry {
+    std::string path;
+    std::string hash;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t ino = 0;
+};
+
+struct Manifest {
+    HashAlgo algo = HashAlgo::SHA256;
+    std::map<std::string, ManifestEntry> files;
+};
+
+bool read_manifest(const std::string &file, Manifest &m);
+// Written to a temp file and renamed into place
+bool write_manifest(const std::string &file, const Manifest &m);
+
+// Bring m in line with the files under root: new or changed (size, mtime
+// or inode differ) files get hashed, vanished ones dropped. Returns the
+// number of entries that changed, -1 if root can't be read. Files under
+// root must not change while it runs (they are mapped for hashing).
+int refresh_manifest(const std::string &root, Manifest &m, bool skip_hidden = false);
+
+// True if path is one of prefixes or lies under one ("src" selects src
+// and src/..., not srcfoo); an empty list selects everything
+bool path_selected(const std::string &path, const std::vector<std::string> &prefixes);
+
+// A relative path that stays under whatever it's joined to: not empty, not
+// absolute, no ".." component ("a..b.txt" is fine)
+bool safe_relative_path(const std::string &path);
+
+#endif // MANIFEST_H
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include "Merkle.h"
+using namespace std;
+
+static string join_path(const string &dir, const string &name) {
+    return dir.empty() ? name : dir + "/" + name;
+}
+
+void MerkleTree::build(const Manifest &m) {
+    hash_algo = m.algo;
+    dirs.clear();
+    dirs[""];
+    for (const auto &kv : m.files) {
+        const string &path = kv.first;
+        size_t slash = path.rfind('/');
+        string parent = slash == string::npos ? "" : path.substr(0, slash);
+        dirs[parent][path.substr(slash + 1)] = MerkleNode{false, kv.second.hash};
+
+        // Link the directory chain up to the top, stopping where it exists
+        while (!parent.empty()) {
+            slash = parent.rfind('/');
+            string up = slash == string::npos ? "" : parent.substr(0, slash);
+            auto inserted = dirs[up].emplace(parent.substr(slash + 1), MerkleNode{true, ""});
+            if (!inserted.second) break;
+            parent = up;
+        }
+    }
+
+    // A directory's path is longer than its parent's, so longest first
+    // hashes every child directory before the directory holding it
+    vector<map<string, Children>::iterator> order;
+    for (auto it = dirs.begin(); it != dirs.end(); ++it) order.push_back(it);
+    stable_sort(order.begin(), order.end(), [](const auto &a, const auto &b) {
+        return a->first.size() > b->first.size();
+    });
+    Hasher hasher(m.algo);
+    for (auto it : order) {
+        hasher.reset();
+        for (const auto &child : it->second) {
+            string line = string(child.second.dir ? "d " : "f ") + child.second.hash + " " + child.first + "\n";
+            hasher.update(line.data(), line.size());
+        }
+        string hash = hasher.final_hex();
+        if (it->first.empty()) {
+            root_hash = hash;
+            continue;
+        }
+        size_t slash = it->first.rfind('/');
+        string up = slash == string::npos ? "" : it->first.substr(0, slash);
+        dirs[up][it->first.substr(slash + 1)].hash = hash;
+    }
+}
+
+const MerkleTree::Children *MerkleTree::children(const string &dir) const {
+    auto it = dirs.find(dir);
+    return it == dirs.end() ? nullptr : &it->second;
+}
+
+void MerkleTree::files_under(const string &dir, vector<string> &out) const {
+    const Children *kids = children(dir);
+    if (!kids) return;
+    for (const auto &child : *kids) {
+        string path = join_path(dir, child.first);
+        if (child.second.dir) files_under(path, out);
+        else out.push_back(path);
+    }
+}
+
+bool merkle_diff(const MerkleTree &local, const string &remote_root, const MerkleFetch &fetch,
+                 vector<string> &changed, size_t *rounds) {
+    if (rounds) *rounds = 0;
+    if (local.root() == remote_root) return true;
+
+    vector<string> level{""};
+    while (!level.empty()) {
+        vector<MerkleTree::Children> remote;
+        if (!fetch(level, remote) || remote.size() != level.size()) return false;
+        if (rounds) (*rounds)++;
+
+        vector<string> next;
+        for (size_t i = 0; i < level.size(); ++i) {
+            const MerkleTree::Children *mine = local.children(level[i]);
+            if (!mine) continue;
+            for (const auto &child : *mine) {
+                string path = join_path(level[i], child.first);
+                auto theirs = remote[i].find(child.first);
+                bool same_kind = theirs != remote[i].end() && theirs->second.dir == child.second.dir;
+                if (same_kind && theirs->second.hash == child.second.hash) continue;
+                if (!child.second.dir) changed.push_back(path);
+                else if (same_kind) next.push_back(path);   // look one level further down
+                else local.files_under(path, changed);     // nothing of it over there
+            }
+        }
+        level.swap(next);
+    }
+    return true;
+}
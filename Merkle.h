@@ -0,0 +1,50 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "Hash.h"
+#include "Manifest.h"
+
+// Hash tree over a project's directories. A file's node is its content
+// hash; a directory's is the hash of its children in name order, one
+// "<f|d> <hash> <name>\n" line each. Equal root hashes mean equal trees,
+// and where two trees differ only subtrees with differing hashes need
+// looking at - a few changed files cost their depth, not the project size.
+struct MerkleNode {
+    bool dir = false;
+    std::string hash;
+};
+
+class MerkleTree {
+public:
+    using Children = std::map<std::string, MerkleNode>;
+
+    void build(const Manifest &m);
+    HashAlgo algo() const { return hash_algo; }
+    const std::string &root() const { return root_hash; }
+    // Listing of a directory ("" = top), nullptr if there's no such directory
+    const Children *children(const std::string &dir) const;
+    // Every file path at or below dir
+    void files_under(const std::string &dir, std::vector<std::string> &out) const;
+
+private:
+    std::map<std::string, Children> dirs;
+    std::string root_hash;
+    HashAlgo hash_algo = HashAlgo::SHA256;
+};
+
+// Asks the other side for its listing of each directory, in order (an
+// empty listing for directories it doesn't have); false if that failed
+using MerkleFetch = std::function<bool(const std::vector<std::string> &dirs,
+                                       std::vector<MerkleTree::Children> &listings)>;
+
+// Files in local that the remote tree doesn't have with the same content,
+// found by descending only into differing directories, one fetch per level.
+// rounds (if given) gets the number of fetches made.
+bool merkle_diff(const MerkleTree &local, const std::string &remote_root, const MerkleFetch &fetch,
+                 std::vector<std::string> &changed, size_t *rounds = nullptr);
+
+#endif // MERKLE_H
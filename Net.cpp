@@ -0,0 +1,412 @@
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include "Net.h"
+using namespace std;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // macOS: sockets get SO_NOSIGPIPE instead
+#endif
+
+bool parse_host_port(const string &addr, string &host, int &port, int default_port) {
+    host = addr;
+    port = default_port;
+    size_t colon;
+    if (!addr.empty() && addr[0] == '[') {
+        // [v6 address] or [v6 address]:port
+        size_t close = addr.find(']');
+        if (close == string::npos) return false;
+        host = addr.substr(1, close - 1);
+        if (close + 1 == addr.size()) return !host.empty();
+        if (addr[close + 1] != ':') return false;
+        colon = close + 1;
+    } else {
+        colon = addr.find(':');
+        // More than one colon: a bare v6 address, no port
+        if (colon != string::npos && addr.find(':', colon + 1) != string::npos) return true;
+    }
+    if (colon != string::npos) {
+        char *end;
+        long p = strtol(addr.c_str() + colon + 1, &end, 10);
+        if (*end != '\0' || p <= 0 || p > 65535) return false;
+        if (addr[0] != '[') host = addr.substr(0, colon);
+        port = (int)p;
+    }
+    if (host.empty()) host = "127.0.0.1";
+    return true;
+}
+
+static bool unix_address(const string &path, sockaddr_un &sa) {
+    sa = sockaddr_un{};
+    sa.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(sa.sun_path)) return false;
+    memcpy(sa.sun_path, path.data(), path.size());
+    return true;
+}
+
+int net_connect(const string &addr, int default_port) {
+    if (addr.rfind("unix:", 0) == 0) {
+        sockaddr_un sa;
+        if (!unix_address(addr.substr(5), sa)) return -1;
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        if (sock >= 0) setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        if (sock >= 0 && connect(sock, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0) {
+            close(sock);
+            sock = -1;
+        }
+        return sock;
+    }
+    string host;
+    int port;
+    if (!parse_host_port(addr, host, port, default_port)) return -1;
+
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res) != 0) return -1;
+    int sock = -1;
+    for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0) continue;
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    return sock;
+}
+
+int net_listen_unix(const string &path) {
+    sockaddr_un sa;
+    if (!unix_address(path, sa)) {
+        cerr << "Unix socket path too long: " << path << "\n";
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        cerr << "Error creating Unix socket.\n";
+        return -1;
+    }
+    // Only replace a socket file nothing is listening on
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) == 0;
+        if (probe >= 0) close(probe);
+        if (live) {
+            cerr << "Something is already listening on " << path << "\n";
+            close(sock);
+            return -1;
+        }
+        unlink(path.c_str());
+    }
+    if (::bind(sock, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 || listen(sock, 64) != 0) {
+        cerr << "Can't listen on " << path << ": " << strerror(errno) << "\n";
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool net_is_local(int sock) {
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    return getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &len) == 0 && addr.ss_family == AF_UNIX;
+}
+
+bool net_send_fd(int sock, int fd, const void *data, size_t len) {
+    if (len == 0) return false;  // the descriptor needs a byte to ride on
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec iov{const_cast<void*>(data), len};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    // The descriptor went with the first byte; the rest is plain data
+    for (size_t off = n; off < len;) {
+        ssize_t m = send(sock, static_cast<const char*>(data) + off, len - off, MSG_NOSIGNAL);
+        if (m <= 0) return false;
+        off += m;
+    }
+    return true;
+}
+
+int net_recv_fd(int sock, void *data, size_t len) {
+    int fd = -1;
+    for (size_t off = 0; off < len;) {
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        iovec iov{static_cast<char*>(data) + off, len - off};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+#ifdef MSG_CMSG_CLOEXEC
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+#else
+        ssize_t n = recvmsg(sock, &msg, 0);
+#endif
+        if (n <= 0) break;
+        for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && fd < 0)
+                memcpy(&fd, CMSG_DATA(c), sizeof(int));
+        }
+        off += n;
+        if (off < len) continue;
+        return fd;
+    }
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+void net_tune(int sock, int timeout_s, int keepalive_s) {
+    timeval tv{timeout_s, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    int on = keepalive_s > 0;
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    if (on) {
+#ifdef TCP_KEEPIDLE
+        int idle = keepalive_s, interval = keepalive_s > 30 ? 10 : (keepalive_s + 2) / 3, count = 4;
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+    }
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
+static SSL_CTX *client_ctx = nullptr, *server_ctx = nullptr;
+static std::atomic<bool> any_tls{false};
+static std::shared_mutex conns_mutex;
+static std::unordered_map<int, SSL*> tls_conns;
+
+static SSL *tls_for(int sock) {
+    if (!any_tls.load(memory_order_relaxed)) return nullptr;
+    shared_lock<shared_mutex> hold(conns_mutex);
+    auto it = tls_conns.find(sock);
+    return it == tls_conns.end() ? nullptr : it->second;
+}
+
+static void tls_error(ostream &err, const string &what) {
+    err << what;
+    unsigned long e = ERR_get_error();
+    if (e) {
+        char buf[256];
+        ERR_error_string_n(e, buf, sizeof(buf));
+        err << ": " << buf;
+    }
+    err << "\n";
+    ERR_clear_error();
+}
+
+static SSL_CTX *new_ctx(const SSL_METHOD *method) {
+    SSL_CTX *ctx = SSL_CTX_new(method);
+    if (!ctx) return nullptr;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);  // OpenSSL 3.0+
+#endif
+    return ctx;
+}
+
+bool tls_init_client(const string &ca_file, ostream &err) {
+    // Connections can be opened from several threads at once (libvcp)
+    static std::mutex init_mutex;
+    lock_guard<mutex> hold(init_mutex);
+    if (client_ctx) return true;
+    // A dropped peer must fail the write, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    SSL_CTX *ctx = new_ctx(TLS_client_method());
+    if (!ctx) {
+        tls_error(err, "Can't set up TLS");
+        return false;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    bool loaded = ca_file.empty() ? SSL_CTX_set_default_verify_paths(ctx)
+                                  : SSL_CTX_load_verify_locations(ctx, ca_file.c_str(), nullptr);
+    if (!loaded) {
+        tls_error(err, "Can't load CA certificates" + (ca_file.empty() ? string() : " from " + ca_file));
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    client_ctx = ctx;
+    return true;
+}
+
+bool tls_init_server(const string &cert_file, const string &key_file) {
+    SSL_CTX *ctx = new_ctx(TLS_server_method());
+    if (!ctx || SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        tls_error(cerr, "Can't load TLS certificate " + cert_file + " / key " + key_file);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    server_ctx = ctx;
+    return true;
+}
+
+static bool tls_start(int sock, SSL *ssl, bool client, ostream &err) {
+    if (!ssl || !SSL_set_fd(ssl, sock)) {
+        tls_error(err, "Can't set up TLS connection");
+        SSL_free(ssl);
+        return false;
+    }
+    if ((client ? SSL_connect(ssl) : SSL_accept(ssl)) != 1) {
+        long verify = SSL_get_verify_result(ssl);
+        if (verify != X509_V_OK)
+            err << "TLS certificate check failed: " << X509_verify_cert_error_string(verify) << "\n";
+        tls_error(err, "TLS handshake failed");
+        SSL_free(ssl);
+        return false;
+    }
+    any_tls = true;
+    lock_guard<shared_mutex> hold(conns_mutex);
+    tls_conns[sock] = ssl;
+    return true;
+}
+
+bool tls_connect(int sock, const string &host, ostream &err) {
+    if (!client_ctx) return false;
+    SSL *ssl = SSL_new(client_ctx);
+    if (ssl) {
+        // Check the certificate names the server we meant to reach
+        in6_addr ip;
+        bool literal = inet_pton(AF_INET, host.c_str(), &ip) == 1 || inet_pton(AF_INET6, host.c_str(), &ip) == 1;
+        X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+        if (literal) {
+            X509_VERIFY_PARAM_set1_ip_asc(param, host.c_str());
+        } else {
+            X509_VERIFY_PARAM_set1_host(param, host.c_str(), 0);
+            SSL_set_tlsext_host_name(ssl, host.c_str());
+        }
+    }
+    return tls_start(sock, ssl, true, err);
+}
+
+bool tls_accept(int sock) {
+    return server_ctx && tls_start(sock, SSL_new(server_ctx), false, cerr);
+}
+
+bool tls_hello_waiting(int sock) {
+    unsigned char first;
+    // Plain requests start with a big-endian string length, so 0x00;
+    // a TLS ClientHello starts with record type 0x16
+    return recv(sock, &first, 1, MSG_PEEK) == 1 && first == 0x16;
+}
+
+string net_describe(int sock) {
+    SSL *ssl = tls_for(sock);
+    if (!ssl) return net_is_local(sock) ? "Unix socket" : "plain TCP";
+#ifdef SSL_OP_ENABLE_KTLS
+    bool ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    bool ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    bool ktls_send = false, ktls_recv = false;
+#endif
+    string mode = ktls_send && ktls_recv ? "kernel TLS send+recv"
+                : ktls_send              ? "kernel TLS send"
+                : ktls_recv              ? "kernel TLS recv"
+                                         : "user-space TLS";
+    return string(SSL_get_version(ssl)) + " " + SSL_get_cipher_name(ssl) + ", " + mode;
+}
+
+ssize_t net_send(int sock, const void *data, size_t len) {
+    SSL *ssl = tls_for(sock);
+    if (!ssl) return send(sock, data, len, MSG_NOSIGNAL);
+    size_t written = 0;
+    if (len == 0) return 0;
+    return SSL_write_ex(ssl, data, len, &written) == 1 ? (ssize_t)written : -1;
+}
+
+ssize_t net_recv(int sock, void *data, size_t len) {
+    SSL *ssl = tls_for(sock);
+    if (!ssl) return recv(sock, data, len, 0);
+    size_t got = 0;
+    if (SSL_read_ex(ssl, data, len, &got) == 1) return (ssize_t)got;
+    return SSL_get_error(ssl, 0) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+bool net_readable(int sock, int timeout_ms) {
+    SSL *ssl = tls_for(sock);
+    if (ssl && SSL_pending(ssl) > 0) return true;
+    pollfd pfd{sock, POLLIN, 0};
+    int n;
+    while ((n = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) {}
+    return n != 0;
+}
+
+ssize_t net_sendfile(int sock, int file_fd, uint64_t offset, size_t len) {
+    SSL *ssl = tls_for(sock);
+#ifdef __linux__
+    if (!ssl) {
+        off_t off = (off_t)offset;
+        return sendfile(sock, file_fd, &off, len);
+    }
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ssl && BIO_get_ktls_send(SSL_get_wbio(ssl))) return SSL_sendfile(ssl, file_fd, (off_t)offset, len, 0);
+#endif
+    static thread_local vector<char> buf(256 * 1024);
+    ssize_t n = pread(file_fd, buf.data(), min(len, buf.size()), (off_t)offset);
+    if (n <= 0) return -1;
+    return net_send(sock, buf.data(), n);
+}
+
+void net_close(int sock) {
+    SSL *ssl = nullptr;
+    if (any_tls.load(memory_order_relaxed)) {
+        lock_guard<shared_mutex> hold(conns_mutex);
+        auto it = tls_conns.find(sock);
+        if (it != tls_conns.end()) {
+            ssl = it->second;
+            tls_conns.erase(it);
+        }
+    }
+    if (ssl) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+    close(sock);
+}
@@ -0,0 +1,73 @@
+#ifndef NET_H
+#define NET_H
+
+// Bits of socket plumbing shared by the client and vcpserver
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <arpa/inet.h>
+#include <sys/types.h>
+
+// macOS has htonll/ntohll, glibc doesn't
+#ifndef htonll
+#if defined(__linux__)
+#include <endian.h>
+#define htonll(x) htobe64(x)
+#define ntohll(x) be64toh(x)
+#endif
+#endif
+
+// Split "host[:port]" or "[v6 address][:port]"; an address with several
+// colons and no brackets is a bare v6 address. port stays default_port
+// when not given.
+bool parse_host_port(const std::string &addr, std::string &host, int &port, int default_port);
+// Connection to "host[:port]" over TCP, or to "unix:/path" over a Unix
+// domain socket; -1 if it can't be made
+int net_connect(const std::string &addr, int default_port);
+// Listening Unix domain socket at path (a stale socket file there is
+// replaced); -1 with the reason on cerr if that fails
+int net_listen_unix(const std::string &path);
+// Peer is on this machine, over a Unix domain socket. Such connections
+// can carry open files (net_send_fd) instead of their bytes.
+bool net_is_local(int sock);
+// len bytes of data with fd attached (SCM_RIGHTS); false if that failed
+bool net_send_fd(int sock, int fd, const void *data, size_t len);
+// Exactly len bytes, and the descriptor that came with them (-1 if none
+// did or the read failed)
+int net_recv_fd(int sock, void *data, size_t len);
+// Options for a transfer socket: send/receive calls give up after
+// timeout_s seconds without progress (0 = wait forever), a silent peer is
+// probed after keepalive_s idle seconds (0 = no keepalive), and small
+// protocol messages go out without waiting on Nagle
+void net_tune(int sock, int timeout_s, int keepalive_s);
+
+// Every byte on a vcp connection goes through these, so the protocol code
+// doesn't care whether a connection is plain TCP or TLS. Same return
+// conventions as send()/recv().
+ssize_t net_send(int sock, const void *data, size_t len);
+ssize_t net_recv(int sock, void *data, size_t len);
+// Something to read (or the peer hung up) within timeout_ms milliseconds
+// (0 = just check, -1 = wait forever)
+bool net_readable(int sock, int timeout_ms);
+// Up to len bytes of file_fd from offset: sendfile() on plain TCP (Linux),
+// SSL_sendfile() when the kernel does the TLS, read + send otherwise
+ssize_t net_sendfile(int sock, int file_fd, uint64_t offset, size_t len);
+void net_close(int sock);
+
+// Optional TLS 1.3. Each side sets up its context once, then handshakes
+// on every connection right after connect()/accept(). Kernel TLS is asked
+// for, so with a kernel that has it records are encrypted in the kernel
+// and sendfile() stays zero-copy; without it (or with OpenSSL before 3.0)
+// OpenSSL does the work.
+// Errors go to err (the server's always to cerr).
+bool tls_init_client(const std::string &ca_file, std::ostream &err = std::cerr);  // "" = system CAs
+bool tls_init_server(const std::string &cert_file, const std::string &key_file);
+bool tls_connect(int sock, const std::string &host, std::ostream &err = std::cerr);
+bool tls_accept(int sock);
+// Peer opened with a TLS handshake record (peeks, consumes nothing)
+bool tls_hello_waiting(int sock);
+// "plain TCP", "Unix socket", or e.g. "TLSv1.3 TLS_AES_256_GCM_SHA384, kernel TLS send+recv"
+std::string net_describe(int sock);
+
+#endif // NET_H
@@ -0,0 +1,138 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+#include "ObjectCache.h"
+using namespace std;
+namespace fs = std::filesystem;
+
+ObjectCache::ObjectCache(HashAlgo algo) : hash_algo(algo) {
+    string base;
+    if (const char *xdg = getenv("XDG_CACHE_HOME")) base = xdg;
+    else if (const char *home = getenv("HOME")) base = string(home) + "/.cache";
+    if (base.empty()) return;
+
+    string d = base + "/vcp/objects/" + hash_algo_name(algo);
+    error_code ec;
+    fs::create_directories(d + "/tmp", ec);
+    if (ec || access(d.c_str(), W_OK) != 0) return;
+    dir = d;
+
+    const char *hl = getenv("VCP_CACHE_HARDLINK");
+    allow_hardlink = hl && string(hl) == "1";
+}
+
+string ObjectCache::object_path(const string &hash) const {
+    return dir + "/" + hash.substr(0, 2) + "/" + hash.substr(2);
+}
+
+bool ObjectCache::has(const string &hash, uint64_t size) const {
+    if (!available() || hash.size() < 3) return false;
+    struct stat st;
+    return stat(object_path(hash).c_str(), &st) == 0 && (uint64_t)st.st_size == size;
+}
+
+// Unique across every cache object in the process (libvcp runs several at once)
+static std::atomic<unsigned> temp_counter{0};
+
+string ObjectCache::temp_path() {
+    return dir + "/tmp/" + to_string(getpid()) + "." + to_string(temp_counter++);
+}
+
+bool ObjectCache::commit(const string &tmp, const string &hash) {
+    string final_path = object_path(hash);
+    error_code ec;
+    fs::create_directories(fs::path(final_path).parent_path(), ec);
+    // Read-only, so a hardlinked checkout can't be edited in place by accident
+    chmod(tmp.c_str(), 0444);
+    if (rename(tmp.c_str(), final_path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Whole-file copy without going through user space where the kernel allows it
+static bool copy_fd(int in, int out) {
+#ifdef __linux__
+    while (true) {
+        ssize_t n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0);
+        if (n == 0) return true;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;  // EXDEV/ENOSYS/EINVAL: do it by hand
+        }
+    }
+    if (lseek(in, 0, SEEK_SET) < 0 || lseek(out, 0, SEEK_SET) < 0 || ftruncate(out, 0) != 0)
+        return false;
+#endif
+    char buf[128 * 1024];
+    while (true) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) return true;
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(out, buf + off, n - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return false;
+            off += w;
+        }
+    }
+}
+
+bool ObjectCache::checkout(const string &hash, const string &dest) {
+    string src = object_path(hash);
+
+#ifdef __APPLE__
+    if (clonefile(src.c_str(), dest.c_str(), 0) == 0) {
+        chmod(dest.c_str(), 0644);
+        return true;
+    }
+#endif
+    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    int out = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+#ifdef FICLONE
+    // Copy-on-write clone on btrfs/XFS: instant, no data blocks written
+    if (ioctl(out, FICLONE, in) == 0) {
+        close(in);
+        return close(out) == 0;
+    }
+#endif
+    if (allow_hardlink) {
+        close(out);
+        unlink(dest.c_str());
+        if (link(src.c_str(), dest.c_str()) == 0) {
+            close(in);
+            return true;
+        }
+        out = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) {
+            close(in);
+            return false;
+        }
+    }
+
+    bool ok = copy_fd(in, out);
+    close(in);
+    if (close(out) != 0) ok = false;
+    if (!ok) unlink(dest.c_str());
+    return ok;
+}
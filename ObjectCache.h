@@ -0,0 +1,39 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include "Hash.h"
+
+// Per-user content addressed store shared by every clone on the machine:
+// $XDG_CACHE_HOME/vcp/objects/<algo>/<aa>/<rest of hash>
+// (~/.cache when XDG_CACHE_HOME isn't set). Objects are written once,
+// verified against their hash, and never modified afterwards.
+class ObjectCache {
+public:
+    explicit ObjectCache(HashAlgo algo);
+
+    // False when there's no usable cache dir (no $HOME, read-only, ...)
+    bool available() const { return !dir.empty(); }
+    HashAlgo algo() const { return hash_algo; }
+    std::string object_path(const std::string &hash) const;
+    bool has(const std::string &hash, uint64_t size) const;
+
+    // Fresh temp file path inside the cache (same filesystem, so the
+    // final rename is atomic)
+    std::string temp_path();
+    // Move a fully written and verified temp file into place
+    bool commit(const std::string &tmp, const std::string &hash);
+
+    // Put a private copy of an object at dest, cheapest way first:
+    // reflink (FICLONE / clonefile), hardlink when VCP_CACHE_HARDLINK=1,
+    // copy_file_range, plain read/write.
+    bool checkout(const std::string &hash, const std::string &dest);
+
+private:
+    HashAlgo hash_algo;
+    std::string dir;
+    bool allow_hardlink = false;
+};
+
+#endif // OBJECT_CACHE_H
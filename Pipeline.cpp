@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <unistd.h>
+#include "Pipeline.h"
+#include "FileReader.h"
+using namespace std;
+namespace fs = std::filesystem;
+
+BufferPool::BufferPool(size_t buffer_size, size_t count) : size(buffer_size) {
+    for (size_t i = 0; i < count; ++i) {
+        storage.emplace_back(new char[buffer_size]);
+        free_list.push_back(storage.back().get());
+    }
+}
+
+char *BufferPool::take() {
+    unique_lock<mutex> hold(mutex_);
+    available.wait(hold, [this]() { return closed || !free_list.empty(); });
+    if (closed) return nullptr;
+    char *buf = free_list.back();
+    free_list.pop_back();
+    return buf;
+}
+
+void BufferPool::give(char *buf) {
+    if (!buf) return;
+    {
+        lock_guard<mutex> hold(mutex_);
+        free_list.push_back(buf);
+    }
+    available.notify_one();
+}
+
+void BufferPool::close() {
+    {
+        lock_guard<mutex> hold(mutex_);
+        closed = true;
+    }
+    available.notify_all();
+}
+
+FilePrefetcher::FilePrefetcher(vector<string> file_paths, size_t buffer_size, size_t buffers)
+    : paths(std::move(file_paths)), pool(buffer_size, buffers) {
+    worker = thread([this]() { run(); });
+}
+
+FilePrefetcher::~FilePrefetcher() {
+    {
+        lock_guard<mutex> hold(mutex_);
+        stopping = true;
+    }
+    pool.close();
+    worker.join();
+}
+
+void FilePrefetcher::push(const Chunk &c) {
+    {
+        lock_guard<mutex> hold(mutex_);
+        ready.push_back(c);
+    }
+    ready_cv.notify_one();
+}
+
+void FilePrefetcher::run() {
+    FileReader file;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        Chunk c;
+        c.file = i;
+        c.first = true;
+        if (!file.open(paths[i])) {
+            c.error = true;
+            push(c);
+            break;
+        }
+        c.file_size = file.size();
+
+        // Copy the reader's windows into pool buffers, filling each one
+        // before handing it over. Stop at the size we announced even if
+        // the file grew meanwhile; running out early is an error.
+        uint64_t remaining = c.file_size;
+        const char *data = nullptr;
+        size_t avail = 0;
+        bool failed = false;
+        do {
+            c.data = pool.take();
+            if (!c.data) break;
+            c.len = 0;
+            while (c.len < pool.buffer_size() && remaining > 0) {
+                if (avail == 0 && !file.next(data, avail)) {
+                    failed = true;
+                    break;
+                }
+                size_t n = (size_t)min<uint64_t>({avail, pool.buffer_size() - c.len, remaining});
+                memcpy(c.data + c.len, data, n);
+                c.len += n;
+                data += n;
+                avail -= n;
+                remaining -= n;
+            }
+            c.last = remaining == 0;
+            c.error = failed;
+            push(c);
+            c.first = false;
+        } while (!c.last && !failed);
+        file.close();
+        if (!c.data || failed) break;
+
+        lock_guard<mutex> hold(mutex_);
+        if (stopping) break;
+    }
+    {
+        lock_guard<mutex> hold(mutex_);
+        finished = true;
+    }
+    ready_cv.notify_one();
+}
+
+bool FilePrefetcher::next(Chunk &c) {
+    unique_lock<mutex> hold(mutex_);
+    ready_cv.wait(hold, [this]() { return finished || !ready.empty(); });
+    if (ready.empty()) return false;
+    c = ready.front();
+    ready.pop_front();
+    return true;
+}
+
+void FilePrefetcher::release(const Chunk &c) {
+    pool.give(c.data);
+}
+
+WriteBehind::WriteBehind(Done done_fn, size_t buffer_size, size_t buffers)
+    : hashing(false), done(std::move(done_fn)), pool(buffer_size, buffers) {
+    worker = thread([this]() { run(); });
+}
+
+WriteBehind::WriteBehind(HashAlgo algo, Done done_fn, size_t buffer_size, size_t buffers)
+    : hashing(true), hasher(algo), done(std::move(done_fn)), pool(buffer_size, buffers) {
+    worker = thread([this]() { run(); });
+}
+
+WriteBehind::~WriteBehind() {
+    finish();
+    {
+        lock_guard<mutex> hold(mutex_);
+        stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+void WriteBehind::push(Task t) {
+    {
+        lock_guard<mutex> hold(mutex_);
+        queue.push_back(std::move(t));
+    }
+    changed.notify_all();
+}
+
+void WriteBehind::begin_file(size_t file, const string &path) {
+    push(Task{Task::BEGIN, file, path, nullptr, 0});
+}
+
+void WriteBehind::write(char *buf, size_t len) {
+    push(Task{Task::DATA, 0, string(), buf, len});
+}
+
+void WriteBehind::end_file() {
+    push(Task{Task::END, 0, string(), nullptr, 0});
+}
+
+void WriteBehind::finish() {
+    unique_lock<mutex> hold(mutex_);
+    changed.wait(hold, [this]() { return queue.empty() && idle; });
+}
+
+void WriteBehind::run() {
+    int fd = -1;
+    size_t file = 0;
+    bool ok = false;
+    while (true) {
+        Task t;
+        {
+            unique_lock<mutex> hold(mutex_);
+            idle = true;
+            changed.notify_all();
+            changed.wait(hold, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            t = std::move(queue.front());
+            queue.pop_front();
+            idle = false;
+        }
+
+        switch (t.kind) {
+        case Task::BEGIN: {
+            file = t.file;
+            fs::path parent = fs::path(t.path).parent_path();
+            std::error_code ec;
+            if (!parent.empty()) fs::create_directories(parent, ec);
+            fd = ::open(t.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            ok = fd >= 0;
+            if (hashing) hasher.reset();
+            break;
+        }
+        case Task::DATA:
+            // Once a file has failed its remaining data is just drained
+            for (size_t off = 0; ok && off < t.len;) {
+                ssize_t n = ::write(fd, t.buf + off, t.len - off);
+                if (n <= 0) ok = false;
+                else off += n;
+            }
+            if (ok && hashing) hasher.update(t.buf, t.len);
+            pool.give(t.buf);
+            break;
+        case Task::END:
+            if (fd >= 0 && ::close(fd) != 0) ok = false;
+            fd = -1;
+            if (done) done(file, ok, ok && hashing ? hasher.final_hex() : string());
+            break;
+        }
+    }
+}
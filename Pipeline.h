@@ -0,0 +1,125 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Hash.h"
+
+// Fixed set of large buffers handed back and forth between two threads.
+// take() blocks while every buffer is in use, which is what keeps the
+// faster side from running arbitrarily far ahead of the slower one.
+class BufferPool {
+public:
+    BufferPool(size_t buffer_size, size_t count);
+    size_t buffer_size() const { return size; }
+    // nullptr once closed
+    char *take();
+    void give(char *buf);
+    // Wake anyone waiting in take(); used when shutting down
+    void close();
+
+private:
+    size_t size;
+    bool closed = false;
+    std::vector<std::unique_ptr<char[]>> storage;
+    std::vector<char*> free_list;
+    std::mutex mutex_;
+    std::condition_variable available;
+};
+
+// Upload side: a background thread reads the given files in order into
+// pool buffers while the caller sends what's already been read, so disk
+// reads overlap network writes instead of taking turns with them.
+class FilePrefetcher {
+public:
+    struct Chunk {
+        size_t file = 0;        // index into the paths given
+        uint64_t file_size = 0; // size when opened; exactly this much is delivered
+        char *data = nullptr;
+        size_t len = 0;
+        bool first = false, last = false;
+        bool error = false;     // file unreadable or shrank; nothing else follows
+    };
+
+    explicit FilePrefetcher(std::vector<std::string> paths, size_t buffer_size = 4 << 20,
+                            size_t buffers = 4);
+    ~FilePrefetcher();
+    FilePrefetcher(const FilePrefetcher&) = delete;
+    FilePrefetcher &operator=(const FilePrefetcher&) = delete;
+
+    // Next chunk in file order; false once everything has been handed out
+    bool next(Chunk &c);
+    // Done with a chunk's data
+    void release(const Chunk &c);
+
+private:
+    void run();
+    void push(const Chunk &c);
+
+    std::vector<std::string> paths;
+    BufferPool pool;
+    std::mutex mutex_;
+    std::condition_variable ready_cv;
+    std::deque<Chunk> ready;
+    bool finished = false;
+    bool stopping = false;
+    std::thread worker;
+};
+
+// Download side: the caller recv()s into pool buffers and queues them; a
+// background thread writes (and optionally hashes) them, so a slow disk
+// doesn't stall the socket and a slow socket doesn't leave the disk idle.
+class WriteBehind {
+public:
+    // Runs on the writer thread once a file is on disk (ok) or has failed.
+    // hash is "" when not hashing.
+    using Done = std::function<void(size_t file, bool ok, const std::string &hash)>;
+
+    explicit WriteBehind(Done done, size_t buffer_size = 1 << 20, size_t buffers = 8);
+    WriteBehind(HashAlgo algo, Done done, size_t buffer_size = 1 << 20, size_t buffers = 8);
+    ~WriteBehind();
+    WriteBehind(const WriteBehind&) = delete;
+    WriteBehind &operator=(const WriteBehind&) = delete;
+
+    // Files are written one after another: begin, any number of writes, end
+    void begin_file(size_t file, const std::string &path);
+    // A free buffer of buffer_size() bytes to fill
+    char *buffer() { return pool.take(); }
+    size_t buffer_size() const { return pool.buffer_size(); }
+    void write(char *buf, size_t len);
+    void end_file();
+    // Wait until everything queued is on disk (and every Done has run)
+    void finish();
+
+private:
+    struct Task {
+        enum { BEGIN, DATA, END } kind;
+        size_t file;
+        std::string path;
+        char *buf;
+        size_t len;
+    };
+    void run();
+    void push(Task t);
+
+    bool hashing;
+    Hasher hasher;
+    Done done;
+    BufferPool pool;
+    std::mutex mutex_;
+    std::condition_variable changed;
+    std::deque<Task> queue;
+    bool stopping = false;
+    bool idle = true;
+    std::thread worker;
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,88 @@
+#include <iomanip>
+#include <iostream>
+#include <streambuf>
+#include "Progress.h"
+using namespace std;
+
+// Collects what's written into lines and hands each to a function
+class Reporter::LineBuf : public streambuf {
+public:
+    explicit LineBuf(function<void(const string &)> emit) : emit(std::move(emit)) {}
+    ~LineBuf() override {
+        if(!line.empty()) emit(line);
+    }
+
+protected:
+    int overflow(int c) override {
+        if(c == traits_type::eof()) return traits_type::not_eof(c);
+        put(traits_type::to_char_type(c));
+        return c;
+    }
+    streamsize xsputn(const char *s, streamsize n) override {
+        for(streamsize i = 0; i < n; ++i) put(s[i]);
+        return n;
+    }
+
+private:
+    void put(char c) {
+        if(c != '\n') {
+            line += c;
+            return;
+        }
+        emit(line);
+        line.clear();
+    }
+    function<void(const string &)> emit;
+    string line;
+};
+
+Reporter::Reporter() : out_stream(&cout), err_stream(&cerr) {}
+
+Reporter::Reporter(ProgressFn f) : fn(std::move(f)) {
+    out_buf.reset(new LineBuf([this](const string &line) {
+        if(!fn) return;
+        ProgressEvent e;
+        e.kind = ProgressEvent::MESSAGE;
+        e.text = line;
+        fn(e);
+    }));
+    err_buf.reset(new LineBuf([this](const string &line) {
+        error_line = line;
+        if(!fn) return;
+        ProgressEvent e;
+        e.kind = ProgressEvent::WARNING;
+        e.text = line;
+        fn(e);
+    }));
+    own_out.reset(new ostream(out_buf.get()));
+    own_err.reset(new ostream(err_buf.get()));
+    out_stream = own_out.get();
+    err_stream = own_err.get();
+}
+
+Reporter::~Reporter() {
+    // Streams first: they write through the buffers
+    own_out.reset();
+    own_err.reset();
+    out_buf.reset();
+    err_buf.reset();
+}
+
+void Reporter::transfer(ProgressEvent::Kind kind, const string &path, uint64_t done, uint64_t total) {
+    if(own_out) {
+        if(!fn) return;
+        ProgressEvent e;
+        e.kind = kind;
+        e.path = path;
+        e.done = done;
+        e.total = total;
+        fn(e);
+        return;
+    }
+    ostream &shown = progress_to_err ? cerr : cout;
+    double pct = (total > 0) ? (100.0 * done / total) : 100.0;
+    shown << (kind == ProgressEvent::UPLOAD ? "Uploading: " : "Downloading: ") << path << " - " << done
+          << "/" << total << " bytes (" << fixed << setprecision(1) << pct << "% )\r";
+    if(done >= total) shown << endl;
+    shown.flush();
+}
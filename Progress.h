@@ -0,0 +1,60 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+
+// What an operation has to say while it runs. The command line prints it;
+// a program using libvcp can take it as events instead (see VCPClient.h).
+struct ProgressEvent {
+    enum Kind {
+        MESSAGE,   // a line about what's going on
+        WARNING,   // a line about something that went wrong
+        UPLOAD,    // done of total bytes of path sent
+        DOWNLOAD,  // done of total bytes of path received
+    };
+    Kind kind = MESSAGE;
+    std::string text;  // MESSAGE/WARNING: one line, no newline
+    std::string path;  // UPLOAD/DOWNLOAD
+    uint64_t done = 0;
+    uint64_t total = 0;
+};
+
+using ProgressFn = std::function<void(const ProgressEvent &)>;
+
+// Where one operation's output goes: stdout and stderr, or with a callback,
+// events (out() lines become MESSAGEs and err() lines WARNINGs). One per
+// operation; it isn't shared between threads.
+class Reporter {
+public:
+    Reporter();
+    explicit Reporter(ProgressFn fn);
+    ~Reporter();
+    Reporter(const Reporter &) = delete;
+    Reporter &operator=(const Reporter &) = delete;
+
+    std::ostream &out() { return *out_stream; }
+    std::ostream &err() { return *err_stream; }
+    // Bytes of a file moved so far (ProgressEvent::UPLOAD/DOWNLOAD). On a
+    // terminal it's a line redrawn in place, ended once done reaches total.
+    void transfer(ProgressEvent::Kind kind, const std::string &path, uint64_t done, uint64_t total);
+    // Last line written to err(), for callers that want it as the reason
+    const std::string &last_error() const { return error_line; }
+
+    // Transfer lines go to stderr (when stdout carries the command's output)
+    bool progress_to_err = false;
+
+private:
+    class LineBuf;
+    ProgressFn fn;
+    std::string error_line;
+    std::unique_ptr<LineBuf> out_buf, err_buf;
+    std::unique_ptr<std::ostream> own_out, own_err;
+    std::ostream *out_stream;
+    std::ostream *err_stream;
+};
+
+#endif // PROGRESS_H
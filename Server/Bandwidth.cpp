@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+#include "Bandwidth.h"
+using namespace std;
+
+BandwidthScheduler bandwidth;
+
+static thread_local Flow *current_flow = nullptr;
+
+static const char *class_names[] = {"interactive", "normal", "bulk"};
+
+static int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool parse_byte_size(const string &text, uint64_t &bytes) {
+    char *end;
+    double v = strtod(text.c_str(), &end);
+    if (end == text.c_str() || v < 0) return false;
+    string unit(end);
+    double mult = 1;
+    if (unit == "k" || unit == "K") mult = 1024.0;
+    else if (unit == "m" || unit == "M") mult = 1024.0 * 1024;
+    else if (unit == "g" || unit == "G") mult = 1024.0 * 1024 * 1024;
+    else if (!unit.empty()) return false;
+    bytes = (uint64_t)(v * mult);
+    return true;
+}
+
+static string human_bytes(double b) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int u = 0;
+    while (b >= 1024 && u < 4) {
+        b /= 1024;
+        u++;
+    }
+    ostringstream out;
+    out << fixed << setprecision(u ? 1 : 0) << b << " " << units[u];
+    return out.str();
+}
+
+BandwidthScheduler::BandwidthScheduler() : last_refill_ns(now_ns()) {}
+
+double BandwidthScheduler::burst_for(uint64_t rate) const {
+    return burst ? (double)burst : (double)rate;
+}
+
+void BandwidthScheduler::refill() {
+    int64_t now = now_ns();
+    double dt = (now - last_refill_ns) / 1e9;
+    last_refill_ns = now;
+    if (global_rate) {
+        global_tokens = min(burst_for(global_rate), global_tokens + global_rate * dt);
+    }
+    if (client_rate) {
+        double cap = burst_for(client_rate);
+        for (auto it = clients.begin(); it != clients.end();) {
+            it->second.tokens = min(cap, it->second.tokens + client_rate * dt);
+            // A full bucket is the same as a new one - no need to keep it
+            if (it->second.tokens >= cap) it = clients.erase(it);
+            else ++it;
+        }
+    }
+}
+
+void BandwidthScheduler::acquire(Flow &flow, size_t bytes) {
+    if (!limited.load(memory_order_relaxed) || bytes == 0) return;
+
+    unique_lock<mutex> hold(mutex_);
+    int c = (int)flow.cls;
+    Ticket t{flow.cls, max(virtual_time, flow.last_finish) + bytes / weights[c], next_seq++, &flow.client};
+    flow.last_finish = t.tag;
+    waiting.insert(t);
+
+    auto client_tokens = [this](const string &client) {
+        auto it = clients.find(client);
+        return it == clients.end() ? burst_for(client_rate) : it->second.tokens;
+    };
+    while (limited) {
+        refill();
+        // First ticket in fair order whose client may still send
+        const Ticket *pick = nullptr;
+        double client_wait = 1;
+        for (const auto &w : waiting) {
+            double tokens = client_rate ? client_tokens(*w.client) : 1;
+            if (tokens > 0) {
+                pick = &w;
+                break;
+            }
+            client_wait = min(client_wait, -tokens / client_rate);
+        }
+        bool global_ok = global_rate == 0 || global_tokens > 0;
+        if (pick && pick->seq == t.seq && global_ok) break;
+
+        // Sleep until a token could make someone eligible; a grant to
+        // another ticket wakes us sooner
+        double wait_s = 0.1;
+        if (!global_ok) wait_s = -global_tokens / global_rate;
+        else if (!pick) wait_s = client_wait;
+        changed.wait_for(hold, chrono::duration<double>(min(max(wait_s, 0.0005), 0.1)));
+    }
+
+    waiting.erase(t);
+    virtual_time = max(virtual_time, t.tag);
+    if (global_rate) global_tokens -= bytes;
+    if (client_rate) {
+        auto it = clients.find(flow.client);
+        if (it == clients.end()) it = clients.emplace(flow.client, Bucket{burst_for(client_rate)}).first;
+        it->second.tokens -= bytes;
+    }
+    granted[c] += bytes;
+    changed.notify_all();
+}
+
+void BandwidthScheduler::set_global_rate(uint64_t rate) {
+    lock_guard<mutex> hold(mutex_);
+    refill();
+    global_rate = rate;
+    global_tokens = burst_for(rate);
+    limited = global_rate || client_rate;
+    changed.notify_all();
+}
+
+void BandwidthScheduler::set_client_rate(uint64_t rate) {
+    lock_guard<mutex> hold(mutex_);
+    refill();
+    client_rate = rate;
+    clients.clear();
+    limited = global_rate || client_rate;
+    changed.notify_all();
+}
+
+void BandwidthScheduler::set_burst(uint64_t bytes) {
+    lock_guard<mutex> hold(mutex_);
+    burst = bytes;
+    global_tokens = min(global_tokens, burst_for(global_rate));
+    changed.notify_all();
+}
+
+void BandwidthScheduler::set_weight(TrafficClass cls, double weight) {
+    lock_guard<mutex> hold(mutex_);
+    weights[(int)cls] = weight;
+}
+
+string BandwidthScheduler::describe() {
+    lock_guard<mutex> hold(mutex_);
+    ostringstream out;
+    out << "global limit: " << (global_rate ? human_bytes(global_rate) + "/s" : "unlimited") << "\n"
+        << "client limit: " << (client_rate ? human_bytes(client_rate) + "/s" : "unlimited") << "\n"
+        << "burst: " << (burst ? human_bytes(burst) : "1s of rate") << "\n"
+        << "weights:";
+    for (int c = 0; c < 3; ++c) out << " " << class_names[c] << "=" << weights[c];
+    out << "\nwaiting: " << waiting.size() << "\nsent under limits:";
+    for (int c = 0; c < 3; ++c) out << " " << class_names[c] << "=" << human_bytes(granted[c]);
+    out << "\n";
+    return out.str();
+}
+
+string BandwidthScheduler::admin(const string &command) {
+    istringstream in(command);
+    string verb, what, value, extra;
+    in >> verb >> what >> value >> extra;
+    if (verb.empty() || verb == "show") return describe();
+    if (verb != "set") return "unknown admin command: " + command + "\n";
+
+    if (what == "weight") {
+        int c = -1;
+        for (int i = 0; i < 3; ++i)
+            if (value == class_names[i]) c = i;
+        double w = atof(extra.c_str());
+        if (c < 0 || !(w > 0)) return "usage: set weight interactive|normal|bulk <weight>\n";
+        set_weight((TrafficClass)c, w);
+        return describe();
+    }
+    uint64_t bytes;
+    if (!parse_byte_size(value, bytes)) return "bad size: " + value + " (use e.g. 50M, 0 = unlimited)\n";
+    if (what == "global") set_global_rate(bytes);
+    else if (what == "client") set_client_rate(bytes);
+    else if (what == "burst") set_burst(bytes);
+    else return "usage: set global|client|burst <bytes>\n";
+    return describe();
+}
+
+FlowScope::FlowScope(const string &client, TrafficClass cls) : outer(current_flow) {
+    flow.client = client;
+    flow.cls = cls;
+    current_flow = &flow;
+}
+
+FlowScope::~FlowScope() {
+    current_flow = outer;
+}
+
+void throttle(size_t bytes, uint64_t transfer_size) {
+    Flow *flow = current_flow;
+    if (!flow) return;
+    if (flow->cls == TrafficClass::NORMAL && transfer_size < (1 << 20)) {
+        flow->cls = TrafficClass::INTERACTIVE;
+        bandwidth.acquire(*flow, bytes);
+        flow->cls = TrafficClass::NORMAL;
+        return;
+    }
+    bandwidth.acquire(*flow, bytes);
+}
@@ -0,0 +1,105 @@
+#ifndef BANDWIDTH_H
+#define BANDWIDTH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+// Who goes first when bandwidth is short. Classes are strict priorities;
+// within a class connections share by weight.
+enum class TrafficClass { INTERACTIVE, NORMAL, BULK };
+
+// One connection's share of the scheduler
+struct Flow {
+    std::string client;     // peer address - per-client limits key on this
+    TrafficClass cls = TrafficClass::NORMAL;
+    double last_finish = 0; // WFQ finish tag of its last grant
+};
+
+// Server-wide file data scheduler. Every chunk of file data a handler sends
+// or receives first asks for that many bytes:
+//  - a global token bucket and one bucket per client cap the rates
+//  - waiting requests are granted in weighted fair queuing order (lowest
+//    virtual finish tag first), so a bulk clone and a small submit share
+//    the link by weight instead of by who calls send() fastest
+// With no limits set there is nothing to share and acquire() returns
+// straight away.
+class BandwidthScheduler {
+public:
+    BandwidthScheduler();
+
+    void acquire(Flow &flow, size_t bytes);
+
+    // Bytes per second, 0 = unlimited
+    void set_global_rate(uint64_t rate);
+    void set_client_rate(uint64_t rate);
+    // Bucket depth in bytes, 0 = one second's worth
+    void set_burst(uint64_t bytes);
+    void set_weight(TrafficClass cls, double weight);
+
+    // "show", "set global|client|burst <bytes>", "set weight <class> <n>";
+    // returns the reply text for the admin
+    std::string admin(const std::string &command);
+    std::string describe();
+
+private:
+    struct Bucket {
+        double tokens = 0;
+    };
+    struct Ticket {
+        TrafficClass cls;
+        double tag;
+        uint64_t seq;
+        const std::string *client;
+        bool operator<(const Ticket &o) const {
+            if (cls != o.cls) return cls < o.cls;
+            if (tag != o.tag) return tag < o.tag;
+            return seq < o.seq;
+        }
+    };
+
+    void refill();
+    double burst_for(uint64_t rate) const;
+
+    std::mutex mutex_;
+    std::condition_variable changed;
+    uint64_t global_rate = 0, client_rate = 0, burst = 0;
+    double weights[3] = {8, 4, 1};
+    double global_tokens = 0;
+    std::map<std::string, Bucket> clients;
+    std::set<Ticket> waiting;
+    double virtual_time = 0;
+    uint64_t next_seq = 0;
+    int64_t last_refill_ns = 0;
+    std::atomic<bool> limited{false};   // any rate set - checked without the lock
+    uint64_t granted[3] = {0, 0, 0};
+};
+
+extern BandwidthScheduler bandwidth;
+
+// Makes a flow the current thread's for as long as it lives, so transfer
+// helpers deep in a handler can meter themselves (see throttle())
+class FlowScope {
+public:
+    FlowScope(const std::string &client, TrafficClass cls);
+    ~FlowScope();
+    void set_class(TrafficClass cls) { flow.cls = cls; }
+
+private:
+    Flow flow;
+    Flow *outer;
+};
+
+// Wait for permission to move bytes of a transfer totalling transfer_size.
+// NORMAL traffic for small files counts as INTERACTIVE, so small submits
+// aren't stuck behind big ones.
+void throttle(size_t bytes, uint64_t transfer_size);
+
+// "100M", "1.5G", "64k" -> bytes; false if it doesn't parse
+bool parse_byte_size(const std::string &text, uint64_t &bytes);
+
+#endif // BANDWIDTH_H
@@ -0,0 +1,145 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "BlobStore.h"
+#include "../Walker.h"
+using namespace std;
+namespace fs = std::filesystem;
+
+BlobStore::BlobStore(const string &root) : store_dir(root + "/.vcpstore") {}
+
+bool BlobStore::init() {
+    error_code ec;
+    fs::remove_all(store_dir + "/tmp", ec);
+    fs::create_directories(store_dir + "/tmp", ec);
+    fs::create_directories(store_dir + "/blobs", ec);
+    if (ec) {
+        cerr << "Can't create blob store in " << store_dir << ": " << ec.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
+string BlobStore::blob_path(HashAlgo algo, const string &hash) const {
+    return store_dir + "/blobs/" + hash_algo_name(algo) + "/" + hash.substr(0, 2) + "/" + hash.substr(2);
+}
+
+bool BlobStore::has(HashAlgo algo, const string &hash) const {
+    if (hash.size() < 3 || hash.find('/') != string::npos) return false;
+    struct stat st;
+    return stat(blob_path(algo, hash).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+string BlobStore::temp_path() {
+    return store_dir + "/tmp/" + to_string(getpid()) + "." + to_string(temp_counter++);
+}
+
+bool BlobStore::commit(const string &tmp, HashAlgo algo, const string &hash) {
+    if (has(algo, hash)) {
+        unlink(tmp.c_str());
+        return true;
+    }
+    string final_path = blob_path(algo, hash);
+    error_code ec;
+    fs::create_directories(fs::path(final_path).parent_path(), ec);
+    // Every project sees the same inode - nobody gets to write through it
+    chmod(tmp.c_str(), 0444);
+    if (rename(tmp.c_str(), final_path.c_str()) != 0) {
+        cerr << "Can't store blob " << hash << ": " << strerror(errno) << "\n";
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Plain copy for when a link isn't possible (store on another filesystem,
+// or the blob hit the filesystem's link limit)
+static bool copy_file(const string &src, const string &dest) {
+    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    int out = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+    bool ok = true;
+    char buf[128 * 1024];
+    while (ok) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        for (ssize_t off = 0; ok && off < n;) {
+            ssize_t w = write(out, buf + off, n - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) ok = false;
+            else off += w;
+        }
+    }
+    close(in);
+    if (close(out) != 0) ok = false;
+    return ok;
+}
+
+bool BlobStore::link_into(HashAlgo algo, const string &hash, const string &dest) {
+    string src = blob_path(algo, hash);
+    error_code ec;
+    fs::path parent = fs::path(dest).parent_path();
+    if (!parent.empty()) fs::create_directories(parent, ec);
+
+    // Link next to dest and rename over it, so readers never see a
+    // half-replaced file and the old blob's count drops in the same step
+    string tmp = dest + ".vcplink";
+    unlink(tmp.c_str());
+    if (link(src.c_str(), tmp.c_str()) != 0) {
+        if (errno != EXDEV && errno != EMLINK && errno != EPERM) {
+            cerr << "Can't link " << dest << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        if (!copy_file(src, tmp)) {
+            cerr << "Can't copy blob to " << dest << "\n";
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    if (rename(tmp.c_str(), dest.c_str()) != 0) {
+        cerr << "Can't replace " << dest << ": " << strerror(errno) << "\n";
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+size_t BlobStore::gc(uint64_t *bytes_freed) {
+    std::unique_lock<std::shared_mutex> hold(gc_mutex);
+    WalkOptions opts;
+    opts.skip_hidden = false;
+    opts.want_stat = true;
+    vector<WalkEntry> entries;
+    string blobs = store_dir + "/blobs";
+    if (!walk_tree(blobs, entries, opts)) return 0;
+
+    size_t freed = 0;
+    uint64_t bytes = 0;
+    for (const auto &e : entries) {
+        if (e.type != WalkEntry::FILE) continue;
+        string p = blobs + "/" + e.path;
+        struct stat st;
+        // One link left = only the store's own name refers to it
+        if (stat(p.c_str(), &st) != 0 || st.st_nlink > 1) continue;
+        if (unlink(p.c_str()) == 0) {
+            freed++;
+            bytes += st.st_size;
+        }
+    }
+    if (bytes_freed) *bytes_freed = bytes;
+    return freed;
+}
@@ -0,0 +1,49 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#include <cstdint>
+#include <atomic>
+#include <shared_mutex>
+#include <string>
+#include "../Hash.h"
+
+// Content addressed storage shared by every project on the server:
+//   <root>/.vcpstore/blobs/<algo>/<aa>/<rest of hash>
+//
+// Project files are hardlinks to their blob, so the blob's link count is
+// its reference count: a blob whose only remaining link is the store's own
+// entry belongs to nobody and gc() removes it. Project files are only ever
+// replaced (new link + rename), never written in place, so sharing a blob
+// between projects is safe.
+class BlobStore {
+public:
+    explicit BlobStore(const std::string &root = ".");
+
+    // Create the directories and clear out temp files from a previous run
+    bool init();
+
+    std::string blob_path(HashAlgo algo, const std::string &hash) const;
+    bool has(HashAlgo algo, const std::string &hash) const;
+
+    // Where to receive an incoming file before we know its hash
+    std::string temp_path();
+    // Move a fully received temp file in under its hash. If the blob is
+    // already there the temp file is just dropped.
+    bool commit(const std::string &tmp, HashAlgo algo, const std::string &hash);
+    // Point dest at the blob (replacing whatever was there)
+    bool link_into(HashAlgo algo, const std::string &hash, const std::string &dest);
+
+    // Remove unreferenced blobs; returns how many were freed
+    size_t gc(uint64_t *bytes_freed = nullptr);
+
+    // Writers (submits) hold this shared; gc() takes it exclusively so a blob
+    // can't vanish between has() and link_into()
+    std::shared_mutex &lock() { return gc_mutex; }
+
+private:
+    std::string store_dir;
+    std::atomic<unsigned> temp_counter{0};
+    std::shared_mutex gc_mutex;
+};
+
+#endif // BLOB_STORE_H
@@ -0,0 +1,388 @@
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Journal.h"
+#include "../Manifest.h"
+using namespace std;
+namespace fs = std::filesystem;
+
+// Past this the committer empties the journal at the next chance
+static const uint64_t CHECKPOINT_BYTES = 8 << 20;
+// A group with more files than this is synced with one syncfs()
+static const size_t SYNCFS_FILES = 64;
+
+bool parse_durability(const string &name, Durability &d) {
+    if (name == "none") d = Durability::NONE;
+    else if (name == "batch") d = Durability::BATCH;
+    else if (name == "strict") d = Durability::STRICT;
+    else return false;
+    return true;
+}
+
+const char *durability_name(Durability d) {
+    switch (d) {
+    case Durability::NONE: return "none";
+    case Durability::BATCH: return "batch";
+    case Durability::STRICT: return "strict";
+    }
+    return "?";
+}
+
+JournalBatch::~JournalBatch() {
+    for (auto &e : entries) {
+        if (e.fd >= 0) close(e.fd);
+    }
+}
+
+void JournalBatch::add_blob(const string &tmp, HashAlgo algo, const string &hash, const string &dest) {
+    entries.push_back(Entry{tmp, algo, hash, dest});
+}
+
+void JournalBatch::add_link(HashAlgo algo, const string &hash, const string &dest) {
+    entries.push_back(Entry{"", algo, hash, dest});
+}
+
+// fdatasync()/syncfs() are Linux; elsewhere fall back to fsync()/sync()
+static bool sync_data_fd(int fd) {
+#ifdef __linux__
+    return fdatasync(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+static bool sync_filesystem(int fd) {
+#ifdef __linux__
+    return syncfs(fd) == 0;
+#else
+    (void)fd;
+    sync();
+    return true;
+#endif
+}
+
+static bool sync_dir(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+Journal::Journal(const string &root_path, BlobStore &store)
+    : root(root_path), journal_file(root_path + "/.vcpstore/journal"), blobs(store) {}
+
+Journal::~Journal() {
+    {
+        lock_guard<mutex> hold(mutex_);
+        stopping = true;
+    }
+    changed.notify_all();
+    if (committer.joinable()) committer.join();
+    if (journal_fd >= 0) close(journal_fd);
+}
+
+string Journal::relative(const string &path) const {
+    return path.compare(0, root.size() + 1, root + "/") == 0 ? path.substr(root.size() + 1) : path;
+}
+
+// Record: "<algo> <hash> <temp file|-> <dest>\n", paths relative to the
+// root. Only whole lines count, so a torn last write is ignored.
+bool Journal::recover() {
+    ifstream in(journal_file);
+    if (!in) return true;
+    struct Record {
+        HashAlgo algo;
+        string hash, tmp;
+    };
+    vector<Record> blobs_in;
+    map<string, Record> links;  // the last record for a path wins
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    size_t records = 0;
+    for (size_t pos = 0, nl; (nl = text.find('\n', pos)) != string::npos; pos = nl + 1) {
+        istringstream line(text.substr(pos, nl - pos));
+        string algo_name, dest;
+        Record r;
+        if (!(line >> algo_name >> r.hash >> r.tmp) || !parse_hash_algo(algo_name, r.algo)) continue;
+        line.get();
+        getline(line, dest);
+        if (!safe_relative_path(dest)) continue;
+        records++;
+        if (r.tmp != "-") blobs_in.push_back(r);
+        links[dest] = r;
+    }
+
+    size_t restored = 0;
+    for (const auto &r : blobs_in) {
+        string tmp = root + "/" + r.tmp;
+        if (!blobs.has(r.algo, r.hash) && access(tmp.c_str(), F_OK) == 0 && blobs.commit(tmp, r.algo, r.hash))
+            restored++;
+    }
+    for (const auto &kv : links) {
+        const Record &r = kv.second;
+        // A project moved to another root since isn't brought back here
+        string project = kv.first.substr(0, kv.first.find('/'));
+        if (!fs::is_directory(root + "/" + project) || !blobs.has(r.algo, r.hash)) continue;
+        string dest = root + "/" + kv.first;
+        struct stat have, want;
+        if (stat(dest.c_str(), &have) == 0 && stat(blobs.blob_path(r.algo, r.hash).c_str(), &want) == 0 &&
+            have.st_ino == want.st_ino && have.st_dev == want.st_dev)
+            continue;
+        if (blobs.link_into(r.algo, r.hash, dest)) restored++;
+    }
+
+    // Everything the journal described is in place; make that stick
+    int fd = open(root.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        sync_filesystem(fd);
+        close(fd);
+    }
+    if (unlink(journal_file.c_str()) != 0) {
+        cerr << "Can't clear journal " << journal_file << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    if (records > 0) {
+        cout << "Journal " << journal_file << ": replayed " << records << " records, "
+             << restored << " files restored\n";
+    }
+    return true;
+}
+
+bool Journal::start(Durability level) {
+    durability = level;
+    if (level != Durability::BATCH) return true;
+    journal_fd = open(journal_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal_fd < 0) {
+        cerr << "Can't open journal " << journal_file << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    struct stat st;
+    journal_bytes = fstat(journal_fd, &st) == 0 ? st.st_size : 0;
+    committer = thread([this]() { run(); });
+    return true;
+}
+
+// Open every temp file and get its data to disk: one syncfs() for a big
+// group (whole_fs set), fdatasync() per file otherwise
+bool Journal::sync_data(JournalBatch &batch, bool &whole_fs) {
+    whole_fs = false;
+    size_t files = 0;
+    for (auto &e : batch.entries) {
+        if (e.tmp.empty()) continue;
+        if (e.fd < 0) e.fd = open(e.tmp.c_str(), O_RDONLY | O_CLOEXEC);
+        if (e.fd < 0) return false;
+        files++;
+    }
+    if (files > SYNCFS_FILES) {
+        for (auto &e : batch.entries) {
+            if (e.fd >= 0) return whole_fs = sync_filesystem(e.fd);
+        }
+    }
+    for (auto &e : batch.entries) {
+        if (e.fd >= 0 && !sync_data_fd(e.fd)) return false;
+    }
+    return true;
+}
+
+// fdatasync() doesn't make a new file's name durable: without this a
+// replay could find the journaled temp file missing
+bool Journal::sync_temp_dirs(const vector<Pending*> &group) {
+    set<string> dirs;
+    for (const auto *p : group) {
+        for (const auto &e : p->batch->entries) {
+            if (!e.tmp.empty()) dirs.insert(fs::path(e.tmp).parent_path().string());
+        }
+    }
+    for (const auto &d : dirs) {
+        if (!sync_dir(d)) return false;
+    }
+    return true;
+}
+
+bool Journal::append(const vector<Pending*> &group) {
+    lock_guard<mutex> hold(file_mutex);
+    string records;
+    for (const auto *p : group) {
+        for (const auto &e : p->batch->entries) {
+            records += string(hash_algo_name(e.algo)) + " " + e.hash + " " +
+                       (e.tmp.empty() ? "-" : relative(e.tmp)) + " " + relative(e.dest) + "\n";
+        }
+    }
+    for (size_t off = 0; off < records.size();) {
+        ssize_t n = write(journal_fd, records.data() + off, records.size() - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += n;
+    }
+    journal_bytes += records.size();
+    return sync_data_fd(journal_fd);
+}
+
+void Journal::apply(JournalBatch &batch, vector<bool> &ok) {
+    ok.assign(batch.entries.size(), false);
+    for (size_t i = 0; i < batch.entries.size(); ++i) {
+        auto &e = batch.entries[i];
+        if (e.fd >= 0) {
+            close(e.fd);
+            e.fd = -1;
+        }
+        if (e.tmp.empty()) {
+            ok[i] = true;
+            continue;
+        }
+        ok[i] = blobs.commit(e.tmp, e.algo, e.hash) && blobs.link_into(e.algo, e.hash, e.dest);
+    }
+}
+
+bool Journal::sync_root() {
+    if (durability == Durability::NONE) return true;
+    int fd = open(root.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = sync_filesystem(fd) && fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+void Journal::commit(JournalBatch &batch, vector<bool> &ok) {
+    if (batch.entries.empty()) {
+        ok.clear();
+        return;
+    }
+    if (durability == Durability::NONE) {
+        apply(batch, ok);
+        return;
+    }
+    if (durability == Durability::STRICT) {
+        bool whole_fs;
+        if (!sync_data(batch, whole_fs)) {
+            cerr << "Can't sync received files: " << strerror(errno) << "\n";
+            for (auto &e : batch.entries) {
+                if (!e.tmp.empty()) unlink(e.tmp.c_str());
+            }
+            ok.assign(batch.entries.size(), false);
+            return;
+        }
+        apply(batch, ok);
+        // The renames and links themselves: every directory they touched
+        set<string> dirs;
+        for (size_t i = 0; i < batch.entries.size(); ++i) {
+            const auto &e = batch.entries[i];
+            dirs.insert(fs::path(e.dest).parent_path().string());
+            if (!e.tmp.empty()) dirs.insert(fs::path(blobs.blob_path(e.algo, e.hash)).parent_path().string());
+        }
+        for (const auto &d : dirs) {
+            if (!sync_dir(d)) cerr << "Can't sync directory " << d << "\n";
+        }
+        return;
+    }
+
+    // BATCH: hand it to the committer and wait for its group to be on disk
+    Pending p{&batch};
+    {
+        unique_lock<mutex> hold(mutex_);
+        changed.wait(hold, [this]() { return !draining; });
+        queue.push_back(&p);
+        changed.notify_all();
+        changed.wait(hold, [&p]() { return p.done; });
+    }
+    if (!p.ok) {
+        for (auto &e : batch.entries) {
+            if (!e.tmp.empty()) unlink(e.tmp.c_str());
+        }
+        ok.assign(batch.entries.size(), false);
+    } else {
+        apply(batch, ok);
+    }
+    {
+        lock_guard<mutex> hold(mutex_);
+        if (p.ok) unapplied--;
+    }
+    changed.notify_all();
+}
+
+// Committer: whatever queued up while the last group was syncing becomes
+// the next group, so the more submits there are the more each sync covers
+void Journal::run() {
+    while (true) {
+        vector<Pending*> group;
+        {
+            unique_lock<mutex> hold(mutex_);
+            changed.wait(hold, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            group.assign(queue.begin(), queue.end());
+            queue.clear();
+        }
+
+        bool ok = true;
+        bool whole_fs = false;
+        if (group.size() == 1) {
+            ok = sync_data(*group[0]->batch, whole_fs);
+        } else {
+            // One syncfs covers everybody once the group is big enough
+            JournalBatch *biggest = group[0]->batch;
+            size_t files = 0;
+            for (auto *p : group) {
+                files += p->batch->size();
+                if (p->batch->size() > biggest->size()) biggest = p->batch;
+            }
+            for (auto *p : group) {
+                if (files > SYNCFS_FILES && p->batch != biggest) {
+                    for (auto &e : p->batch->entries) {
+                        if (!e.tmp.empty() && e.fd < 0) e.fd = open(e.tmp.c_str(), O_RDONLY | O_CLOEXEC);
+                    }
+                    continue;
+                }
+                bool synced_fs;
+                if (!sync_data(*p->batch, synced_fs)) ok = false;
+            }
+            if (files > SYNCFS_FILES) {
+                if (!sync_filesystem(journal_fd)) ok = false;
+                whole_fs = true;
+            }
+        }
+        if (ok && !whole_fs) ok = sync_temp_dirs(group);
+        if (ok) ok = append(group);
+        if (!ok) cerr << "Journal commit failed: " << strerror(errno) << "\n";
+
+        {
+            lock_guard<mutex> hold(mutex_);
+            for (auto *p : group) {
+                p->done = true;
+                p->ok = ok;
+                if (ok) unapplied++;
+            }
+        }
+        changed.notify_all();
+        bool big;
+        {
+            lock_guard<mutex> hold(file_mutex);
+            big = journal_bytes > CHECKPOINT_BYTES;
+        }
+        if (big) checkpoint();
+    }
+}
+
+// Holding file_mutex keeps new records out; batches already synced still
+// get applied, then syncfs makes their renames and links durable on their own
+void Journal::checkpoint() {
+    if (journal_fd < 0) return;
+    lock_guard<mutex> file_hold(file_mutex);
+    unique_lock<mutex> hold(mutex_);
+    draining = true;
+    changed.wait(hold, [this]() { return unapplied == 0; });
+    if (sync_filesystem(journal_fd) && ftruncate(journal_fd, 0) == 0 && sync_data_fd(journal_fd)) {
+        journal_bytes = 0;
+    } else {
+        cerr << "Journal checkpoint failed: " << strerror(errno) << "\n";
+    }
+    draining = false;
+    changed.notify_all();
+}
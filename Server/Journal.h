@@ -0,0 +1,110 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BlobStore.h"
+
+// How much a submit's final ack promises (--durability):
+//   NONE    nothing synced; a crash can lose or corrupt what was just acked
+//   BATCH   file data and a journal record are on disk before the ack;
+//           concurrent submits share the syncs (group commit), and the
+//           renames/links the journal describes are redone at startup if
+//           the crash beat them to disk
+//   STRICT  every file, rename and link synced by the submit itself
+enum class Durability { NONE, BATCH, STRICT };
+
+bool parse_durability(const std::string &name, Durability &d);
+const char *durability_name(Durability d);
+
+// Files one submit is about to store; made durable and applied together by
+// Journal::commit(). Paths are absolute (under the storage root).
+class JournalBatch {
+public:
+    JournalBatch() = default;
+    JournalBatch(const JournalBatch &) = delete;
+    JournalBatch &operator=(const JournalBatch &) = delete;
+    ~JournalBatch();
+
+    // A received temp file, to become blob hash and be linked in at dest
+    void add_blob(const std::string &tmp, HashAlgo algo, const std::string &hash, const std::string &dest);
+    // dest already linked to a stored blob; only needs to survive a crash
+    void add_link(HashAlgo algo, const std::string &hash, const std::string &dest);
+    size_t size() const { return entries.size(); }
+
+private:
+    friend class Journal;
+    struct Entry {
+        std::string tmp;   // "" for add_link
+        HashAlgo algo;
+        std::string hash;
+        std::string dest;
+        int fd = -1;
+    };
+    std::vector<Entry> entries;
+};
+
+// Write-ahead journal of stored files for one storage root, in
+// <root>/.vcpstore/journal. Each record says "this temp file holds blob H
+// and H is linked in at path P"; it is written only once the temp file's
+// data is synced, so replaying it after a crash is always safe. Once the
+// journal is big, a checkpoint syncs the whole filesystem and empties it.
+class Journal {
+public:
+    Journal(const std::string &root_path, BlobStore &blobs);
+    ~Journal();
+
+    // Redo what the last run journaled, then empty the journal. Must run
+    // before BlobStore::init() clears the temp files records point at.
+    bool recover();
+    // Open the journal and, for BATCH, start the committer thread
+    bool start(Durability level);
+    Durability level() const { return durability; }
+
+    // Make the batch durable to the configured level, move its temp files
+    // into the store and link them in. ok[i] tells how entry i went.
+    void commit(JournalBatch &batch, std::vector<bool> &ok);
+    // Wait until every committed batch is applied, sync the filesystem and
+    // empty the journal. Done automatically once it's big; call it before
+    // removing a project so a replay can't bring its files back.
+    void checkpoint();
+    // Sync the root's whole filesystem unless the level is NONE: for bulk
+    // work done outside commit(), like a rebalance copying a project in
+    bool sync_root();
+
+private:
+    struct Pending {
+        JournalBatch *batch;
+        bool done = false;
+        bool ok = false;
+    };
+    void run();
+    bool sync_data(JournalBatch &batch, bool &whole_fs);
+    bool sync_temp_dirs(const std::vector<Pending*> &group);
+    bool append(const std::vector<Pending*> &group);
+    void apply(JournalBatch &batch, std::vector<bool> &ok);
+    std::string relative(const std::string &path) const;
+
+    std::string root;
+    std::string journal_file;
+    BlobStore &blobs;
+    Durability durability = Durability::NONE;
+    int journal_fd = -1;
+    uint64_t journal_bytes = 0;
+
+    std::mutex file_mutex;   // journal_fd writes vs. checkpoint truncating it
+    std::mutex mutex_;
+    std::condition_variable changed;
+    std::deque<Pending*> queue;
+    size_t unapplied = 0;    // batches synced but not yet applied
+    bool draining = false;   // checkpoint waiting for unapplied to reach 0
+    bool stopping = false;
+    std::thread committer;
+};
+
+#endif // JOURNAL_H
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+#include "Replication.h"
+using namespace std;
+
+uint64_t wall_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void Replicator::start(SendFn send) {
+    send_fn = std::move(send);
+    for (auto &f : followers) {
+        Follower *fp = f.get();
+        thread([this, fp]() { run(*fp); }).detach();
+    }
+}
+
+void Replicator::project_changed(const string &project) {
+    uint64_t now = wall_ms();
+    for (auto &f : followers) {
+        {
+            lock_guard<mutex> hold(f->state_mutex);
+            f->pending.emplace(project, now);  // keeps the older time if already queued
+        }
+        f->wake.notify_one();
+    }
+}
+
+void Replicator::run(Follower &f) {
+    unsigned backoff_ms = 0;
+    while (true) {
+        string project;
+        uint64_t changed_ms;
+        {
+            unique_lock<mutex> hold(f.state_mutex);
+            f.wake.wait(hold, [&f]() { return !f.pending.empty(); });
+            // Longest waiting first
+            auto oldest = min_element(f.pending.begin(), f.pending.end(),
+                [](const pair<const string, uint64_t> &a, const pair<const string, uint64_t> &b) {
+                    return a.second < b.second;
+                });
+            project = oldest->first;
+            changed_ms = oldest->second;
+            f.pending.erase(oldest);
+            f.sending_since = changed_ms;
+        }
+
+        bool ok = send_fn(f.addr, project, changed_ms);
+        {
+            lock_guard<mutex> hold(f.state_mutex);
+            f.sending_since = 0;
+            if (ok) {
+                f.sent++;
+                f.last_ok_ms = wall_ms();
+                f.last_error.clear();
+            } else {
+                auto it = f.pending.find(project);
+                if (it == f.pending.end()) f.pending.emplace(project, changed_ms);
+                else it->second = min(it->second, changed_ms);
+                f.last_error = "sending " + project + " failed";
+            }
+        }
+        if (ok) {
+            backoff_ms = 0;
+        } else {
+            backoff_ms = min(backoff_ms ? backoff_ms * 2 : 500u, 30000u);
+            this_thread::sleep_for(chrono::milliseconds(backoff_ms));
+        }
+    }
+}
+
+string Replicator::status() {
+    ostringstream out;
+    uint64_t now = wall_ms();
+    out << "role: primary, " << followers.size() << " follower(s)\n";
+    for (auto &f : followers) {
+        lock_guard<mutex> hold(f->state_mutex);
+        uint64_t oldest = f->sending_since ? f->sending_since : now;
+        for (const auto &p : f->pending) oldest = min(oldest, p.second);
+        out << "  " << f->addr << ": " << f->pending.size() << " project(s) pending, lag "
+            << (now - oldest) << " ms, " << f->sent << " sent";
+        if (!f->last_error.empty()) out << " (" << f->last_error << ")";
+        out << "\n";
+    }
+    return out.str();
+}
+
+void ReplicaState::applied(const string &project, uint64_t changed_ms) {
+    lock_guard<mutex> hold(state_mutex);
+    last_apply_ms = wall_ms();
+    last_lag_ms = last_apply_ms > changed_ms ? last_apply_ms - changed_ms : 0;
+    max_lag_ms = max(max_lag_ms, last_lag_ms);
+    last_project = project;
+    applied_count++;
+}
+
+string ReplicaState::status() {
+    lock_guard<mutex> hold(state_mutex);
+    ostringstream out;
+    out << "role: follower (read-only)\n";
+    if (applied_count == 0) {
+        out << "  nothing replicated yet\n";
+        return out.str();
+    }
+    out << "  " << applied_count << " update(s) applied, last " << last_project << " "
+        << (wall_ms() - last_apply_ms) / 1000 << " s ago\n"
+        << "  replication lag: " << last_lag_ms << " ms (max " << max_lag_ms << " ms)\n";
+    return out.str();
+}
@@ -0,0 +1,69 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Milliseconds since the epoch - comparable between primary and followers
+// as long as their clocks are roughly in sync
+uint64_t wall_ms();
+
+// Primary side. Every project a submit touches is queued for each
+// follower, and one thread per follower pushes queued projects to it.
+// A project changed again before it went out is only sent once; one
+// whose send failed stays queued and is retried with backoff, so a
+// follower that was down catches up when it comes back.
+class Replicator {
+public:
+    // Sends one project's current state to a follower; changed_ms is when
+    // the oldest change not yet on that follower happened
+    using SendFn = std::function<bool(const std::string &follower, const std::string &project,
+                                      uint64_t changed_ms)>;
+
+    void add_follower(const std::string &addr) { followers.emplace_back(new Follower(addr)); }
+    bool empty() const { return followers.empty(); }
+    void start(SendFn send);
+    void project_changed(const std::string &project);
+    // One line per follower: what's queued and how far behind it is
+    std::string status();
+
+private:
+    struct Follower {
+        explicit Follower(const std::string &addr) : addr(addr) {}
+        std::string addr;
+        std::mutex state_mutex;
+        std::condition_variable wake;
+        std::map<std::string, uint64_t> pending;  // project -> first unsent change
+        uint64_t sending_since = 0;               // change time of the one in flight
+        uint64_t sent = 0;
+        uint64_t last_ok_ms = 0;
+        std::string last_error;
+    };
+    void run(Follower &f);
+
+    std::vector<std::unique_ptr<Follower>> followers;
+    SendFn send_fn;
+};
+
+// Follower side: what has come in from the primary, for STATUS
+class ReplicaState {
+public:
+    void applied(const std::string &project, uint64_t changed_ms);
+    std::string status();
+
+private:
+    std::mutex state_mutex;
+    uint64_t applied_count = 0;
+    uint64_t last_apply_ms = 0;
+    uint64_t last_lag_ms = 0;
+    uint64_t max_lag_ms = 0;
+    std::string last_project;
+};
+
+#endif // REPLICATION_H
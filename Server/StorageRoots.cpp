@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "StorageRoots.h"
+#include "../FileReader.h"
+#include "../Manifest.h"
+#include "../Walker.h"
+using namespace std;
+namespace fs = std::filesystem;
+
+HashAlgo project_hash_algo(const string &project_dir) {
+    HashAlgo algo = HashAlgo::SHA256;
+    ifstream cfg(project_dir + "/.vcp/config.txt");
+    string line;
+    while (getline(cfg, line)) {
+        if (line.rfind("hash=", 0) == 0) parse_hash_algo(line.substr(5), algo);
+    }
+    return algo;
+}
+
+bool StorageRoots::add(const string &spec) {
+    auto root = make_unique<StorageRoot>();
+    root->path = spec;
+    size_t colon = spec.rfind(':');
+    if (colon != string::npos) {
+        char *end;
+        double w = strtod(spec.c_str() + colon + 1, &end);
+        if (*end == '\0' && colon + 1 < spec.size()) {
+            if (!(w > 0)) {
+                cerr << "Storage root weight must be positive: " << spec << "\n";
+                return false;
+            }
+            root->path = spec.substr(0, colon);
+            root->weight = w;
+        }
+    }
+    while (root->path.size() > 1 && root->path.back() == '/') root->path.pop_back();
+    if (root->path.empty()) {
+        cerr << "Empty storage root\n";
+        return false;
+    }
+    roots.push_back(std::move(root));
+    return true;
+}
+
+bool StorageRoots::init(Durability durability) {
+    if (roots.empty()) add(".");
+    set<string> seen;
+    for (auto &r : roots) {
+        error_code ec;
+        fs::create_directories(r->path, ec);
+        r->key = fs::weakly_canonical(fs::absolute(r->path), ec).string();
+        if (!seen.insert(r->key).second) {
+            cerr << "Storage root listed twice: " << r->path << "\n";
+            return false;
+        }
+        r->blobs = make_unique<BlobStore>(r->path);
+        r->journal = make_unique<Journal>(r->path, *r->blobs);
+        if (!r->journal->recover() || !r->blobs->init() || !r->journal->start(durability)) return false;
+    }
+    return true;
+}
+
+// 64-bit FNV-1a with a final avalanche, so similar names still spread evenly
+static uint64_t placement_hash(const string &root_key, const string &project) {
+    uint64_t h = 1469598103934665603ULL;
+    auto mix = [&h](const string &s) {
+        for (unsigned char c : s) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        h ^= 0xff;
+        h *= 1099511628211ULL;
+    };
+    mix(root_key);
+    mix(project);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+StorageRoot &StorageRoots::preferred(const string &project) {
+    StorageRoot *best = roots.front().get();
+    double best_score = -INFINITY;
+    for (auto &r : roots) {
+        // Weighted rendezvous: -w / ln(u) for u uniform in (0,1) picks each
+        // root with probability proportional to its weight
+        double u = ((placement_hash(r->key, project) >> 11) + 0.5) / 9007199254740992.0;
+        double score = -r->weight / log(u);
+        if (score > best_score) {
+            best_score = score;
+            best = r.get();
+        }
+    }
+    return *best;
+}
+
+StorageRoot *StorageRoots::find(const string &project) {
+    StorageRoot &pref = preferred(project);
+    if (fs::is_directory(pref.project_dir(project))) return &pref;
+    for (auto &r : roots) {
+        if (r.get() != &pref && fs::is_directory(r->project_dir(project))) return r.get();
+    }
+    return nullptr;
+}
+
+StorageRoot &StorageRoots::place(const string &project) {
+    StorageRoot *r = find(project);
+    return r ? *r : preferred(project);
+}
+
+vector<string> StorageRoots::projects() const {
+    set<string> names;
+    for (const auto &r : roots) {
+        error_code ec;
+        for (const auto &entry : fs::directory_iterator(r->path, ec)) {
+            string name = entry.path().filename().string();
+            if (name[0] != '.' && entry.is_directory(ec)) names.insert(name);
+        }
+    }
+    return vector<string>(names.begin(), names.end());
+}
+
+shared_mutex &StorageRoots::project_lock(const string &project) {
+    lock_guard<mutex> hold(locks_mutex);
+    auto &slot = locks[project];
+    if (!slot) slot = make_unique<shared_mutex>();
+    return *slot;
+}
+
+// Copy src to dst and hash it in the same pass
+static bool copy_and_hash(const string &src, const string &dst, Hasher &hasher) {
+    FileReader in;
+    if (!in.open(src, true)) return false;  // project files are links to blobs
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) return false;
+    hasher.reset();
+    const char *data;
+    size_t len;
+    bool ok = true;
+    while (ok && in.next(data, len)) {
+        hasher.update(data, len);
+        for (size_t off = 0; off < len;) {
+            ssize_t w = write(out, data + off, len - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) {
+                ok = false;
+                break;
+            }
+            off += w;
+        }
+    }
+    if (in.failed()) ok = false;
+    if (close(out) != 0) ok = false;
+    return ok;
+}
+
+bool StorageRoots::move_project(const string &project, StorageRoot &from, StorageRoot &to) {
+    unique_lock<shared_mutex> hold(project_lock(project));
+    shared_lock<shared_mutex> store_hold(to.blobs->lock());
+    string src = from.project_dir(project);
+    if (!fs::is_directory(src)) return true;  // went away meanwhile
+
+    // Hashes we already know spare us reading files the target store has
+    Manifest old;
+    if (!read_manifest(from.manifest_file(project), old)) {
+        old.files.clear();
+        old.algo = project_hash_algo(src);
+    }
+
+    WalkOptions opts;
+    opts.skip_hidden = false;
+    opts.want_stat = true;
+    vector<WalkEntry> entries;
+    if (!walk_tree(src, entries, opts)) return false;
+
+    // Build the copy off to the side and rename it in, so the project only
+    // ever appears on the new root complete
+    string staging = to.path + "/.vcpstore/tmp/move-" + project;
+    error_code ec;
+    fs::remove_all(staging, ec);
+    fs::create_directories(staging, ec);
+    Manifest moved;
+    moved.algo = old.algo;
+    Hasher hasher(old.algo);
+    for (const auto &e : entries) {
+        if (e.type == WalkEntry::DIR) {
+            fs::create_directories(staging + "/" + e.path, ec);
+            continue;
+        }
+        if (e.type != WalkEntry::FILE) continue;
+        string hash;
+        auto it = old.files.find(e.path);
+        if (it != old.files.end() && it->second.size == e.size &&
+            it->second.mtime_ns == e.mtime_ns && it->second.ino == e.ino) {
+            hash = it->second.hash;
+        }
+        if (hash.empty() || !to.blobs->has(old.algo, hash)) {
+            string tmp = to.blobs->temp_path();
+            if (!copy_and_hash(src + "/" + e.path, tmp, hasher)) {
+                cerr << "Rebalance: can't copy " << src << "/" << e.path << "\n";
+                unlink(tmp.c_str());
+                fs::remove_all(staging, ec);
+                return false;
+            }
+            hash = hasher.final_hex();
+            if (!to.blobs->commit(tmp, old.algo, hash)) {
+                fs::remove_all(staging, ec);
+                return false;
+            }
+        }
+        string dest = staging + "/" + e.path;
+        if (!to.blobs->link_into(old.algo, hash, dest)) {
+            fs::remove_all(staging, ec);
+            return false;
+        }
+        struct stat st;
+        if (stat(dest.c_str(), &st) == 0) {
+            ManifestEntry &me = moved.files[e.path];
+            me.path = e.path;
+            me.hash = hash;
+            me.size = st.st_size;
+#ifdef __APPLE__
+            me.mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+            me.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+            me.ino = st.st_ino;
+        }
+    }
+
+    fs::create_directories(to.path + "/.vcpmeta", ec);
+    write_manifest(to.manifest_file(project), moved);
+    // The copy's data is on disk before it can appear, and the rename
+    // before the original goes: a crash never leaves a project on neither
+    if (!to.journal->sync_root()) {
+        cerr << "Rebalance: can't sync " << to.path << ": " << strerror(errno) << "\n";
+        unlink(to.manifest_file(project).c_str());
+        fs::remove_all(staging, ec);
+        return false;
+    }
+    if (rename(staging.c_str(), to.project_dir(project).c_str()) != 0) {
+        cerr << "Rebalance: can't move " << project << " into " << to.path << ": "
+             << strerror(errno) << "\n";
+        unlink(to.manifest_file(project).c_str());
+        fs::remove_all(staging, ec);
+        return false;
+    }
+    if (!to.journal->sync_root()) {
+        cerr << "Rebalance: can't sync " << to.path << ", keeping " << src << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    from.journal->checkpoint();
+    fs::remove_all(src, ec);
+    unlink(from.manifest_file(project).c_str());
+    return true;
+}
+
+int StorageRoots::rebalance() {
+    int moved = 0;
+    bool failed = false;
+    for (auto &r : roots) {
+        vector<string> names;
+        error_code ec;
+        for (const auto &entry : fs::directory_iterator(r->path, ec)) {
+            string name = entry.path().filename().string();
+            if (name[0] != '.' && entry.is_directory(ec)) names.push_back(name);
+        }
+        for (const auto &name : names) {
+            StorageRoot &pref = preferred(name);
+            if (&pref == r.get()) continue;
+            // Already there too (an interrupted move)? The preferred copy
+            // is the one being served; drop this one.
+            if (fs::is_directory(pref.project_dir(name))) {
+                unique_lock<shared_mutex> hold(project_lock(name));
+                fs::remove_all(r->project_dir(name), ec);
+                continue;
+            }
+            cout << "Rebalance: moving " << name << " from " << r->path << " to " << pref.path << "\n";
+            if (move_project(name, *r, pref)) moved++;
+            else failed = true;
+        }
+    }
+    // Whatever the moved projects left behind is unreferenced now
+    if (moved > 0) {
+        for (auto &r : roots) r->blobs->gc();
+    }
+    return failed ? -1 : moved;
+}
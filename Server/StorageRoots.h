@@ -0,0 +1,70 @@
+#ifndef STORAGE_ROOTS_H
+#define STORAGE_ROOTS_H
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "BlobStore.h"
+#include "Journal.h"
+
+// One directory projects can live in (typically one per disk). Each root
+// has its own blob store and manifest cache (.vcpmeta), since hardlinks
+// can't cross filesystems.
+struct StorageRoot {
+    std::string path;
+    double weight = 1.0;
+    std::string key;    // absolute path, what placement hashes on
+    std::unique_ptr<BlobStore> blobs;
+    std::unique_ptr<Journal> journal;   // what submits store goes through this
+
+    std::string project_dir(const std::string &project) const { return path + "/" + project; }
+    std::string manifest_file(const std::string &project) const {
+        return path + "/.vcpmeta/" + project + ".manifest";
+    }
+};
+
+// Spreads projects over several roots by weighted rendezvous hashing of
+// the project name: every root gets a score for the name and the highest
+// wins, so adding a root only moves the projects that now score highest on
+// it. Until rebalance() has moved them, projects are served from wherever
+// they actually are.
+class StorageRoots {
+public:
+    // "path" or "path:weight" (weight > 0, relative capacity)
+    bool add(const std::string &spec);
+    // Set up every root ("." alone if none were added), replaying what
+    // each journal recorded before a crash
+    bool init(Durability durability);
+
+    const std::vector<std::unique_ptr<StorageRoot>> &all() const { return roots; }
+    StorageRoot &preferred(const std::string &project);
+    // Root currently holding the project, nullptr if none does
+    StorageRoot *find(const std::string &project);
+    // find(), or preferred() for a project that doesn't exist yet
+    StorageRoot &place(const std::string &project);
+    // Every project on any root, sorted, each once
+    std::vector<std::string> projects() const;
+
+    // Held shared by anything reading or writing a project, exclusively
+    // while rebalance() moves it
+    std::shared_mutex &project_lock(const std::string &project);
+
+    // Move every project that isn't on its preferred root there. Safe
+    // while serving. Returns the number moved, -1 if any move failed.
+    int rebalance();
+
+private:
+    bool move_project(const std::string &project, StorageRoot &from, StorageRoot &to);
+
+    std::vector<std::unique_ptr<StorageRoot>> roots;
+    std::mutex locks_mutex;
+    std::unordered_map<std::string, std::unique_ptr<std::shared_mutex>> locks;
+};
+
+// Hash the project was set up with (its .vcp/config.txt), sha256 if unset
+HashAlgo project_hash_algo(const std::string &project_dir);
+
+#endif // STORAGE_ROOTS_H
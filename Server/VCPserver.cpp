@@ -28,12 +28,28 @@ void handle_sigint(int) {
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <filesystem>
+#include <shared_mutex>
 #include <arpa/inet.h>
 #include <thread>
 #include <atomic>
 #include <regex>
+#include <map>
+#include <memory>
+#include <vector>
+#include "../Net.h"
+#include "../Delta.h"
+#include "../Manifest.h"
+#include "../Merkle.h"
+#include "StorageRoots.h"
+#include "Replication.h"
+#include "Bandwidth.h"
 #define MAX_CLIENTS 8
+// Seconds a SESSION connection may sit idle between commands
+#define SESSION_IDLE 30
 
 
 using namespace std;
@@ -41,17 +57,43 @@ namespace fs = std::filesystem;
 
 #define SERVER_PORT 8080
 #define BUFFER_SIZE 1024
+// File data is handed to the bandwidth scheduler in slices this big
+#define THROTTLE_SLICE (256 * 1024)
 
 // Declarition of functions
 bool handle_submit_request(int client_sock);
 bool handle_clone_request(int client_sock);
 bool handle_list_request(int client_sock);
+bool handle_manifest_request(int client_sock);
+bool handle_fetch_request(int client_sock);
+bool handle_tree_request(int client_sock);
+bool handle_push_request(int client_sock);
+bool handle_replicate_request(int client_sock);
+bool handle_status_request(int client_sock);
+bool handle_admin_request(int client_sock, const string &peer);
+static bool replicate_project(const string &follower, const string &project_name, uint64_t changed_ms);
+
+// Where projects live (--root, one per disk; the working directory if none)
+static StorageRoots storage;
+
+static int server_port = SERVER_PORT;
+// Followers take writes only from their primary (REPLICATE)
+static bool follower_mode = false;
+// Seconds a client (or follower) may stall mid-transfer before we give up
+static int socket_timeout = 300;
+// TLS: serve it when a certificate is loaded (--tls-cert/--tls-key), refuse
+// plain clients with --require-tls, speak it to followers with --tls-ca
+static bool tls_serving = false;
+static bool require_tls = false;
+static bool tls_to_followers = false;
+static Replicator replicator;
+static ReplicaState replica_state;
 
 // Helper to receive exactly n bytes
 bool recv_all(int sock, char *buffer, size_t len) {
     size_t total = 0;
     while (total < len) {
-        ssize_t r = recv(sock, buffer + total, len - total, 0);
+        ssize_t r = net_recv(sock, buffer + total, len - total);
         if (r <= 0) return false;
         total += r;
     }
@@ -71,18 +113,39 @@ bool receive_data(int sock, string &data) {
     return true;
 }
 
+// Helper to send a whole buffer
+bool send_all(int sock, const char *data, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = net_send(sock, data + total, len - total);
+        if (n <= 0) return false;
+        total += n;
+    }
+    return true;
+}
+
+// Helpers to queue protocol values in a buffer for one send_all
+static void append_u32(string &buf, uint32_t v) {
+    v = htonl(v);
+    buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+static void append_string(string &buf, const string &str) {
+    append_u32(buf, str.size());
+    buf.append(str);
+}
+
 // Helper to send a uint32_t ack value
 bool send_ack(int sock, uint32_t ack_val) {
     uint32_t net_val = htonl(ack_val);
-    if (send(sock, &net_val, sizeof(net_val), 0) != sizeof(net_val))
+    if (net_send(sock, &net_val, sizeof(net_val)) != sizeof(net_val))
         return false;
     return true;
 }
 
-// htonll and ntohll are available on macOS
-
-// Helper to receive a file sent by client
-bool receive_file(int sock, const string &save_path) {
+// Helper to receive a file sent by client (hashed on the way in if asked)
+bool receive_file(int sock, const string &save_path, Hasher *hasher = nullptr,
+                  const string &label = "") {
     uint64_t net_size;
     if (!recv_all(sock, reinterpret_cast<char*>(&net_size), sizeof(net_size))) return false;
     uint64_t file_size = ntohll(net_size);
@@ -103,73 +166,125 @@ bool receive_file(int sock, const string &save_path) {
         return false;
     }
 
+    if (hasher) hasher->reset();
     char buffer[BUFFER_SIZE];
     uint64_t remaining = file_size;
     uint64_t total = file_size;
     uint64_t received = 0;
+    size_t granted = 0;
     while (remaining > 0) {
-        size_t to_read = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
-        ssize_t r = recv(sock, buffer, to_read, 0);
+        if (granted == 0) {
+            granted = (size_t)min<uint64_t>(remaining, THROTTLE_SLICE);
+            throttle(granted, total);
+        }
+        size_t to_read = min<size_t>(granted, BUFFER_SIZE);
+        ssize_t r = net_recv(sock, buffer, to_read);
         if (r <= 0) return false;
+        granted -= r;
+        if (hasher) hasher->update(buffer, r);
         outfile.write(buffer, r);
         remaining -= r;
         received += r;
         double pct = (total > 0) ? (100.0 * received / total) : 100.0;
-        cout << "Receiving: " << save_path << " - " << received << "/" << total
+        cout << "Receiving: " << (label.empty() ? save_path : label) << " - " << received << "/" << total
              << " bytes (" << fixed << setprecision(1) << pct << "% )\r";
         cout.flush();
     }
     cout << endl;
     outfile.close();
-    return true;
+    return !outfile.fail();
+}
+
+// Local submit (Unix socket): the client attaches its open file to the size
+// instead of sending the bytes. The copy is made in the kernel where it can
+// be, and hashed from our copy, which the client can't change under us.
+// 1 = stored, 0 = this file couldn't be copied, -1 = the stream broke.
+static int receive_passed_file(int sock, const string &save_path, Hasher &hasher) {
+    uint64_t net_size;
+    int in = net_recv_fd(sock, &net_size, sizeof(net_size));
+    if (in < 0) return -1;
+    uint64_t size = ntohll(net_size), copied = 0;
+    int out = open(save_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+#ifdef __linux__
+    for (loff_t in_off = 0, out_off = 0; out >= 0 && copied < size;) {
+        ssize_t n = copy_file_range(in, &in_off, out, &out_off, size - copied, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;  // EXDEV/ENOSYS/EINVAL, or the file shrank
+        copied += n;
+    }
+#endif
+    vector<char> buf(1 << 20);
+    while (out >= 0 && copied < size) {
+        ssize_t n = pread(in, buf.data(), min<uint64_t>(buf.size(), size - copied), copied);
+        if (n <= 0 || pwrite(out, buf.data(), n, copied) != n) break;
+        copied += n;
+    }
+    close(in);
+
+    bool ok = out >= 0 && copied == size;
+    hasher.reset();
+    if (ok && size > 0) {
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, out, 0);
+        ok = map != MAP_FAILED;
+        if (ok) {
+            hasher.update(map, size);
+            munmap(map, size);
+        }
+    }
+    if (out >= 0 && close(out) != 0) ok = false;
+    return ok ? 1 : 0;
 }
 
 bool send_file_to_client(int sock, const string &file_path) {
-    ifstream file(file_path, ios::binary | ios::ate);
-    if(!file) {
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
         cerr << "Cannot open file for sending: " << file_path << endl;
+        if(fd >= 0) close(fd);
         return false;
     }
 
-    uint64_t file_size = file.tellg();
-    file.seekg(0);
-
     // Send file size
-    uint64_t net_size = htonll(file_size);
-    if(send(sock, &net_size, sizeof(net_size), 0) != sizeof(net_size)) {
+    uint64_t total = st.st_size;
+    uint64_t net_size = htonll(total);
+    if(net_send(sock, &net_size, sizeof(net_size)) != sizeof(net_size)) {
+        close(fd);
         return false;
     }
 
-    // Send file content
-    char buffer[BUFFER_SIZE];
-    uint64_t total = file_size;
+    // Send file content: straight from the page cache unless TLS has to
+    // be done in user space (see net_sendfile)
     uint64_t sent = 0;
-    while(file_size > 0) {
-        size_t read_size = (file_size < BUFFER_SIZE) ? file_size : BUFFER_SIZE;
-        file.read(buffer, read_size);
-        if(send(sock, buffer, read_size, 0) != (ssize_t)read_size) {
-            return false;
+    bool ok = true;
+    while(ok && sent < total) {
+        size_t slice = (size_t)min<uint64_t>(total - sent, THROTTLE_SLICE);
+        throttle(slice, total);
+        for(uint64_t end = sent + slice; sent < end;) {
+            ssize_t n = net_sendfile(sock, fd, sent, end - sent);
+            if(n <= 0) {
+                ok = false;
+                break;
+            }
+            sent += n;
         }
-        file_size -= read_size;
-        sent += read_size;
         double pct = (total > 0) ? (100.0 * sent / total) : 100.0;
         cout << "Sending: " << file_path << " - " << sent << "/" << total
              << " bytes (" << fixed << setprecision(1) << pct << "% )\r";
         cout.flush();
     }
     cout << endl;
-
-    return true;
+    close(fd);
+    return ok;
 }
 
 
 bool send_string_to_client(int sock, const string &str) {
     uint32_t len = htonl(str.size());
-    if(send(sock, &len, sizeof(len), 0) != sizeof(len)) {
+    if(net_send(sock, &len, sizeof(len)) != sizeof(len)) {
         return false;
     }
     if(str.size() > 0) {
-        if(send(sock, str.c_str(), str.size(), 0) != (ssize_t)str.size()) {
+        if(net_send(sock, str.c_str(), str.size()) != (ssize_t)str.size()) {
             return false;
         }
     }
@@ -177,9 +292,20 @@ bool send_string_to_client(int sock, const string &str) {
 }
 
 // Clone project from server
+// Path prefixes a sparse clone wants, ended by an empty string (none = all)
+static bool receive_path_filter(int sock, vector<string> &prefixes) {
+    while(true) {
+        string prefix;
+        if(!receive_data(sock, prefix)) return false;
+        if(prefix.empty()) return true;
+        prefixes.push_back(prefix);
+    }
+}
+
 bool handle_clone_request(int client_sock) {
     string project_name;
-    if(!receive_data(client_sock, project_name)) {
+    vector<string> prefixes;
+    if(!receive_data(client_sock, project_name) || !receive_path_filter(client_sock, prefixes)) {
         cerr << "Failed to receive project name for clone\n";
         return false;
     }
@@ -195,22 +321,35 @@ bool handle_clone_request(int client_sock) {
     }
 
     // Check if project exists
-    if(!fs::exists(project_name) || !fs::is_directory(project_name)) {
+    std::shared_lock<std::shared_mutex> hold(storage.project_lock(project_name));
+    StorageRoot *root = storage.find(project_name);
+    if(!root) {
         cerr << "Project '" << project_name << "' not found\n";
         send_ack(client_sock, 0); // Send failure
         return false;
     }
+    string project_dir = root->project_dir(project_name);
     // Send ack for project name
     if(!send_ack(client_sock, 1)) {
         cerr << "Failed to send clone ack\n";
         return false;
     }
 
-    // Send Recursive directory contents
+    // Send Recursive directory contents, not descending into directories
+    // the filter can't match anything in
     try {
-        for(const auto& entry : fs::recursive_directory_iterator(project_name)) {
-            if(fs::is_regular_file(entry)) {
-                string rel_path = fs::relative(entry.path(), project_name).string();
+        for(auto it = fs::recursive_directory_iterator(project_dir); it != fs::recursive_directory_iterator(); ++it) {
+            const auto &entry = *it;
+            string rel_path = fs::relative(entry.path(), project_dir).string();
+            if(entry.is_directory()) {
+                bool wanted = prefixes.empty();
+                for(size_t i = 0; !wanted && i < prefixes.size(); ++i) {
+                    wanted = path_selected(rel_path, {prefixes[i]}) || path_selected(prefixes[i], {rel_path});
+                }
+                if(!wanted) it.disable_recursion_pending();
+                continue;
+            }
+            if(fs::is_regular_file(entry) && path_selected(rel_path, prefixes)) {
                 cout << "Sending file: " << rel_path << endl;
                 
                 if(!send_string_to_client(client_sock, rel_path)) {
@@ -230,7 +369,7 @@ bool handle_clone_request(int client_sock) {
     }
 
     uint32_t end_marker = htonl(0);
-    if(send(client_sock, &end_marker, sizeof(end_marker), 0) != sizeof(end_marker)) {
+    if(net_send(client_sock, &end_marker, sizeof(end_marker)) != sizeof(end_marker)) {
         cerr << "Failed to send end marker\n";
         return false;
     }
@@ -239,27 +378,315 @@ bool handle_clone_request(int client_sock) {
     return true;
 }
 
+// One lock for all manifests - refreshes are rare and mostly stat calls
+static std::mutex manifest_mutex;
+
+// Up to date manifest for a project, cached in <root>/.vcpmeta/<project>.manifest.
+// Only files whose size/mtime/inode moved since last time get rehashed.
+bool load_project_manifest(const StorageRoot &root, const string &project_name, Manifest &m) {
+    std::lock_guard<std::mutex> lock(manifest_mutex);
+    string manifest_file = root.manifest_file(project_name);
+    bool cached = read_manifest(manifest_file, m);
+
+    HashAlgo algo = project_hash_algo(root.project_dir(project_name));
+    if (!cached || m.algo != algo) {
+        m.files.clear();
+        m.algo = algo;
+    }
+
+    int changed = refresh_manifest(root.project_dir(project_name), m);
+    if (changed < 0) return false;
+    if (changed > 0 || !cached) {
+        std::error_code ec;
+        fs::create_directories(root.path + "/.vcpmeta", ec);
+        if (!write_manifest(manifest_file, m))
+            cerr << "Couldn't save manifest for " << project_name << "\n";
+    }
+    return true;
+}
+
+// Merkle trees of projects negotiated with lately. Only pushes and
+// replication change a project, and both drop its entry here.
+static std::mutex tree_mutex;
+static std::map<string, std::shared_ptr<const MerkleTree>> project_trees;
+
+static std::shared_ptr<const MerkleTree> project_tree(const StorageRoot &root, const string &project_name) {
+    {
+        std::lock_guard<std::mutex> lock(tree_mutex);
+        auto it = project_trees.find(project_name);
+        if (it != project_trees.end()) return it->second;
+    }
+    Manifest m;
+    if (!load_project_manifest(root, project_name, m)) return nullptr;
+    auto tree = std::make_shared<MerkleTree>();
+    tree->build(m);
+    std::lock_guard<std::mutex> lock(tree_mutex);
+    project_trees[project_name] = tree;
+    return tree;
+}
+
+// Fold files a submit just stored into the project's manifest. Their hashes
+// are already known, so the next refresh finds them clean instead of
+// reading them all back.
+static void record_stored_files(const StorageRoot &root, const string &project_name, HashAlgo algo,
+                                const vector<ManifestEntry> &stored) {
+    if (stored.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(tree_mutex);
+        project_trees.erase(project_name);
+    }
+    std::lock_guard<std::mutex> lock(manifest_mutex);
+    string manifest_file = root.manifest_file(project_name);
+    Manifest m;
+    if (!read_manifest(manifest_file, m) || m.algo != algo) {
+        m.files.clear();
+        m.algo = algo;
+    }
+    for (ManifestEntry e : stored) {
+        struct stat st;
+        if (stat((root.project_dir(project_name) + "/" + e.path).c_str(), &st) != 0) continue;
+        e.size = st.st_size;
+#ifdef __APPLE__
+        e.mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        e.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+        e.ino = st.st_ino;
+        m.files[e.path] = e;
+    }
+    std::error_code ec;
+    fs::create_directories(root.path + "/.vcpmeta", ec);
+    if (!write_manifest(manifest_file, m))
+        cerr << "Couldn't save manifest for " << project_name << "\n";
+}
+
+// Receive one file into the blob store and link it in as project/rel_path.
+// hash gets the content hash actually received.
+static bool store_incoming_file(int sock, StorageRoot &root, const string &project_name,
+                                const string &rel_path, HashAlgo algo, string &hash) {
+    Hasher hasher(algo);
+    string tmp = root.blobs->temp_path();
+    if (!receive_file(sock, tmp, &hasher, rel_path)) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    hash = hasher.final_hex();
+    JournalBatch batch;
+    batch.add_blob(tmp, algo, hash, root.project_dir(project_name) + "/" + rel_path);
+    vector<bool> ok;
+    root.journal->commit(batch, ok);
+    return ok[0];
+}
+
+static string peer_address(int sock) {
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    char host[INET6_ADDRSTRLEN] = "unknown";
+    if (getpeername(sock, reinterpret_cast<sockaddr*>(&addr), &len) == 0) {
+        if (addr.ss_family == AF_INET)
+            inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(&addr)->sin_addr, host, sizeof(host));
+        else if (addr.ss_family == AF_INET6)
+            inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(&addr)->sin6_addr, host, sizeof(host));
+        else if (addr.ss_family == AF_UNIX)
+            return "local";
+    }
+    return host;
+}
+
+static bool valid_project_name(const string &name) {
+    static const std::regex valid_name("^[A-Za-z0-9._-]{1,100}$");
+    return std::regex_match(name, valid_name);
+}
+
+// (path, hash, size) of every file, so the client can skip what it already has
+bool handle_manifest_request(int client_sock) {
+    string project_name;
+    vector<string> prefixes;
+    if(!receive_data(client_sock, project_name) || !receive_path_filter(client_sock, prefixes)) {
+        cerr << "Failed to receive project name for manifest\n";
+        return false;
+    }
+    if(!valid_project_name(project_name)) {
+        cerr << "Manifest request for unknown project: " << project_name << endl;
+        send_ack(client_sock, 0);
+        return false;
+    }
+    std::shared_lock<std::shared_mutex> hold(storage.project_lock(project_name));
+    StorageRoot *root = storage.find(project_name);
+    if(!root) {
+        cerr << "Manifest request for unknown project: " << project_name << endl;
+        send_ack(client_sock, 0);
+        return false;
+    }
+
+    Manifest m;
+    if(!load_project_manifest(*root, project_name, m)) {
+        cerr << "Can't build manifest for " << project_name << endl;
+        send_ack(client_sock, 0);
+        return false;
+    }
+    if(!send_ack(client_sock, 1) || !send_string_to_client(client_sock, hash_algo_name(m.algo))) {
+        return false;
+    }
+    // Sparse clone: only entries under the requested paths
+    size_t sent = 0;
+    for(const auto& item : m.files) {
+        const ManifestEntry &e = item.second;
+        if(!path_selected(e.path, prefixes)) continue;
+        sent++;
+        uint64_t net_size = htonll(e.size);
+        if(!send_string_to_client(client_sock, e.path) ||
+           !send_string_to_client(client_sock, e.hash) ||
+           net_send(client_sock, &net_size, sizeof(net_size)) != sizeof(net_size)) {
+            cerr << "Failed to send manifest entry: " << e.path << endl;
+            return false;
+        }
+    }
+    if(!send_string_to_client(client_sock, "")) return false;
+
+    cout << "Manifest sent for project: " << project_name << " (" << sent << " of " << m.files.size() << " files)\n";
+    return true;
+}
+
+// Send just the listed files. The client sends every path first (empty
+// string ends the list), then reads one ack + file per path, in order.
+bool handle_fetch_request(int client_sock) {
+    string project_name;
+    if(!receive_data(client_sock, project_name)) {
+        cerr << "Failed to receive project name for fetch\n";
+        return false;
+    }
+    if(!valid_project_name(project_name)) {
+        cerr << "Fetch request for unknown project: " << project_name << endl;
+        send_ack(client_sock, 0);
+        return false;
+    }
+    std::shared_lock<std::shared_mutex> hold(storage.project_lock(project_name));
+    StorageRoot *root = storage.find(project_name);
+    if(!root) {
+        cerr << "Fetch request for unknown project: " << project_name << endl;
+        send_ack(client_sock, 0);
+        return false;
+    }
+    if(!send_ack(client_sock, 1)) return false;
+
+    vector<string> wanted;
+    while(true) {
+        string path;
+        if(!receive_data(client_sock, path)) {
+            cerr << "Failed to receive fetch list\n";
+            return false;
+        }
+        if(path.empty()) break;
+        wanted.push_back(path);
+    }
+
+    for(const auto& path : wanted) {
+        string full = root->project_dir(project_name) + "/" + path;
+        if(!safe_relative_path(path) || !fs::is_regular_file(full)) {
+            cerr << "Can't serve " << path << endl;
+            if(!send_ack(client_sock, 0)) return false;
+            continue;
+        }
+        if(!send_ack(client_sock, 1) || !send_file_to_client(client_sock, full)) {
+            cerr << "Failed to send file: " << path << endl;
+            return false;
+        }
+    }
+    cout << "Fetch completed for project: " << project_name << " (" << wanted.size() << " files)\n";
+    return true;
+}
+
+// Merkle negotiation (see Merkle.h): after the header we send our root
+// hash, then answer directory listings in rounds. Each round the peer
+// sends a count and that many directory paths; we send, per directory,
+// a count and (name, hash, is_dir) for each child. A count of 0 ends it.
+bool handle_tree_request(int client_sock) {
+    string project_name, algo_name;
+    if (!receive_data(client_sock, project_name) || !receive_data(client_sock, algo_name)) {
+        cerr << "Failed to receive tree request.\n";
+        return false;
+    }
+    HashAlgo algo;
+    if (!valid_project_name(project_name) || !parse_hash_algo(algo_name, algo)) {
+        send_ack(client_sock, 0);
+        return false;
+    }
+    std::shared_lock<std::shared_mutex> hold(storage.project_lock(project_name));
+    StorageRoot *root = storage.find(project_name);
+    std::shared_ptr<const MerkleTree> tree = root ? project_tree(*root, project_name) : nullptr;
+    // New project, or hashed differently - nothing to compare against
+    if (!tree || tree->algo() != algo) {
+        send_ack(client_sock, 0);
+        return true;
+    }
+    if (!send_ack(client_sock, 1) || !send_string_to_client(client_sock, tree->root())) return false;
+
+    size_t rounds = 0, listed = 0;
+    while (true) {
+        uint32_t count;
+        if (!recv_all(client_sock, reinterpret_cast<char*>(&count), sizeof(count))) return false;
+        count = ntohl(count);
+        if (count == 0) break;
+        string reply;
+        for (uint32_t i = 0; i < count; ++i) {
+            string dir;
+            if (!receive_data(client_sock, dir)) return false;
+            const MerkleTree::Children *kids = tree->children(dir);
+            append_u32(reply, kids ? kids->size() : 0);
+            if (!kids) continue;
+            for (const auto &child : *kids) {
+                append_string(reply, child.first);
+                append_string(reply, child.second.hash);
+                append_u32(reply, child.second.dir);
+            }
+        }
+        if (!send_all(client_sock, reply.data(), reply.size())) return false;
+        rounds++;
+        listed += count;
+    }
+    cout << "Tree compared for " << project_name << ": " << listed << " directories in "
+         << rounds << " rounds\n";
+    return true;
+}
+
+// Client end of handle_tree_request: one round of directory listings
+static bool fetch_tree_level(int sock, const vector<string> &dirs, vector<MerkleTree::Children> &listings) {
+    string request;
+    append_u32(request, dirs.size());
+    for (const auto &d : dirs) append_string(request, d);
+    if (!send_all(sock, request.data(), request.size())) return false;
+    listings.assign(dirs.size(), MerkleTree::Children());
+    for (auto &listing : listings) {
+        uint32_t n;
+        if (!recv_all(sock, reinterpret_cast<char*>(&n), sizeof(n))) return false;
+        for (n = ntohl(n); n > 0; --n) {
+            string name;
+            MerkleNode node;
+            uint32_t is_dir;
+            if (!receive_data(sock, name) || !receive_data(sock, node.hash) ||
+                !recv_all(sock, reinterpret_cast<char*>(&is_dir), sizeof(is_dir)))
+                return false;
+            node.dir = ntohl(is_dir) != 0;
+            listing[name] = node;
+        }
+    }
+    return true;
+}
+
 bool handle_list_request(int client_sock) {
     cout << "List request received\n";
-    try {
-        for(const auto& entry : fs::directory_iterator(".")) {
-            if(fs::is_directory(entry) && entry.path().filename().string()[0] != '.') {
-                string project_name = entry.path().filename().string();
-                cout << "Sending project: " << project_name << endl;
-                
-                if(!send_string_to_client(client_sock, project_name)) {
-                    cerr << "Failed to send project name: " << project_name << endl;
-                    return false;
-                }
-            }
+    // Every root, each project once (one mid-rebalance can be on two)
+    for(const auto& project_name : storage.projects()) {
+        cout << "Sending project: " << project_name << endl;
+        if(!send_string_to_client(client_sock, project_name)) {
+            cerr << "Failed to send project name: " << project_name << endl;
+            return false;
         }
-    } catch(const fs::filesystem_error& e) {
-        cerr << "Error listing projects: " << e.what() << endl;
-        return false;
     }
 
     uint32_t end_marker = htonl(0);
-    if(send(client_sock, &end_marker, sizeof(end_marker), 0) != sizeof(end_marker)) {
+    if(net_send(client_sock, &end_marker, sizeof(end_marker)) != sizeof(end_marker)) {
         cerr << "Failed to send end marker\n";
         return false;
     }
@@ -268,8 +695,101 @@ bool handle_list_request(int client_sock) {
     return true;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
         std::signal(SIGINT, handle_sigint);
+    // A peer hanging up mid-send should fail that send, not kill the server
+    std::signal(SIGPIPE, SIG_IGN);
+    bool gc_only = false, rebalance_only = false;
+    Durability durability = Durability::BATCH;
+    string tls_cert, tls_key, tls_ca, unix_path;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--gc") gc_only = true;
+        else if (arg == "--rebalance") rebalance_only = true;
+        else if (arg == "--follower") follower_mode = true;
+        else if (arg == "--root" && i + 1 < argc) {
+            if (!storage.add(argv[++i])) return 1;
+        } else if (arg == "--port" && i + 1 < argc) {
+            server_port = atoi(argv[++i]);
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            socket_timeout = atoi(argv[++i]);
+        } else if (arg == "--unix" && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (arg == "--tls-cert" && i + 1 < argc) {
+            tls_cert = argv[++i];
+        } else if (arg == "--tls-key" && i + 1 < argc) {
+            tls_key = argv[++i];
+        } else if (arg == "--tls-ca" && i + 1 < argc) {
+            tls_ca = argv[++i];
+            tls_to_followers = true;
+        } else if (arg == "--durability" && i + 1 < argc) {
+            if (!parse_durability(argv[++i], durability)) {
+                cerr << "Bad durability: " << argv[i] << " (none, batch or strict)\n";
+                return 1;
+            }
+        } else if (arg == "--require-tls") {
+            require_tls = true;
+        } else if (arg == "--replica" && i + 1 < argc) {
+            replicator.add_follower(argv[++i]);
+        } else if ((arg == "--rate-limit" || arg == "--client-rate-limit") && i + 1 < argc) {
+            uint64_t rate;
+            if (!parse_byte_size(argv[++i], rate)) {
+                cerr << "Bad rate: " << argv[i] << " (use e.g. 100M)\n";
+                return 1;
+            }
+            if (arg == "--rate-limit") bandwidth.set_global_rate(rate);
+            else bandwidth.set_client_rate(rate);
+        } else {
+            cerr << "Usage: vcpserver [--port <n>] [--unix <socket path>] [--root <dir>[:weight]]... [--gc | --rebalance]\n"
+                 << "                 [--replica <host:port>]... | [--follower]\n"
+                 << "                 [--rate-limit <bytes/s>] [--client-rate-limit <bytes/s>]\n"
+                 << "                 [--timeout <seconds>] [--durability none|batch|strict]\n"
+                 << "                 [--tls-cert <pem> --tls-key <pem> [--require-tls]] [--tls-ca <pem>]\n";
+            return 1;
+        }
+    }
+    if (server_port <= 0 || server_port > 65535 || socket_timeout < 0 ||
+        (follower_mode && !replicator.empty())) {
+        cerr << "Bad --port or --timeout, or --replica given to a follower\n";
+        return 1;
+    }
+    if (tls_cert.empty() != tls_key.empty() || (require_tls && tls_cert.empty())) {
+        cerr << "--tls-cert and --tls-key go together, and --require-tls needs them\n";
+        return 1;
+    }
+    if (!tls_cert.empty()) {
+        if (!tls_init_server(tls_cert, tls_key)) return 1;
+        tls_serving = true;
+    }
+    if (tls_to_followers && !tls_init_client(tls_ca)) return 1;
+    if (!storage.init(durability)) return 1;
+    for (const auto &root : storage.all()) {
+        // Blobs no project links to any more (files replaced by later submits)
+        uint64_t freed_bytes = 0;
+        size_t freed = root->blobs->gc(&freed_bytes);
+        if (freed > 0) {
+            std::string gc_msg = "Blob store " + root->path + ": freed " + std::to_string(freed) +
+                                 " unreferenced blobs (" + std::to_string(freed_bytes) + " bytes)";
+            cout << gc_msg << "\n";
+            log_event(gc_msg);
+        }
+    }
+    if (gc_only) return 0;
+    if (rebalance_only) {
+        int moved = storage.rebalance();
+        cout << "Rebalance: " << (moved < 0 ? "finished with errors" : std::to_string(moved) + " projects moved") << "\n";
+        return moved < 0 ? 1 : 0;
+    }
+    // Projects sitting on a root they don't hash to (a root was just added)
+    // move over in the background; they're served from where they are meanwhile
+    if (storage.all().size() > 1) {
+        std::thread([]() {
+            int moved = storage.rebalance();
+            if (moved != 0) log_event("Rebalance: " + (moved < 0 ? string("finished with errors")
+                                                                 : std::to_string(moved) + " projects moved"));
+        }).detach();
+    }
+
     int server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock < 0) {
         cerr << "Error creating server socket.\n";
@@ -286,7 +806,7 @@ int main() {
 
     sockaddr_in server_addr{};
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_port = htons(server_port);
     server_addr.sin_addr.s_addr = INADDR_ANY;
 
     if (::bind(server_sock, reinterpret_cast<sockaddr*>(&server_addr), sizeof(server_addr)) < 0) {
@@ -301,90 +821,163 @@ int main() {
         return 1;
     }
 
-    cout << "Server listening on port " << SERVER_PORT << "...\n";
+    int unix_sock = -1;
+    if (!unix_path.empty() && (unix_sock = net_listen_unix(unix_path)) < 0) {
+        close(server_sock);
+        return 1;
+    }
+
+    cout << "Server listening on port " << server_port << (unix_sock >= 0 ? " and " + unix_path : string())
+         << (follower_mode ? " (read-only follower)" : "")
+         << (require_tls ? ", TLS only" : tls_serving ? ", TLS or plain" : "")
+         << ", durability " << durability_name(durability) << "...\n";
+
+    if (!replicator.empty()) {
+        replicator.start(replicate_project);
+        // Bring followers up to date with whatever they missed while apart;
+        // anything they already hold is just acknowledged, not resent
+        for (const auto &project : storage.projects()) replicator.project_changed(project);
+    }
 
     std::atomic<int> client_count{0};
     auto client_handler = [&](int client_sock) {
         client_count++;
-        std::string connect_msg = "Client connected. Active clients: " + std::to_string(client_count);
-        cout << connect_msg << "\n";
-        log_event(connect_msg);
-        string command;
-        if (!receive_data(client_sock, command)) {
-            std::string err_msg = "Failed to receive command.";
+        string peer = peer_address(client_sock);
+        FlowScope flow(peer, TrafficClass::NORMAL);
+        // A client speaking TLS opens with a handshake; anything else is plain.
+        // Unix socket clients are on this machine and are never asked for TLS.
+        bool local = net_is_local(client_sock);
+        bool tls_hello = tls_serving && !local && tls_hello_waiting(client_sock);
+        if ((tls_hello && !tls_accept(client_sock)) || (!tls_hello && require_tls && !local)) {
+            std::string err_msg = "Refused " + peer + ": " + (tls_hello ? "TLS handshake failed" : "plain connection, TLS required");
             cerr << err_msg << "\n";
             log_event(err_msg);
-            close(client_sock);
+            net_close(client_sock);
             client_count--;
             return;
         }
-        std::string cmd_msg = "Received command: " + command;
-        cout << cmd_msg << "\n";
-        log_event(cmd_msg);
-        if (command == "SUBMIT") {
-            handle_submit_request(client_sock);
-        } else if (command == "CLONE") {
-            handle_clone_request(client_sock);
-        } else if (command == "LIST") {
-            handle_list_request(client_sock);
-        } else {
-            std::string unknown_msg = "Unknown command: " + command;
-            cerr << unknown_msg << "\n";
-            log_event(unknown_msg);
-            send_ack(client_sock, 0);
+        std::string connect_msg = "Client connected (" + net_describe(client_sock) +
+                                  "). Active clients: " + std::to_string(client_count);
+        cout << connect_msg << "\n";
+        log_event(connect_msg);
+        // One command per connection, unless the client opens with SESSION:
+        // then commands follow one another until it hangs up, goes quiet
+        // for SESSION_IDLE seconds, or an exchange fails
+        bool session = false;
+        for (bool first = true;; first = false) {
+            string command;
+            if (session && !net_readable(client_sock, SESSION_IDLE * 1000)) break;
+            if (!receive_data(client_sock, command)) {
+                if (first) {
+                    std::string err_msg = "Failed to receive command.";
+                    cerr << err_msg << "\n";
+                    log_event(err_msg);
+                }
+                break;
+            }
+            std::string cmd_msg = "Received command: " + command;
+            cout << cmd_msg << "\n";
+            log_event(cmd_msg);
+            if (first && command == "SESSION") {
+                session = send_ack(client_sock, 1);
+                if (!session) break;
+                continue;
+            }
+            // Listings ahead of submits ahead of bulk downloads
+            if (command == "CLONE" || command == "FETCH" || command == "REPLICATE")
+                flow.set_class(TrafficClass::BULK);
+            else if (command == "SUBMIT" || command == "PUSH")
+                flow.set_class(TrafficClass::NORMAL);
+            else
+                flow.set_class(TrafficClass::INTERACTIVE);
+            bool done = false;
+            if (command == "SUBMIT") {
+                done = handle_submit_request(client_sock);
+            } else if (command == "CLONE") {
+                done = handle_clone_request(client_sock);
+            } else if (command == "LIST") {
+                done = handle_list_request(client_sock);
+            } else if (command == "MANIFEST") {
+                done = handle_manifest_request(client_sock);
+            } else if (command == "FETCH") {
+                done = handle_fetch_request(client_sock);
+            } else if (command == "TREE") {
+                done = handle_tree_request(client_sock);
+            } else if (command == "PUSH") {
+                done = handle_push_request(client_sock);
+            } else if (command == "REPLICATE") {
+                done = handle_replicate_request(client_sock);
+            } else if (command == "STATUS") {
+                done = handle_status_request(client_sock);
+            } else if (command == "ADMIN") {
+                done = handle_admin_request(client_sock, peer);
+            } else {
+                std::string unknown_msg = "Unknown command: " + command;
+                cerr << unknown_msg << "\n";
+                log_event(unknown_msg);
+                send_ack(client_sock, 0);
+            }
+            if (!session || !done) break;
         }
-        close(client_sock);
+        net_close(client_sock);
         std::string disconnect_msg = "Connection closed. Active clients: " + std::to_string(client_count - 1);
         cout << disconnect_msg << "\n";
         log_event(disconnect_msg);
         client_count--;
     };
 
-    while (server_running) {
-        try {
-            if (client_count >= MAX_CLIENTS) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                continue;
-            }
-            int client_sock = accept(server_sock, nullptr, nullptr);
-            if (!server_running) {
-                if (client_sock >= 0) close(client_sock);
-                break;
-            }
-            if (client_sock < 0) {
-                if (errno == EINTR && !server_running) break;
-                cerr << "Failed to accept client connection.\n";
-                log_event("Failed to accept client connection.");
-                continue;
-            }
-            std::thread([&, client_sock]() {
-                try {
-                    client_handler(client_sock);
-                } catch (const std::exception& e) {
-                    std::string err = std::string("Exception in client handler: ") + e.what();
-                    cerr << err << "\n";
-                    log_event(err);
-                    close(client_sock);
-                    client_count--;
-                } catch (...) {
-                    std::string err = "Unknown exception in client handler.";
-                    cerr << err << "\n";
-                    log_event(err);
-                    close(client_sock);
-                    client_count--;
+    auto accept_loop = [&](int listen_sock) {
+        while (server_running) {
+            try {
+                if (client_count >= MAX_CLIENTS) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    continue;
                 }
-            }).detach();
-        } catch (const std::exception& e) {
-            std::string err = std::string("Exception in main accept loop: ") + e.what();
-            cerr << err << "\n";
-            log_event(err);
-        } catch (...) {
-            std::string err = "Unknown exception in main accept loop.";
-            cerr << err << "\n";
-            log_event(err);
+                int client_sock = accept(listen_sock, nullptr, nullptr);
+                if (!server_running) {
+                    if (client_sock >= 0) net_close(client_sock);
+                    break;
+                }
+                if (client_sock < 0) {
+                    if (errno == EINTR && !server_running) break;
+                    cerr << "Failed to accept client connection.\n";
+                    log_event("Failed to accept client connection.");
+                    continue;
+                }
+                net_tune(client_sock, socket_timeout, 60);
+                std::thread([&, client_sock]() {
+                    try {
+                        client_handler(client_sock);
+                    } catch (const std::exception& e) {
+                        std::string err = std::string("Exception in client handler: ") + e.what();
+                        cerr << err << "\n";
+                        log_event(err);
+                        net_close(client_sock);
+                        client_count--;
+                    } catch (...) {
+                        std::string err = "Unknown exception in client handler.";
+                        cerr << err << "\n";
+                        log_event(err);
+                        net_close(client_sock);
+                        client_count--;
+                    }
+                }).detach();
+            } catch (const std::exception& e) {
+                std::string err = std::string("Exception in main accept loop: ") + e.what();
+                cerr << err << "\n";
+                log_event(err);
+            } catch (...) {
+                std::string err = "Unknown exception in main accept loop.";
+                cerr << err << "\n";
+                log_event(err);
+            }
         }
-    }
+    };
+    // Same-host clients can also come in over a Unix socket (--unix)
+    if (unix_sock >= 0) std::thread(accept_loop, unix_sock).detach();
+    accept_loop(server_sock);
     close(server_sock);
+    if (unix_sock >= 0) unlink(unix_path.c_str());
     log_event("Server socket closed. Exiting main.");
     std::cout << "Server shut down.\n";
     return 0;
@@ -405,10 +998,18 @@ bool handle_submit_request(int client_sock) {
         send_ack(client_sock, 0);
         return false;
     }
+    if (follower_mode) {
+        cerr << "Read-only follower, refusing submit for: " << project_name << "\n";
+        send_ack(client_sock, 0);
+        return false;
+    }
 
-    if (!fs::exists(project_name)) {
-        if (!fs::create_directory(project_name)) {
-            cerr << "Failed to create directory: " << project_name << "\n";
+    std::shared_lock<std::shared_mutex> project_hold(storage.project_lock(project_name));
+    StorageRoot &root = storage.place(project_name);
+    string project_dir = root.project_dir(project_name);
+    if (!fs::exists(project_dir)) {
+        if (!fs::create_directory(project_dir)) {
+            cerr << "Failed to create directory: " << project_dir << "\n";
             return false;
         }
     }
@@ -419,6 +1020,9 @@ bool handle_submit_request(int client_sock) {
     }
 
     // Step 2: Receive files until an empty filename is received.
+    HashAlgo algo = project_hash_algo(project_dir);
+    vector<ManifestEntry> stored;
+    std::shared_lock<std::shared_mutex> store_hold(root.blobs->lock());
     while (true) {
         string filepath;
         if (!receive_data(client_sock, filepath)) {
@@ -428,16 +1032,18 @@ bool handle_submit_request(int client_sock) {
         // An empty string signals end-of-transfer.
         if (filepath.empty()) break;
         // Reject absolute paths or parent traversal attempts
-        if (fs::path(filepath).is_absolute() || filepath.find("..") != string::npos) {
+        if (!safe_relative_path(filepath)) {
             cerr << "Rejected unsafe filepath: " << filepath << "\n";
             send_ack(client_sock, 0);
             continue;
         }
 
         // Preserve relative path when saving under the project directory
-        fs::path save_path = fs::path(project_name) / fs::path(filepath);
-        cout << "Receiving file: " << filepath << " -> " << save_path.string() << "\n";
-        if (receive_file(client_sock, save_path.string())) {
+        cout << "Receiving file: " << filepath << " -> " << project_dir << "/" << filepath << "\n";
+        ManifestEntry e;
+        e.path = filepath;
+        if (store_incoming_file(client_sock, root, project_name, filepath, algo, e.hash)) {
+            stored.push_back(e);
             if (!send_ack(client_sock, 1)) {
                 cerr << "Failed to send ack for file: " << filepath << "\n";
                 break;
@@ -448,10 +1054,389 @@ bool handle_submit_request(int client_sock) {
             break;
         }
     }
+    store_hold.unlock();
 
     // Final ack after all files received.
     if (!send_ack(client_sock, 1))
         cerr << "Failed to send final ack.\n";
 
+    record_stored_files(root, project_name, algo, stored);
+    project_hold.unlock();
+    if (!stored.empty()) replicator.project_changed(project_name);
     return true;
 }
+
+// Offer exchange shared by PUSH and REPLICATE, batched so nothing waits on
+// a round trip per file:
+//   1. the sender offers every file as (path, hash, size); empty path ends
+//   2. we answer all of them at once, one uint32 per offer:
+//        0 = rejected (bad path), 1 = send it, 2 = already have that content,
+//        3 = send a delta against the version we have at that path
+//      followed by a block signature (see Delta.h) for every 3
+//   3. the sender streams the files we asked for back to back: first the
+//      1s in offer order, each as size + bytes, then the 3s in offer
+//      order, each as size + delta. With local set (a Unix socket peer)
+//      each 1 is its size with the open file attached (SCM_RIGHTS).
+// Content any project has stored before never crosses the wire again, and
+// files of at least delta_min bytes (0 = never) we have an older version
+// of only send what changed.
+// -1 if the connection broke off, 0 if some file couldn't be stored, else 1.
+static int receive_offers(int client_sock, StorageRoot &root, const string &project_name,
+                          HashAlgo algo, uint64_t delta_min, bool local, vector<ManifestEntry> &stored,
+                          size_t &received, size_t &reused) {
+    vector<ManifestEntry> offers;
+    while (true) {
+        ManifestEntry e;
+        uint64_t net_size;
+        if (!receive_data(client_sock, e.path)) {
+            cerr << "Failed to receive file name.\n";
+            return -1;
+        }
+        if (e.path.empty()) break;
+        if (!receive_data(client_sock, e.hash) ||
+            !recv_all(client_sock, reinterpret_cast<char*>(&net_size), sizeof(net_size))) {
+            cerr << "Failed to receive offer for " << e.path << "\n";
+            return -1;
+        }
+        e.size = ntohll(net_size);
+        offers.push_back(std::move(e));
+    }
+
+    // Old versions deltas are taken against stay open until they're
+    // applied, so another push replacing them meanwhile doesn't matter
+    struct DeltaBase {
+        size_t offer;
+        int fd;
+        uint64_t size;
+        BlockSignature sig;
+        ~DeltaBase() { close(fd); }
+    };
+    std::shared_lock<std::shared_mutex> store_hold(root.blobs->lock());
+    // Everything this submit stores is made durable in one go at the end
+    JournalBatch batch;
+    vector<std::pair<ManifestEntry, bool>> staged;  // per batch entry: file, whether it was sent
+    vector<uint32_t> replies(offers.size());
+    vector<size_t> needed;
+    vector<std::unique_ptr<DeltaBase>> deltas;
+    for (size_t i = 0; i < offers.size(); ++i) {
+        ManifestEntry &e = offers[i];
+        string dest = root.project_dir(project_name) + "/" + e.path;
+        uint32_t reply = 1;
+        struct stat st;
+        if (!safe_relative_path(e.path)) {
+            cerr << "Rejected unsafe filepath: " << e.path << "\n";
+            reply = 0;
+        } else if (root.blobs->has(algo, e.hash) && root.blobs->link_into(algo, e.hash, dest)) {
+            batch.add_link(algo, e.hash, dest);
+            staged.emplace_back(e, false);
+            reply = 2;
+        } else if (delta_min > 0 && e.size >= delta_min && stat(dest.c_str(), &st) == 0 &&
+                   S_ISREG(st.st_mode) && (uint64_t)st.st_size >= delta_min) {
+            int fd = open(dest.c_str(), O_RDONLY);
+            if (fd >= 0) {
+                deltas.emplace_back(new DeltaBase{i, fd, (uint64_t)st.st_size, BlockSignature()});
+                reply = 3;
+            } else {
+                needed.push_back(i);
+            }
+        } else {
+            needed.push_back(i);
+        }
+        replies[i] = htonl(reply);
+    }
+    string reply_buf(reinterpret_cast<const char*>(replies.data()), replies.size() * sizeof(uint32_t));
+    for (auto &d : deltas) {
+        // A signature we can't compute still has to be sent; with no blocks
+        // the delta is all literal data
+        if (!compute_signature(d->fd, d->size, algo, d->sig)) d->sig.weak.clear(), d->sig.strong.clear();
+        append_signature(reply_buf, d->sig);
+    }
+    if (!send_all(client_sock, reply_buf.data(), reply_buf.size())) return -1;
+
+    int result = 1;
+    // The bytes are in; a disk problem from here on only costs this file
+    auto keep = [&](ManifestEntry &e, const string &tmp, const string &hash) {
+        if (hash != e.hash)
+            cerr << "Warning: " << e.path << " didn't match the hash it was offered with\n";
+        e.hash = hash;
+        batch.add_blob(tmp, algo, hash, root.project_dir(project_name) + "/" + e.path);
+        staged.emplace_back(e, true);
+    };
+    for (size_t i : needed) {
+        ManifestEntry &e = offers[i];
+        Hasher hasher(algo);
+        string tmp = root.blobs->temp_path();
+        if (local) {
+            int got = receive_passed_file(client_sock, tmp, hasher);
+            if (got < 0) {
+                cerr << "Error receiving file: " << e.path << "\n";
+                unlink(tmp.c_str());
+                result = -1;
+                break;
+            }
+            if (got == 0) {
+                cerr << "Couldn't copy " << e.path << " from the client\n";
+                unlink(tmp.c_str());
+                result = 0;
+                continue;
+            }
+        } else if (!receive_file(client_sock, tmp, &hasher, e.path)) {
+            cerr << "Error receiving file: " << e.path << "\n";
+            unlink(tmp.c_str());
+            result = -1;
+            break;
+        }
+        keep(e, tmp, hasher.final_hex());
+    }
+    for (auto &d : deltas) {
+        if (result < 0) break;
+        ManifestEntry &e = offers[d->offer];
+        uint64_t net_size;
+        if (!recv_all(client_sock, reinterpret_cast<char*>(&net_size), sizeof(net_size))) {
+            result = -1;
+            break;
+        }
+        uint64_t new_size = ntohll(net_size), written = 0, literal = 0;
+        string tmp = root.blobs->temp_path();
+        int out_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        Hasher hasher(algo);
+        auto in = [&](void *data, size_t len) {
+            throttle(len, new_size);
+            literal += len;
+            return recv_all(client_sock, static_cast<char*>(data), len);
+        };
+        auto out = [&](const void *data, size_t len) {
+            for (size_t off = 0; out_fd >= 0 && off < len;) {
+                ssize_t n = write(out_fd, static_cast<const char*>(data) + off, len - off);
+                if (n <= 0) return false;
+                off += n;
+            }
+            hasher.update(data, len);
+            written += len;
+            return out_fd >= 0;
+        };
+        int applied = apply_delta(d->fd, d->size, d->sig.block_size, in, out);
+        if (out_fd >= 0 && close(out_fd) != 0) applied = min(applied, 0);
+        if (applied < 0) {
+            cerr << "Error receiving delta for " << e.path << "\n";
+            unlink(tmp.c_str());
+            result = -1;
+            break;
+        }
+        if (applied == 0 || written != new_size) {
+            cerr << "Error rebuilding " << e.path << " from its delta\n";
+            unlink(tmp.c_str());
+            result = 0;
+            continue;
+        }
+        cout << "Delta: " << e.path << " - " << new_size << " bytes from " << literal
+             << " received\n";
+        keep(e, tmp, hasher.final_hex());
+    }
+
+    // Whatever arrived is kept even if the connection broke off, so a retry
+    // finds it already stored
+    vector<bool> ok;
+    root.journal->commit(batch, ok);
+    for (size_t i = 0; i < ok.size(); ++i) {
+        if (!ok[i]) {
+            cerr << "Error storing file: " << staged[i].first.path << "\n";
+            result = min(result, 0);
+            continue;
+        }
+        stored.push_back(staged[i].first);
+        staged[i].second ? received++ : reused++;
+    }
+    return result;
+}
+
+// Submit that offers every file before sending it (see receive_offers).
+// Header: project, hash algorithm, u64 delta cutoff.
+bool handle_push_request(int client_sock) {
+    string project_name, algo_name;
+    uint64_t net_delta_min;
+    if (!receive_data(client_sock, project_name) || !receive_data(client_sock, algo_name) ||
+        !recv_all(client_sock, reinterpret_cast<char*>(&net_delta_min), sizeof(net_delta_min))) {
+        cerr << "Failed to receive push header.\n";
+        return false;
+    }
+    HashAlgo algo;
+    if (follower_mode || !valid_project_name(project_name) || !parse_hash_algo(algo_name, algo)) {
+        cerr << (follower_mode ? "Read-only follower, refusing push for: " : "Invalid push for project: ")
+             << project_name << " (" << algo_name << ")\n";
+        send_ack(client_sock, 0);
+        return false;
+    }
+    std::shared_lock<std::shared_mutex> project_hold(storage.project_lock(project_name));
+    StorageRoot &root = storage.place(project_name);
+    std::error_code ec;
+    fs::create_directories(root.project_dir(project_name), ec);
+    if (ec) {
+        cerr << "Failed to create directory: " << project_name << "\n";
+        send_ack(client_sock, 0);
+        return false;
+    }
+    if (!send_ack(client_sock, 1)) return false;
+
+    vector<ManifestEntry> stored;
+    size_t reused = 0, received = 0;
+    // A client on this machine hands over open files instead of their bytes
+    int result = receive_offers(client_sock, root, project_name, algo, ntohll(net_delta_min),
+                                net_is_local(client_sock), stored, received, reused);
+    bool ok = result >= 0;
+    if (ok && !send_ack(client_sock, result))
+        cerr << "Failed to send final ack.\n";
+    record_stored_files(root, project_name, algo, stored);
+    project_hold.unlock();
+    if (!stored.empty()) replicator.project_changed(project_name);
+
+    std::string msg = "Push for " + project_name + ": " + std::to_string(received) +
+                      " files received, " + std::to_string(reused) + " already stored";
+    cout << msg << "\n";
+    log_event(msg);
+    return ok;
+}
+
+// Follower end of replication: same offers as PUSH, from our primary,
+// stamped with when the change happened there so we can tell our lag
+bool handle_replicate_request(int client_sock) {
+    string project_name, algo_name;
+    uint64_t net_changed;
+    if (!receive_data(client_sock, project_name) || !receive_data(client_sock, algo_name) ||
+        !recv_all(client_sock, reinterpret_cast<char*>(&net_changed), sizeof(net_changed))) {
+        cerr << "Failed to receive replication header.\n";
+        return false;
+    }
+    HashAlgo algo;
+    if (!follower_mode || !valid_project_name(project_name) || !parse_hash_algo(algo_name, algo)) {
+        cerr << "Refusing replication of " << project_name
+             << (follower_mode ? "" : " - not started with --follower") << "\n";
+        send_ack(client_sock, 0);
+        return false;
+    }
+    std::shared_lock<std::shared_mutex> project_hold(storage.project_lock(project_name));
+    StorageRoot &root = storage.place(project_name);
+    std::error_code ec;
+    fs::create_directories(root.project_dir(project_name), ec);
+    if (ec || !send_ack(client_sock, 1)) return false;
+
+    vector<ManifestEntry> stored;
+    size_t reused = 0, received = 0;
+    int result = receive_offers(client_sock, root, project_name, algo, 0, false, stored, received, reused);
+    record_stored_files(root, project_name, algo, stored);
+    if (result < 0 || !send_ack(client_sock, result) || result == 0) return false;
+    replica_state.applied(project_name, ntohll(net_changed));
+    log_event("Replicated " + project_name + ": " + std::to_string(received) + " files received, " +
+              std::to_string(reused) + " already stored");
+    return true;
+}
+
+// Connection to a follower, over TLS if --tls-ca was given; -1 if that failed
+static int connect_follower(const string &follower) {
+    int sock = net_connect(follower, SERVER_PORT);
+    if (sock < 0) return -1;
+    net_tune(sock, socket_timeout, 60);
+    string host;
+    int port;
+    if (tls_to_followers && !net_is_local(sock) && (!parse_host_port(follower, host, port, SERVER_PORT) || !tls_connect(sock, host))) {
+        net_close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Primary end: bring a follower's copy of a project up to date. Comparing
+// Merkle trees first narrows the offers down to files that differ, and of
+// those only content the follower has never stored gets sent.
+static bool replicate_project(const string &follower, const string &project_name, uint64_t changed_ms) {
+    FlowScope flow("replication", TrafficClass::BULK);
+    std::shared_lock<std::shared_mutex> project_hold(storage.project_lock(project_name));
+    StorageRoot *root = storage.find(project_name);
+    Manifest m;
+    if (!root || !load_project_manifest(*root, project_name, m)) return true;  // nothing to send
+
+    // Compare trees first and offer only what differs; if the follower
+    // can't compare (doesn't have the project yet) offer everything
+    vector<const ManifestEntry*> offer;
+    std::shared_ptr<const MerkleTree> tree = project_tree(*root, project_name);
+    int tree_sock = tree ? connect_follower(follower) : -1;
+    bool compared = false;
+    vector<string> changed;
+    if (tree_sock >= 0) {
+        uint32_t reply, done = 0;
+        string remote_root;
+        if (send_string_to_client(tree_sock, "TREE") && send_string_to_client(tree_sock, project_name) &&
+            send_string_to_client(tree_sock, hash_algo_name(m.algo)) &&
+            recv_all(tree_sock, reinterpret_cast<char*>(&reply), sizeof(reply)) && ntohl(reply) == 1 &&
+            receive_data(tree_sock, remote_root)) {
+            compared = merkle_diff(*tree, remote_root,
+                [tree_sock](const vector<string> &dirs, vector<MerkleTree::Children> &listings) {
+                    return fetch_tree_level(tree_sock, dirs, listings);
+                }, changed);
+            net_send(tree_sock, &done, sizeof(done));
+        }
+        net_close(tree_sock);
+    }
+    if (compared) {
+        for (const auto &path : changed) {
+            auto it = m.files.find(path);
+            if (it != m.files.end()) offer.push_back(&it->second);
+        }
+    } else {
+        for (const auto &kv : m.files) offer.push_back(&kv.second);
+    }
+
+    int sock = connect_follower(follower);
+    if (sock < 0) {
+        cerr << "Replication: can't reach follower " << follower << "\n";
+        return false;
+    }
+    uint64_t net_changed = htonll(changed_ms);
+    uint32_t reply;
+    bool ok = send_string_to_client(sock, "REPLICATE") &&
+              send_string_to_client(sock, project_name) &&
+              send_string_to_client(sock, hash_algo_name(m.algo)) &&
+              net_send(sock, &net_changed, sizeof(net_changed)) == sizeof(net_changed) &&
+              recv_all(sock, reinterpret_cast<char*>(&reply), sizeof(reply)) && ntohl(reply) == 1;
+    // All offers in one go (see receive_offers), then the files it wants
+    string offers;
+    for (const auto *e : offer) {
+        uint64_t net_size = htonll(e->size);
+        append_string(offers, e->path);
+        append_string(offers, e->hash);
+        offers.append(reinterpret_cast<const char*>(&net_size), sizeof(net_size));
+    }
+    append_string(offers, "");
+    vector<uint32_t> replies(offer.size());
+    ok = ok && send_all(sock, offers.data(), offers.size()) &&
+         recv_all(sock, reinterpret_cast<char*>(replies.data()), replies.size() * sizeof(uint32_t));
+    string project_dir = root->project_dir(project_name);
+    for (size_t i = 0; ok && i < offer.size(); ++i) {
+        if (ntohl(replies[i]) == 1) ok = send_file_to_client(sock, project_dir + "/" + offer[i]->path);
+    }
+    ok = ok && recv_all(sock, reinterpret_cast<char*>(&reply), sizeof(reply)) && ntohl(reply) == 1;
+    net_close(sock);
+    if (!ok) cerr << "Replication of " << project_name << " to " << follower << " failed\n";
+    return ok;
+}
+
+// Runtime settings (bandwidth limits for now), from this machine only
+bool handle_admin_request(int client_sock, const string &peer) {
+    string command;
+    if (!receive_data(client_sock, command)) return false;
+    if (peer != "127.0.0.1" && peer != "::1" && peer != "::ffff:127.0.0.1" && peer != "local") {
+        cerr << "Refusing admin command from " << peer << "\n";
+        return send_string_to_client(client_sock, "admin commands are only accepted from localhost\n");
+    }
+    log_event("Admin: " + command);
+    return send_string_to_client(client_sock, bandwidth.admin(command));
+}
+
+// Role and replication lag, as text for `vcp status`
+bool handle_status_request(int client_sock) {
+    string status;
+    if (follower_mode) status = replica_state.status();
+    else if (!replicator.empty()) status = replicator.status();
+    else status = "role: standalone\n";
+    return send_string_to_client(client_sock, status);
+}
@@ -0,0 +1,518 @@
+// vcp_loadgen - many simulated clients against one vcpserver
+//
+// Speaks the same wire protocol as the vcp client (PUSH for submit,
+// MANIFEST + FETCH for clone, LIST) but with synthetic projects generated
+// in memory, so one machine can play hundreds of clients without a disk
+// full of checkouts. Every interval it prints throughput, failures and
+// latency percentiles per operation, and a summary at the end.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "../Hash.h"
+#include "../Net.h"
+using namespace std;
+using Clock = chrono::steady_clock;
+
+#define SERVER_PORT 8080
+
+struct Options {
+    string server = "127.0.0.1";
+    unsigned clients = 16;        // concurrent connections at most
+    double rate = 0;              // arrivals/s (open loop), 0 = closed loop
+    double think_ms = 100;        // mean pause between a client's ops (closed loop)
+    double duration_s = 30;
+    double interval_s = 5;
+    double mix[3] = {1, 3, 6};    // submit, clone, list
+    unsigned projects = 8;
+    unsigned files = 50;
+    uint64_t file_size = 64 * 1024;
+    double change = 0.1;          // fraction of files new in each submit
+    int timeout_s = 30;
+    bool tls = false;             // handshake cost shows up in the latencies
+    HashAlgo algo = HashAlgo::SHA256;
+};
+
+enum Op { SUBMIT, CLONE, LIST, OP_COUNT };
+static const char *op_names[] = {"submit", "clone", "list"};
+
+// ok: did it; refused: server said no, or never answered the connection
+// (full accept queue); failed: broke off after the server had answered
+enum Outcome { OK, REFUSED, FAILED };
+
+// ---- wire protocol ----
+
+struct Conn {
+    int fd = -1;
+    bool answered = false;
+    ~Conn() { if (fd >= 0) net_close(fd); }
+    Outcome broken() const { return answered ? FAILED : REFUSED; }
+
+    bool open(const Options &opt) {
+        fd = net_connect(opt.server, SERVER_PORT);
+        if (fd < 0) return false;
+        net_tune(fd, opt.timeout_s, 0);
+        string host;
+        int port;
+        return !opt.tls || (parse_host_port(opt.server, host, port, SERVER_PORT) && tls_connect(fd, host));
+    }
+    bool send_all(const void *data, size_t len) {
+        const char *p = static_cast<const char*>(data);
+        while (len > 0) {
+            ssize_t n = net_send(fd, p, len);
+            if (n <= 0) return false;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+    bool recv_all(void *data, size_t len) {
+        char *p = static_cast<char*>(data);
+        while (len > 0) {
+            ssize_t n = net_recv(fd, p, len);
+            if (n <= 0) return false;
+            answered = true;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+    bool send_string(const string &s) {
+        uint32_t len = htonl(s.size());
+        return send_all(&len, sizeof(len)) && send_all(s.data(), s.size());
+    }
+    bool recv_string(string &s) {
+        uint32_t len;
+        if (!recv_all(&len, sizeof(len))) return false;
+        s.assign(ntohl(len), '\0');
+        return s.empty() || recv_all(&s[0], s.size());
+    }
+    bool send_u64(uint64_t v) {
+        v = htonll(v);
+        return send_all(&v, sizeof(v));
+    }
+    bool recv_u32(uint32_t &v) {
+        if (!recv_all(&v, sizeof(v))) return false;
+        v = ntohl(v);
+        return true;
+    }
+    // Read and throw away a size-prefixed file body; bytes gets its size
+    bool drain_file(uint64_t &bytes) {
+        if (!recv_all(&bytes, sizeof(bytes))) return false;
+        bytes = ntohll(bytes);
+        static thread_local vector<char> sink(256 * 1024);
+        for (uint64_t left = bytes; left > 0;) {
+            ssize_t n = net_recv(fd, sink.data(), min<uint64_t>(left, sink.size()));
+            if (n <= 0) return false;
+            left -= n;
+        }
+        return true;
+    }
+};
+
+// ---- synthetic projects ----
+
+// File content is a pure function of its seed, so it can be regenerated
+// for hashing and again for sending instead of being held in memory
+static void fill(uint64_t seed, uint64_t offset, char *buf, size_t len) {
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + offset / 8 + 1;
+    for (size_t i = 0; i < len; i += 8) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(buf + i, &x, min<size_t>(8, len - i));
+    }
+}
+
+struct SynthFile {
+    string path;
+    uint64_t size;
+    uint64_t seed;
+};
+
+// change = chance each file gets new content instead of the project's base
+static vector<SynthFile> make_files(const Options &opt, unsigned project, mt19937_64 &rng,
+                                    double change) {
+    // Sizes spread around file_size, same for every version of a project
+    mt19937_64 shape(project * 7919 + 1);
+    exponential_distribution<double> size_dist(1.0 / max<uint64_t>(opt.file_size, 1));
+    uniform_real_distribution<double> coin(0, 1);
+    vector<SynthFile> files;
+    for (unsigned i = 0; i < opt.files; ++i) {
+        SynthFile f;
+        f.path = "dir" + to_string(i % 10) + "/file" + to_string(i) + ".bin";
+        f.size = (uint64_t)size_dist(shape);
+        f.seed = ((uint64_t)project << 32) | i;   // the project's base content
+        if (change > 0 && coin(rng) < change) f.seed = rng();
+        files.push_back(f);
+    }
+    return files;
+}
+
+static string hash_synth(const SynthFile &f, HashAlgo algo) {
+    Hasher h(algo);
+    static thread_local vector<char> buf(256 * 1024);
+    for (uint64_t off = 0; off < f.size; off += buf.size()) {
+        size_t n = min<uint64_t>(buf.size(), f.size - off);
+        fill(f.seed, off, buf.data(), n);
+        h.update(buf.data(), n);
+    }
+    return h.final_hex();
+}
+
+static string project_name(unsigned p) { return "loadgen_" + to_string(p); }
+
+// ---- operations ----
+
+static Outcome do_submit(const Options &opt, unsigned project, mt19937_64 &rng,
+                         uint64_t &bytes, double change) {
+    vector<SynthFile> files = make_files(opt, project, rng, change);
+    Conn c;
+    if (!c.open(opt)) return REFUSED;
+    uint32_t reply;
+    if (!c.send_string("PUSH") || !c.send_string(project_name(project)) ||
+        !c.send_string(hash_algo_name(opt.algo)) || !c.send_u64(0) || !c.recv_u32(reply))
+        return c.broken();
+    if (reply != 1) return REFUSED;
+
+    // Every offer in one write, every reply in one read, then the wanted
+    // files back to back - the same shape as vcp submit
+    string offers;
+    for (const auto &f : files) {
+        string hash = hash_synth(f, opt.algo);
+        uint32_t path_len = htonl(f.path.size()), hash_len = htonl(hash.size());
+        uint64_t net_size = htonll(f.size);
+        offers.append(reinterpret_cast<const char*>(&path_len), sizeof(path_len)).append(f.path);
+        offers.append(reinterpret_cast<const char*>(&hash_len), sizeof(hash_len)).append(hash);
+        offers.append(reinterpret_cast<const char*>(&net_size), sizeof(net_size));
+    }
+    offers.append(4, '\0');
+    vector<uint32_t> replies(files.size());
+    if (!c.send_all(offers.data(), offers.size()) ||
+        !c.recv_all(replies.data(), replies.size() * sizeof(uint32_t)))
+        return c.broken();
+
+    static thread_local vector<char> buf(256 * 1024);
+    for (size_t i = 0; i < files.size(); ++i) {
+        const SynthFile &f = files[i];
+        if (ntohl(replies[i]) != 1) continue;   // have it / rejected
+        if (!c.send_u64(f.size)) return c.broken();
+        for (uint64_t off = 0; off < f.size; off += buf.size()) {
+            size_t n = min<uint64_t>(buf.size(), f.size - off);
+            fill(f.seed, off, buf.data(), n);
+            if (!c.send_all(buf.data(), n)) return c.broken();
+        }
+        bytes += f.size;
+    }
+    if (!c.recv_u32(reply)) return c.broken();
+    return reply == 1 ? OK : FAILED;
+}
+
+// A cold clone: the whole manifest, then every file
+static Outcome do_clone(const Options &opt, unsigned project, uint64_t &bytes) {
+    vector<string> paths;
+    {
+        Conn c;
+        if (!c.open(opt)) return REFUSED;
+        uint32_t reply;
+        string algo;
+        if (!c.send_string("MANIFEST") || !c.send_string(project_name(project)) || !c.send_string("") ||
+            !c.recv_u32(reply))
+            return c.broken();
+        if (reply != 1) return REFUSED;
+        if (!c.recv_string(algo)) return c.broken();
+        while (true) {
+            string path, hash;
+            uint64_t size;
+            if (!c.recv_string(path)) return c.broken();
+            if (path.empty()) break;
+            if (!c.recv_string(hash) || !c.recv_all(&size, sizeof(size))) return c.broken();
+            paths.push_back(path);
+        }
+    }
+    Conn c;
+    if (!c.open(opt)) return REFUSED;
+    uint32_t reply;
+    if (!c.send_string("FETCH") || !c.send_string(project_name(project)) || !c.recv_u32(reply))
+        return c.broken();
+    if (reply != 1) return REFUSED;
+    for (const auto &p : paths)
+        if (!c.send_string(p)) return c.broken();
+    if (!c.send_string("")) return c.broken();
+    for (size_t i = 0; i < paths.size(); ++i) {
+        uint64_t n;
+        if (!c.recv_u32(reply)) return c.broken();
+        if (reply != 1) continue;
+        if (!c.drain_file(n)) return c.broken();
+        bytes += n;
+    }
+    return OK;
+}
+
+static Outcome do_list(const Options &opt) {
+    Conn c;
+    if (!c.open(opt)) return REFUSED;
+    if (!c.send_string("LIST")) return c.broken();
+    while (true) {
+        string name;
+        if (!c.recv_string(name)) return c.broken();
+        if (name.empty()) return OK;
+    }
+}
+
+// ---- statistics ----
+
+struct Window {
+    vector<double> latency_ms[OP_COUNT];
+    uint64_t refused[OP_COUNT] = {}, failed[OP_COUNT] = {};
+    uint64_t bytes = 0;
+};
+
+class Stats {
+public:
+    void record(Op op, Outcome o, double ms, uint64_t bytes) {
+        lock_guard<mutex> hold(m);
+        for (Window *w : {&window, &total}) {
+            if (o == OK) w->latency_ms[op].push_back(ms);
+            else if (o == REFUSED) w->refused[op]++;
+            else w->failed[op]++;
+            w->bytes += bytes;
+        }
+    }
+    Window take_window() {
+        lock_guard<mutex> hold(m);
+        Window w;
+        swap(w, window);
+        return w;
+    }
+    Window totals() {
+        lock_guard<mutex> hold(m);
+        return total;
+    }
+
+private:
+    mutex m;
+    Window window, total;
+};
+
+static double percentile(vector<double> &v, double p) {
+    if (v.empty()) return 0;
+    size_t k = min(v.size() - 1, (size_t)(p / 100.0 * v.size()));
+    nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+static void print_window(Window &w, double seconds, const string &label) {
+    cout << fixed << setprecision(1) << label << "  "
+         << (w.bytes / seconds / (1024 * 1024)) << " MiB/s\n";
+    for (int op = 0; op < OP_COUNT; ++op) {
+        auto &v = w.latency_ms[op];
+        if (v.empty() && !w.refused[op] && !w.failed[op]) continue;
+        double mx = v.empty() ? 0 : *max_element(v.begin(), v.end());
+        cout << "  " << setw(6) << op_names[op] << "  " << setw(8) << (v.size() / seconds) << " ops/s"
+             << "  ok " << v.size() << "  refused " << w.refused[op] << "  failed " << w.failed[op]
+             << "  ms p50 " << percentile(v, 50) << " p90 " << percentile(v, 90)
+             << " p99 " << percentile(v, 99) << " max " << mx << "\n";
+    }
+    cout.flush();
+}
+
+// ---- driver ----
+
+static Op pick_op(const Options &opt, mt19937_64 &rng) {
+    discrete_distribution<int> d({opt.mix[0], opt.mix[1], opt.mix[2]});
+    return (Op)d(rng);
+}
+
+static void run_op(const Options &opt, Stats &stats, mt19937_64 &rng, Clock::time_point start) {
+    Op op = pick_op(opt, rng);
+    unsigned project = uniform_int_distribution<unsigned>(0, opt.projects - 1)(rng);
+    uint64_t bytes = 0;
+    Outcome o;
+    if (op == SUBMIT) o = do_submit(opt, project, rng, bytes, opt.change);
+    else if (op == CLONE) o = do_clone(opt, project, bytes);
+    else o = do_list(opt);
+    double ms = chrono::duration<double, milli>(Clock::now() - start).count();
+    stats.record(op, o, ms, bytes);
+}
+
+static bool parse_mix(const string &text, double mix[3]) {
+    double m[3] = {0, 0, 0};
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == string::npos) return false;
+        string name = item.substr(0, eq);
+        int op = -1;
+        for (int i = 0; i < OP_COUNT; ++i)
+            if (name == op_names[i]) op = i;
+        if (op < 0) return false;
+        m[op] = atof(item.c_str() + eq + 1);
+    }
+    if (m[0] + m[1] + m[2] <= 0) return false;
+    copy(m, m + 3, mix);
+    return true;
+}
+
+static void usage() {
+    cerr << "Usage: vcp_loadgen [options]\n"
+         << "  --server host[:port]  server to load ($VCP_SERVER, else 127.0.0.1:8080)\n"
+         << "  --clients N           simulated clients / max concurrent ops (16)\n"
+         << "  --rate R              open loop: R arrivals per second (default: closed loop)\n"
+         << "  --think MS            closed loop: mean think time between ops (100)\n"
+         << "  --duration S          how long to run (30)\n"
+         << "  --interval S          report every S seconds (5)\n"
+         << "  --mix submit=1,clone=3,list=6\n"
+         << "  --projects N          synthetic projects (8)\n"
+         << "  --files N             files per project (50)\n"
+         << "  --file-size BYTES     mean file size (65536)\n"
+         << "  --change F            fraction of files changed per submit (0.1)\n"
+         << "  --timeout S           socket timeout (30)\n"
+         << "  --tls-ca PEM          connect over TLS, trusting the CA in PEM\n"
+         << "  --hash sha256|blake3\n";
+}
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    if (const char *env = getenv("VCP_SERVER")) opt.server = env;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (i + 1 >= argc) { usage(); return 1; }
+        string v = argv[++i];
+        if (a == "--server") opt.server = v;
+        else if (a == "--clients") opt.clients = max(1, atoi(v.c_str()));
+        else if (a == "--rate") opt.rate = atof(v.c_str());
+        else if (a == "--think") opt.think_ms = atof(v.c_str());
+        else if (a == "--duration") opt.duration_s = atof(v.c_str());
+        else if (a == "--interval") opt.interval_s = max(0.1, atof(v.c_str()));
+        else if (a == "--projects") opt.projects = max(1, atoi(v.c_str()));
+        else if (a == "--files") opt.files = max(1, atoi(v.c_str()));
+        else if (a == "--file-size") opt.file_size = strtoull(v.c_str(), nullptr, 10);
+        else if (a == "--change") opt.change = atof(v.c_str());
+        else if (a == "--timeout") opt.timeout_s = max(1, atoi(v.c_str()));
+        else if (a == "--tls-ca") {
+            if (!tls_init_client(v)) return 1;
+            opt.tls = true;
+        }
+        else if (a == "--mix") {
+            if (!parse_mix(v, opt.mix)) { usage(); return 1; }
+        } else if (a == "--hash") {
+            if (!parse_hash_algo(v, opt.algo)) { usage(); return 1; }
+        } else { usage(); return 1; }
+    }
+
+    // Seed the projects so clones have something to fetch
+    cout << "Seeding " << opt.projects << " projects on " << opt.server << "...\n";
+    mt19937_64 seed_rng(42);
+    for (unsigned p = 0; p < opt.projects; ++p) {
+        uint64_t bytes = 0;
+        if (do_submit(opt, p, seed_rng, bytes, 0) != OK) {
+            cerr << "Couldn't seed " << project_name(p) << " - is the server running?\n";
+            return 1;
+        }
+    }
+
+    Stats stats;
+    atomic<bool> running{true};
+    auto t0 = Clock::now();
+    vector<thread> workers;
+
+    // Open loop: arrivals on a Poisson schedule whether or not earlier ones
+    // finished, and latency counted from the scheduled arrival, so a slow
+    // server shows up as queueing instead of being hidden by it
+    mutex qm;
+    condition_variable qcv;
+    deque<Clock::time_point> arrivals;
+    uint64_t backlog_peak = 0;
+
+    for (unsigned i = 0; i < opt.clients; ++i) {
+        workers.emplace_back([&, i]() {
+            mt19937_64 rng(1000 + i);
+            exponential_distribution<double> think(1.0 / max(opt.think_ms, 0.001));
+            while (running) {
+                Clock::time_point start;
+                if (opt.rate > 0) {
+                    unique_lock<mutex> hold(qm);
+                    qcv.wait(hold, [&]() { return !arrivals.empty() || !running; });
+                    if (!running) break;
+                    start = arrivals.front();
+                    arrivals.pop_front();
+                } else {
+                    start = Clock::now();
+                }
+                run_op(opt, stats, rng, start);
+                if (opt.rate <= 0 && opt.think_ms > 0 && running)
+                    this_thread::sleep_for(chrono::duration<double, milli>(think(rng)));
+            }
+        });
+    }
+
+    thread arrival_thread;
+    if (opt.rate > 0) {
+        arrival_thread = thread([&]() {
+            mt19937_64 rng(7);
+            exponential_distribution<double> gap(opt.rate);
+            auto next = Clock::now();
+            while (running) {
+                next += chrono::duration_cast<Clock::duration>(chrono::duration<double>(gap(rng)));
+                this_thread::sleep_until(next);
+                lock_guard<mutex> hold(qm);
+                arrivals.push_back(next);
+                backlog_peak = max<uint64_t>(backlog_peak, arrivals.size());
+                qcv.notify_one();
+            }
+        });
+    }
+
+    auto last = t0;
+    while (true) {
+        auto now = Clock::now();
+        double elapsed = chrono::duration<double>(now - t0).count();
+        if (elapsed >= opt.duration_s) break;
+        this_thread::sleep_for(chrono::duration<double>(min(opt.interval_s, opt.duration_s - elapsed)));
+        now = Clock::now();
+        Window w = stats.take_window();
+        ostringstream label;
+        label << "[" << fixed << setprecision(0) << chrono::duration<double>(now - t0).count() << "s]";
+        if (opt.rate > 0) {
+            lock_guard<mutex> hold(qm);
+            label << " backlog " << arrivals.size();
+        }
+        print_window(w, chrono::duration<double>(now - last).count(), label.str());
+        last = now;
+    }
+
+    running = false;
+    qcv.notify_all();
+    if (arrival_thread.joinable()) arrival_thread.join();
+    cout << "Waiting for in-flight operations...\n";
+    for (auto &t : workers) t.join();
+
+    Window total = stats.totals();
+    double secs = chrono::duration<double>(Clock::now() - t0).count();
+    cout << "\n";
+    print_window(total, secs, "Total over " + to_string((int)secs) + "s");
+    if (opt.rate > 0) {
+        cout << "  arrivals left unserved: " << arrivals.size() << " (peak backlog " << backlog_peak << ")\n";
+    }
+    uint64_t bad = 0;
+    for (int op = 0; op < OP_COUNT; ++op) bad += total.failed[op];
+    return bad ? 2 : 0;
+}
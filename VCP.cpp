@@ -1,357 +1,635 @@
 
+#include <algorithm>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
 #include <string>
+#include <map>
 #include <unordered_map>
 #include <sstream>
 #include <chrono>
 #include <iomanip>
-#include <openssl/evp.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
+#include <cstdlib>
 #include <cstring>
+#include <glob.h>
 #include <unordered_set>
+#include <vector>
+#include "VCP.h"
 #include "FTP.h"  // for file transferring
+#include "Diff.h"
+#include "Hash.h"
+#include "Walker.h"
+#include "Ignore.h"
+#include "Watch.h"
+#include "Manifest.h"
+#include "ObjectCache.h"
 
 namespace fs = std::filesystem;
 
 using namespace std; 
 
-string cpath, vcpPath; 
-
-class VCP {
-private:
-    //using SHA-256 (OpenSSL EVP)
-    string hashFile(const string &fpath) {
-        ifstream file(fpath, ios::binary);
-        if (!file) {
-            cerr << "Can't read " << fpath << " (permissions? missing?)" << endl;
-            return "";
+// fsync() a file or directory by name
+static bool sync_path(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+VCP::VCP(const string &root, Reporter *rep, ConnectionPool *pool)
+    : cpath(root), vcpPath(root + "/.vcp"), rep(rep ? rep : &console), pool(pool) {}
+
+// Repo settings from .vcp/config.txt:
+//   hash=<algo>        sha256 if absent
+//   delta_min=<bytes>  submit sends changes only for files this big (0 = never)
+void VCP::loadConfig() {
+    if(config_loaded) return;
+    config_loaded = true;
+    ifstream cfg(vcpPath + "/config.txt");
+    string line;
+    while(getline(cfg, line)) {
+        if(line.rfind("hash=", 0) == 0) {
+            HashAlgo algo;
+            if(parse_hash_algo(line.substr(5), algo)) hash_algo = algo;
+            else rep->err() << "Unknown hash '" << line.substr(5) << "' in config, using sha256\n";
         }
-
-        EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-        if (!mdctx) {
-            cerr << "Failed to create OpenSSL digest context" << endl;
-            return "";
+        else if(line.rfind("delta_min=", 0) == 0) {
+            char *end;
+            unsigned long long v = strtoull(line.c_str() + 10, &end, 10);
+            if(*end == '\0' && end != line.c_str() + 10) delta_min = v;
+            else rep->err() << "Bad delta_min '" << line.substr(10) << "' in config, using " << delta_min << "\n";
         }
+    }
+}
 
-        if (1 != EVP_DigestInit_ex(mdctx, EVP_sha256(), nullptr)) {
-            cerr << "EVP_DigestInit_ex failed" << endl;
-            EVP_MD_CTX_free(mdctx);
-            return "";
-        }
+HashAlgo VCP::repoHash() {
+    loadConfig();
+    return hash_algo;
+}
 
-        char buf[8192];
-        while (file.good()) {
-            file.read(buf, sizeof(buf));
-            std::streamsize n = file.gcount();
-            if (n > 0) {
-                if (1 != EVP_DigestUpdate(mdctx, buf, (size_t)n)) {
-                    cerr << "EVP_DigestUpdate failed" << endl;
-                    EVP_MD_CTX_free(mdctx);
-                    return "";
-                }
-            }
-        }
+uint64_t VCP::repoDeltaMin() {
+    loadConfig();
+    return delta_min;
+}
 
-        unsigned char md_value[EVP_MAX_MD_SIZE];
-        unsigned int md_len = 0;
-        if (1 != EVP_DigestFinal_ex(mdctx, md_value, &md_len)) {
-            cerr << "EVP_DigestFinal_ex failed" << endl;
-            EVP_MD_CTX_free(mdctx);
-            return "";
-        }
 
-        EVP_MD_CTX_free(mdctx);
+// Patterns from .vcpignore at the project root, compiled once per run
+const IgnoreMatcher &VCP::ignores() {
+    if(!ignore_loaded) {
+        ignore.load(cpath + "/.vcpignore");
+        ignore_loaded = true;
+    }
+    return ignore;
+}
+
+string VCP::hashFile(const string &fpath) {
+    return hash_file(fpath, repoHash(), rep->err());
+}
+
+// Hash walker results (want_stat entries), reusing .vcp/index wherever
+// size/mtime/inode still match what was hashed last time. Entries at or
+// after the index's own mtime are "racily clean" and hashed anyway.
+// full_scan means files is the whole tree, so stale entries get dropped.
+vector<string> VCP::hashEntries(const vector<WalkEntry> &files, bool full_scan) {
+    string index_path = vcpPath + "/index";
+    Manifest idx;
+    int64_t index_mtime = 0;
+    struct stat ist;
+    if(read_manifest(index_path, idx) && idx.algo == repoHash() &&
+       stat(index_path.c_str(), &ist) == 0) {
+#ifdef __APPLE__
+        index_mtime = (int64_t)ist.st_mtimespec.tv_sec * 1000000000 + ist.st_mtimespec.tv_nsec;
+#else
+        index_mtime = (int64_t)ist.st_mtim.tv_sec * 1000000000 + ist.st_mtim.tv_nsec;
+#endif
+    } else {
+        idx.files.clear();
+        idx.algo = repoHash();
+    }
 
-        stringstream hs;
-        for (unsigned int i = 0; i < md_len; ++i)
-            hs << hex << setw(2) << setfill('0') << (int)md_value[i];
-        return hs.str();
+    vector<string> hashes(files.size());
+    vector<size_t> todo;
+    vector<string> abs_paths;
+    for(size_t i = 0; i < files.size(); ++i) {
+        const WalkEntry &f = files[i];
+        auto it = idx.files.find(f.path);
+        if(it != idx.files.end() && it->second.size == f.size && it->second.ino == f.ino &&
+           it->second.mtime_ns == f.mtime_ns && f.mtime_ns < index_mtime) {
+            hashes[i] = it->second.hash;
+        } else {
+            todo.push_back(i);
+            abs_paths.push_back(cpath + "/" + f.path);
+        }
     }
 
-    // Skip executables and hidden files for security 
-    bool isExe(const fs::path &fpath) {
-        fs::file_status status = fs::status(fpath);
-        bool is_exec = 
-            (status.permissions() & fs::perms::owner_exec) != fs::perms::none || 
-            (status.permissions() & fs::perms::group_exec) != fs::perms::none || 
-            (status.permissions() & fs::perms::others_exec) != fs::perms::none;
-        
-        // Heuristic for executable extension
-        bool no_ext = fpath.extension().empty();
-        return is_exec || no_ext; 
+    vector<string> fresh = hash_files(abs_paths, repoHash(), rep->err());
+    for(size_t k = 0; k < todo.size(); ++k) {
+        const WalkEntry &f = files[todo[k]];
+        hashes[todo[k]] = fresh[k];
+        if(fresh[k].empty()) continue;
+        ManifestEntry &e = idx.files[f.path];
+        e.path = f.path;
+        e.hash = fresh[k];
+        e.size = f.size;
+        e.mtime_ns = f.mtime_ns;
+        e.ino = f.ino;
     }
 
-public:
+    size_t dropped = 0;
+    if(full_scan) {
+        unordered_set<string> seen;
+        for(const auto& f : files) seen.insert(f.path);
+        for(auto it = idx.files.begin(); it != idx.files.end();) {
+            if(seen.count(it->first)) ++it;
+            else { it = idx.files.erase(it); dropped++; }
+        }
+    }
+    if(!todo.empty() || dropped) write_manifest(index_path, idx);
+    return hashes;
+}
+
+// Parent directories of a tracked file, so state() stops calling them new
+void VCP::trackParents(const string &rel, unordered_map<string,string> &tracked) {
+    for(size_t slash = rel.find('/'); slash != string::npos; slash = rel.find('/', slash + 1)) {
+        tracked.emplace(rel.substr(0, slash + 1), "-");
+    }
+}
+
+// Skip executables for security: anything executable or without an extension
+bool VCP::isExe(const string &rel, mode_t mode) {
+    bool is_exec = (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+    size_t slash = rel.rfind('/');
+    size_t dot = rel.rfind('.');
+    size_t name_start = (slash == string::npos) ? 0 : slash + 1;
+    bool no_ext = dot == string::npos || dot <= name_start;
+    return is_exec || no_ext;
+}
 
 // Set up new project
-    void init() {
-        string tracker_path = vcpPath + "/tracker.txt";
-        if(fs::exists(tracker_path)){
-            cerr << "Existing project found!\n"; 
-            return;
-        }
+bool VCP::init(const string &name, HashAlgo algo) {
+    string tracker_path = vcpPath + "/tracker.txt";
+    if(fs::exists(tracker_path)){
+        rep->err() << "Existing project found!\n"; 
+        return false;
+    }
 
-        // Make .vcp dir
-        if (!fs::create_directory(vcpPath)) {
-            cerr << "Failed to create .vcp directory - permissions issue?\n";
-            return;
-        }
+    // Make .vcp dir
+    if (!fs::create_directory(vcpPath)) {
+        rep->err() << "Failed to create .vcp directory - permissions issue?\n";
+        return false;
+    }
 
-        // Get project name from user
-        string proj_name;
-        cout << "Enter project name (no spaces): ";
-        cin.ignore();
-        getline(cin, proj_name);
-        
-        // Add timestamp to ensure project name is unique and avoid conflicts
-        auto now = chrono::system_clock::now();
-        time_t now_c = chrono::system_clock::to_time_t(now);
-        stringstream timestamp;
-        timestamp << put_time(localtime(&now_c), "%Y%m%d_%H%M");
-        proj_name += "_" + timestamp.str();
-
-        // Create tracker file and write project name on it
-        ofstream tracker(tracker_path);
-        if (!tracker) {
-            cerr << "Failed to create tracker file!\n";
-            return;
-        }
-        tracker << proj_name << endl;
-        cout << "Project '" << proj_name << "' ready!\n";
+    string proj_name = name;
+    // Add timestamp to ensure project name is unique and avoid conflicts
+    auto now = chrono::system_clock::now();
+    time_t now_c = chrono::system_clock::to_time_t(now);
+    stringstream timestamp;
+    timestamp << put_time(localtime(&now_c), "%Y%m%d_%H%M");
+    proj_name += "_" + timestamp.str();
+
+    // Create tracker file and write project name on it
+    ofstream tracker(tracker_path);
+    if (!tracker) {
+        rep->err() << "Failed to create tracker file!\n";
+        return false;
+    }
+    tracker << proj_name << endl;
+
+    // Record the hash algorithm so every later add/state agrees on it
+    ofstream cfg(vcpPath + "/config.txt");
+    cfg << "hash=" << hash_algo_name(algo) << endl;
+    rep->out() << "Project '" << proj_name << "' ready!\n";
+    return true;
+}
+
+// Scan the working copy for new and modified files
+bool VCP::state(RepoState &st) {
+    string tracker_file = vcpPath + "/tracker.txt";
+    if(!fs::exists(tracker_file)){
+        rep->err() << "No project here - run 'init' first!\n"; 
+        return false;
     }
 
-// Show state of repository
-    void state() {
-        string tracker_file = vcpPath + "/tracker.txt";
-        if(!fs::exists(tracker_file)){
-            cerr << "No project here - run 'init' first!\n"; 
-            return;
+    // Load existing files
+    ifstream tf(tracker_file);
+    string proj_name;
+    getline(tf, proj_name);
+    
+    unordered_set<string> tracked_dirs;
+    unordered_map<string,string> tracked_files;
+    string path, hash;
+    while(tf >> path >> hash) {
+        if(path.back() == '/') {
+            tracked_dirs.insert(path);
+        } else {
+            tracked_files[path] = hash;
         }
+    }
+    tf.close();
 
-        // Load existing files
-        ifstream tf(tracker_file);
-        string proj_name;
-        getline(tf, proj_name);
-        
-        unordered_set<string> tracked_dirs;
-        unordered_map<string,string> tracked_files;
-        string path, hash;
-        while(tf >> path >> hash) {
-            if(path.back() == '/') {
-                tracked_dirs.insert(path);
-            } else {
-                tracked_files[path] = hash;
-            }
+    // Scan current dir
+    unordered_map<string,string> new_items;
+    unordered_map<string,string> changed_files;
+    vector<WalkEntry> scan_files;
+    
+    // A live `vcp watch` already knows which paths can differ; otherwise
+    // walk everything. Hidden and .vcpignore'd entries are pruned by the
+    // walker itself.
+    vector<WalkEntry> entries;
+    bool full_scan = false;
+    if(!journal_entries(cpath, vcpPath, "", true, entries)) {
+        full_scan = true;
+        const IgnoreMatcher &ig = ignores();
+        WalkOptions opts;
+        opts.want_stat = true;  // for the stat index
+        if(!ig.empty()) {
+            opts.skip = [&ig](const string &p, bool is_dir) { return ig.match(p, is_dir); };
         }
-        tf.close();
-
-        // Scan current dir
-        unordered_map<string,string> new_items;
-        unordered_map<string,string> changed_files;
-        
-        try {
-            for(const auto& entry : fs::recursive_directory_iterator(cpath, 
-                fs::directory_options::skip_permission_denied)) 
-            {
-                string rel_path = fs::relative(entry.path(), cpath).string();
-                
-                // Skip hidden files
-                if(rel_path.find("/.") != string::npos || 
-                   rel_path[0] == '.') continue;
-
-                if(fs::is_regular_file(entry)) {
-                    string current_hash = hashFile(entry.path().string());
-                    if(current_hash.empty()) continue;  // Skip unreadable
-
-                    if(!tracked_files.count(rel_path)) {
-                        new_items[rel_path] = current_hash;
-                    } else if(tracked_files[rel_path] != current_hash) {
-                        changed_files[rel_path] = current_hash;
-                    }
-                }
-                else if(fs::is_directory(entry)) {
-                    if(!tracked_dirs.count(rel_path + "/")) {
-                        new_items[rel_path + "/"] = "";
-                    }
-                }
-            }
-        } catch(fs::filesystem_error& e) {
-            cerr << "Scan failed  " << endl;
+        if(!walk_tree(cpath, entries, opts)) {
+            rep->err() << "Scan failed  " << endl;
         }
-
-        // Print results
-        if(!new_items.empty()) {
-            cout << "** New items **\n";
-            for(const auto& item : new_items) {
-                cout << "  + " << item.first << endl;
-            }
+    }
+    for(auto& entry : entries) {
+        if(entry.type == WalkEntry::FILE) {
+            scan_files.push_back(std::move(entry));
         }
-        
-        if(!changed_files.empty()) {
-            cout << "\n** Modified files **\n";
-            for(const auto& file : changed_files) {
-                cout << "  * " << file.first << endl;
+        else if(entry.type == WalkEntry::DIR) {
+            if(!tracked_dirs.count(entry.path + "/")) {
+                new_items[entry.path + "/"] = "";
             }
         }
-        
-        if(new_items.empty() && changed_files.empty()) {
-            cout << "No changes detected\n";
+    }
+
+    // Hash whatever the stat index can't vouch for, in one batch
+    vector<string> hashes = hashEntries(scan_files, full_scan);
+    for(size_t i = 0; i < scan_files.size(); ++i) {
+        const string &current_hash = hashes[i];
+        if(current_hash.empty()) continue;  // Skip unreadable
+
+        const string &rel = scan_files[i].path;
+        if(!tracked_files.count(rel)) {
+            new_items[rel] = current_hash;
+        } else if(tracked_files[rel] != current_hash) {
+            changed_files[rel] = current_hash;
         }
     }
 
-    // Add files to tracking
-    bool add(const string &fpath) {
-        string tracker_path = vcpPath + "/tracker.txt";
-        if(!fs::exists(tracker_path)) {
-            cerr << "No project! Run 'init' first.\n"; 
-            return false;
+    st.added.clear();
+    st.modified.clear();
+    for(const auto& item : new_items) st.added.push_back(item.first);
+    for(const auto& file : changed_files) st.modified.push_back(file.first);
+    sort(st.added.begin(), st.added.end());
+    sort(st.modified.begin(), st.modified.end());
+    return true;
+}
+
+// The tracked versions come from the object cache, or from the server
+// when the cache doesn't have them
+int VCP::diff(const vector<string> &paths, ostream &out) {
+    string tracker_file = vcpPath + "/tracker.txt";
+    if(!fs::exists(tracker_file)) {
+        rep->err() << "No project here - run 'init' first!\n";
+        return 1;
+    }
+    ifstream tf(tracker_file);
+    string proj_name;
+    getline(tf, proj_name);
+
+    // Files a lazy clone hasn't fetched are unchanged by definition
+    Manifest pending;
+    read_manifest(cpath + "/" + LAZY_LIST, pending);
+    unordered_map<string,string> tracked;
+    vector<WalkEntry> present;
+    map<string,string> base, deleted;  // path -> version to diff against
+    string path, hash;
+    while(tf >> path >> hash) {
+        if(path.back() == '/' || path.rfind(".vcp/", 0) == 0 || !path_selected(path, paths)) continue;
+        WalkEntry e;
+        if(statEntry(path, e)) {
+            tracked[path] = hash;
+            present.push_back(std::move(e));
+        } else if(!pending.files.count(path)) {
+            deleted[path] = hash;
         }
+    }
+    tf.close();
 
-        if (!fs::exists(fpath)) { 
-            cerr << "Can't find '" << fpath << "' - typo?\n"; 
-            return false; 
+    vector<string> hashes = hashEntries(present, false);
+    for(size_t i = 0; i < present.size(); ++i) {
+        const string &rel = present[i].path;
+        if(!hashes[i].empty() && hashes[i] != tracked[rel]) base[rel] = tracked[rel];
+    }
+    base.insert(deleted.begin(), deleted.end());
+    if(base.empty()) return 0;
+
+    ObjectCache cache(repoHash());
+    FileTransfer ft(cpath, rep, pool);
+    ft.cache_versions(proj_name, base, cache);
+    int status = 0;
+    vector<DiffPair> pairs;
+    for(const auto& b : base) {
+        string old_file = cache.object_path(b.second);
+        if(!cache.available() || access(old_file.c_str(), F_OK) != 0) {
+            rep->err() << "No copy of the last version of " << b.first << " - not diffed\n";
+            status = 1;
+            continue;
         }
+        pairs.push_back({b.first, old_file, deleted.count(b.first) ? "" : cpath + "/" + b.first});
+    }
+    for(const auto& text : diff_files(pairs)) out.write(text.data(), text.size());
+    return status;
+}
+
+// Stat a file into a walker-style entry
+bool VCP::statEntry(const string &rel, WalkEntry &e) {
+    struct stat st;
+    if(stat((cpath + "/" + rel).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    e.path = rel;
+    e.type = WalkEntry::FILE;
+    e.mode = st.st_mode;
+    e.size = st.st_size;
+#ifdef __APPLE__
+    e.mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    e.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    e.ino = st.st_ino;
+    return true;
+}
+
+// A path as given (relative ones are relative to the root)
+string VCP::fullPath(const string &p) const {
+    return fs::path(p).is_absolute() ? p : cpath + "/" + p;
+}
+
+// Files one add argument stands for (a file, or a directory's
+// contents), appended to files; false with the reason reported if none
+bool VCP::collectFiles(const string &arg, vector<WalkEntry> &files) {
+    const string &fpath = arg;
+    string full = fullPath(arg);
+    if (!fs::exists(full)) { 
+        rep->err() << "Can't find '" << fpath << "' - typo?\n"; 
+        return false; 
+    }
 
-        // Read existing tracker data
-        ifstream tracker(tracker_path);
-        string proj_name;
-        getline(tracker, proj_name);
-        
-        unordered_map<string, string> tracked;
-        string path, hash;
-        while(tracker >> path >> hash) {
-            tracked[path] = hash;
+    // Process input path
+    string rel_path = fs::relative(full, cpath).string();
+    const IgnoreMatcher &ig = ignores();
+    if(rel_path != "." && ig.match_path(rel_path, fs::is_directory(full))) {
+        rep->err() << "'" << fpath << "' is ignored by .vcpignore\n";
+        return false;
+    }
+    
+    if (fs::is_directory(full)) {
+        // Add directory contents
+        WalkOptions opts;
+        opts.prefix = rel_path == "." ? "" : rel_path;
+        opts.skip_hidden = false;
+        opts.want_stat = true;  // need permission bits for isExe
+        if(!ig.empty()) {
+            opts.skip = [&ig](const string &p, bool is_dir) { return ig.match(p, is_dir); };
         }
-        tracker.close();
-
-        // Process input path
-        string rel_path = fs::relative(fpath, cpath).string();
-        
-        if (fs::is_directory(fpath)) {
-            // Add directory contents
-            try {
-                for(const auto& entry : fs::recursive_directory_iterator(fpath)) {
-                    if(fs::is_regular_file(entry) && !isExe(entry.path())) {
-                        string item_rel = fs::relative(entry.path(), cpath).string();
-                        tracked[item_rel] = hashFile(entry.path().string());
-                    }
-                }
-            } catch(...) {
-                cerr << "Error scanning directory\n";
-                return false;
-            }
-        } 
-        else if(fs::is_regular_file(fpath)) {
-            if(isExe(fpath)) {
-                cerr << "Unsupported file type\n \t executable file\n";
-                return false;
+        vector<WalkEntry> entries;
+        bool in_meta = rel_path == ".vcp" || rel_path.rfind(".vcp/", 0) == 0;
+        if(!in_meta && journal_entries(cpath, vcpPath, opts.prefix, false, entries)) {
+            // The watcher doesn't cover .vcp itself
+            if(opts.prefix.empty()) {
+                opts.prefix = ".vcp";
+                walk_tree(vcpPath, entries, opts);
             }
-            tracked[rel_path] = hashFile(fpath);
         }
-        else {
-            cerr << "Unsupported file type\n";
+        else if(!walk_tree(full, entries, opts)) {
+            rep->err() << "Error scanning directory '" << fpath << "'\n";
             return false;
         }
-
-        // Write back updated tracker
-        ofstream out(tracker_path);
-        out << proj_name << endl;
-        for(const auto& item : tracked) {
-            out << item.first << " " << item.second << endl;
+        for(auto& entry : entries) {
+            if(entry.type == WalkEntry::FILE && !isExe(entry.path, entry.mode)) {
+                files.push_back(std::move(entry));
+            }
         }
         return true;
     }
-
-// Push to server
-    void submit() {
-        add(vcpPath);
-        FileTransfer ft;
-        ft.submit();  
+    WalkEntry e;
+    if(!fs::is_regular_file(full) || !statEntry(rel_path, e)) {
+        rep->err() << "Unsupported file type: " << fpath << "\n";
+        return false;
+    }
+    if(isExe(rel_path, e.mode)) {
+        rep->err() << "Unsupported file type: " << fpath << "\n \t executable file\n";
+        return false;
+    }
+    files.push_back(std::move(e));
+    return true;
+}
+
+// The tracker is read once, everything is hashed in one parallel batch,
+// and the new tracker is synced and replaces the old one in a single
+// rename, so an interrupted add (or a power cut) changes nothing.
+bool VCP::add(const vector<string> &fpaths) {
+    string tracker_path = vcpPath + "/tracker.txt";
+    if(!fs::exists(tracker_path)) {
+        rep->err() << "No project! Run 'init' first.\n"; 
+        return false;
     }
 
+    // Read existing tracker data
+    ifstream tracker(tracker_path);
+    string proj_name;
+    getline(tracker, proj_name);
     
-    void clone(const string &project_name) {
-        if(project_name.empty()) {
-            cerr << "Please specify a project name to clone\n";
-            return;
-        }
-
-        FileTransfer ft;
-        if(ft.clone_project(project_name) == 0) {
-            if(fs::exists(project_name + "/.vcp")) {
-                cout << "Project '" << project_name << "' cloned successfully!\n";
-                cout << "Navigate to the project directory with: cd " << project_name << endl;
+    unordered_map<string, string> tracked;
+    string path, hash;
+    while(tracker >> path >> hash) {
+        if(!watch_file(path)) tracked[path] = hash;  // older adds picked up watch.log
+    }
+    tracker.close();
+
+    bool all_ok = true;
+    vector<string> args, absent;
+    for(const auto& p : fpaths) {
+        string full = fullPath(p);
+        if(p.find_first_of("*?[") != string::npos && !fs::exists(full)) {
+            glob_t g;
+            if(glob(full.c_str(), 0, nullptr, &g) != 0) {
+                rep->err() << "No match for '" << p << "'\n";
+                all_ok = false;
+                continue;
             }
+            // Matches named the way the pattern was
+            size_t strip = full.size() - p.size();
+            for(size_t i = 0; i < g.gl_pathc; ++i) args.push_back(string(g.gl_pathv[i]).substr(strip));
+            globfree(&g);
+            continue;
         }
+        if(!fs::exists(full)) absent.push_back(repoPath(p));
+        args.push_back(p);
     }
-
-    
-    void list() {
-        FileTransfer ft;
-        ft.list_projects();
+    // In a lazy clone, asking for a file is the first use of it
+    if(!absent.empty()) {
+        FileTransfer ft(cpath, rep, pool);
+        ft.fetch_lazy(cpath, absent);
     }
 
-    void help() {
-        cout << "VCP - Version Control Program\n";
-        cout << "Commands:\n"
-             << "  init     - Start new project\n"
-             << "  state    - Show changes\n"
-             << "  add      - Track files\n"
-             << "  submit   - Send to server\n"
-             << "  clone    - Clone project from server\n"
-             << "  list     - List available projects on server\n";
+    vector<WalkEntry> files;
+    for(const auto& a : args) {
+        if(!collectFiles(a, files)) all_ok = false;
     }
-};
-
-
-int main(int argc, char *argv[]) {
-    VCP vcp;
-    cpath = fs::current_path().string();
-    vcpPath = cpath + "/.vcp"; 
-
-    if(argc < 2) {
-        vcp.help();
-        return 1;
+    // Overlapping arguments ("src" and "src/a.c") name some files twice;
+    // the watcher's own files are local to this machine
+    unordered_set<string> seen;
+    files.erase(remove_if(files.begin(), files.end(),
+                          [&seen](const WalkEntry &e) {
+                              return watch_file(e.path) || !seen.insert(e.path).second;
+                          }),
+                files.end());
+
+    vector<string> hashes = hashEntries(files, false);
+    for(size_t i = 0; i < files.size(); ++i) {
+        if(hashes[i].empty()) {
+            rep->err() << "Can't read '" << files[i].path << "' - not added\n";
+            all_ok = false;
+            continue;
+        }
+        tracked[files[i].path] = hashes[i];
+        trackParents(files[i].path, tracked);
     }
 
-    string cmd = argv[1];
-    
-    if(cmd == "init") {
-        vcp.init();
+    // Write back updated tracker
+    string tmp_path = tracker_path + ".tmp";
+    ofstream out(tmp_path, ios::trunc);
+    out << proj_name << endl;
+    for(const auto& item : tracked) {
+        out << item.first << " " << item.second << "\n";
     }
-    else if(cmd == "state") {
-        vcp.state();
+    out.close();
+    // Data before the rename, or a crash can leave an empty tracker
+    if(!out || !sync_path(tmp_path) || rename(tmp_path.c_str(), tracker_path.c_str()) != 0) {
+        rep->err() << "Failed to update tracker file!\n";
+        unlink(tmp_path.c_str());
+        return false;
     }
-    else if(cmd == "add") {
-        if(argc < 3) {
-            cerr << "Missing file to add!\n";
-            return 1;
+    sync_path(vcpPath);
+    return all_ok;
+}
+
+// Push to server
+bool VCP::submit() {
+    if(!add({vcpPath})) return false;
+
+    // Files a lazy clone hasn't fetched are unchanged by definition
+    Manifest pending;
+    read_manifest(cpath + "/" + LAZY_LIST, pending);
+
+    ifstream tf(vcpPath + "/tracker.txt");
+    string proj_name;
+    getline(tf, proj_name);
+    vector<WalkEntry> files, meta_files;
+    unordered_map<string,string> added_as;
+    string path, hash;
+    while(tf >> path >> hash) {
+        if(path.back() == '/') continue;  // directory entry
+        WalkEntry e;
+        if(!statEntry(path, e)) {
+            if(!pending.files.count(path)) rep->err() << "Skipping " << path << " - it's gone\n";
+            continue;
         }
-        vcp.add(argv[2]);
-    }
-    else if(cmd == "submit") {
-        vcp.submit();
+        added_as[path] = hash;
+        (path.rfind(".vcp/", 0) == 0 ? meta_files : files).push_back(std::move(e));
     }
-    else if(cmd == "clone") {
-        if(argc < 3) {
-            cerr << "Missing project name to clone!\n";
-            return 1;
+    tf.close();
+
+    // Offer the server what's on disk now, not what was added; the
+    // index makes this free for anything untouched since
+    vector<string> hashes = hashEntries(files, false);
+    vector<ManifestEntry> offer;
+    for(size_t i = 0; i < files.size(); ++i) {
+        if(hashes[i].empty()) {
+            rep->err() << "Can't read " << files[i].path << " - skipping\n";
+            continue;
         }
-        vcp.clone(argv[2]);
+        if(hashes[i] != added_as[files[i].path]) {
+            rep->out() << "Note: " << files[i].path << " changed since it was added\n";
+        }
+        ManifestEntry m;
+        m.path = files[i].path;
+        m.hash = hashes[i];
+        m.size = files[i].size;
+        offer.push_back(m);
     }
-    else if(cmd == "list") {
-        vcp.list();
+    // .vcp itself last: hashEntries above may just have rewritten the index.
+    // The lazy list describes this checkout only, so it stays here.
+    for(const auto& f : meta_files) {
+        if(f.path == LAZY_LIST) continue;
+        error_code ec;
+        ManifestEntry m;
+        m.path = f.path;
+        m.hash = hashFile(cpath + "/" + f.path);
+        m.size = fs::file_size(cpath + "/" + f.path, ec);
+        if(!ec && !m.hash.empty()) offer.push_back(m);
     }
-    else {
-        cerr << "Unknown command '" << cmd << "'\n";
-        vcp.help();
-        return 1;
+
+    FileTransfer ft(cpath, rep, pool);
+    return ft.submit(proj_name, offer, repoHash(), repoDeltaMin()) == 0;
+}
+
+
+bool VCP::clone(const string &project_name, const vector<string> &paths, bool lazy) {
+    if(project_name.empty()) {
+        rep->err() << "Please specify a project name to clone\n";
+        return false;
     }
 
-    return 0;
-}
\ No newline at end of file
+    FileTransfer ft(cpath, rep, pool);
+    return ft.clone_project(project_name, paths, lazy) == 0;
+}
+
+
+int VCP::fetch(const vector<string> &paths) {
+    if(!fs::exists(vcpPath + "/tracker.txt")) {
+        rep->err() << "No project here - run 'init' first!\n";
+        return 1;
+    }
+    FileTransfer ft(cpath, rep, pool);
+    int got = ft.fetch_lazy(cpath, paths);
+    if(got == 0) rep->out() << "Nothing to fetch\n";
+    else if(got > 0) rep->out() << "Fetched " << got << " files\n";
+    return got < 0 ? 1 : 0;
+}
+
+string VCP::repoPath(const string &p) const {
+    string rel = fs::path(p).lexically_normal().string();
+    if(fs::path(p).is_absolute()) rel = fs::path(p).lexically_relative(cpath).lexically_normal().string();
+    while(!rel.empty() && rel.back() == '/') rel.pop_back();
+    return rel == "." ? "" : rel;
+}
+
+bool VCP::list(vector<string> &projects) {
+    FileTransfer ft(cpath, rep, pool);
+    return ft.list_projects(projects) == 0;
+}
+
+bool VCP::status(string &text) {
+    FileTransfer ft(cpath, rep, pool);
+    return ft.server_status(text) == 0;
+}
+
+bool VCP::admin(const string &command, string &reply) {
+    FileTransfer ft(cpath, rep, pool);
+    return ft.server_admin(command, reply) == 0;
+}
+
+int VCP::watch(bool foreground, bool stop) {
+    if(!fs::exists(vcpPath + "/tracker.txt")) {
+        rep->err() << "No project here - run 'init' first!\n";
+        return 1;
+    }
+    if(stop) return stop_watcher(vcpPath);
+    return run_watcher(cpath, vcpPath, repoHash(), foreground);
+}
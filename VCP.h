@@ -0,0 +1,84 @@
+#ifndef VCP_H
+#define VCP_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+#include "Hash.h"
+#include "Ignore.h"
+#include "Progress.h"
+#include "Walker.h"
+
+class ConnectionPool;
+
+// What `vcp state` finds: paths relative to the root, directories ending in "/"
+struct RepoState {
+    std::vector<std::string> added;     // not tracked yet
+    std::vector<std::string> modified;  // tracked, content changed since
+};
+
+// One working copy: the directory holding .vcp/ (for clone, the directory
+// the project is cloned into). Everything the `vcp` command does, with
+// results returned rather than printed; messages go to the Reporter.
+// Not thread safe - see VCPClient.h for running operations concurrently.
+class VCP {
+public:
+    // rep null = stdout/stderr; pool null = a new connection per request
+    explicit VCP(const std::string &root, Reporter *rep = nullptr, ConnectionPool *pool = nullptr);
+    VCP(const VCP &) = delete;
+    VCP &operator=(const VCP &) = delete;
+
+    // New project named name plus a timestamp; false if there already is one
+    bool init(const std::string &name, HashAlgo algo = HashAlgo::SHA256);
+    bool state(RepoState &st);
+    // Unified diff of tracked files under paths (all if none) that differ
+    // from the version in the tracker, written to out. 0, or 1 if some
+    // couldn't be diffed.
+    int diff(const std::vector<std::string> &paths, std::ostream &out);
+    // Add files to tracking. Each argument is a file, a directory, or a
+    // glob the shell didn't expand. A bad argument is reported and
+    // skipped; false if there was one.
+    bool add(const std::vector<std::string> &fpaths);
+    bool submit();
+    bool clone(const std::string &project_name, const std::vector<std::string> &paths, bool lazy);
+    // Check out files a lazy clone left for later (all of them if no paths)
+    int fetch(const std::vector<std::string> &paths);
+    bool list(std::vector<std::string> &projects);
+    // Server role, and for replicas how far behind they are
+    bool status(std::string &text);
+    // Runtime server settings, e.g. "set global 100M" (localhost only)
+    bool admin(const std::string &command, std::string &reply);
+    // Background inotify watcher that keeps .vcp/journal up to date
+    int watch(bool foreground, bool stop);
+
+    // Path as the repo names it: relative to the root, no "./" or trailing "/"
+    std::string repoPath(const std::string &p) const;
+
+private:
+    void loadConfig();
+    HashAlgo repoHash();
+    uint64_t repoDeltaMin();
+    const IgnoreMatcher &ignores();
+    std::string hashFile(const std::string &fpath);
+    std::vector<std::string> hashEntries(const std::vector<WalkEntry> &files, bool full_scan);
+    void trackParents(const std::string &rel, std::unordered_map<std::string, std::string> &tracked);
+    bool isExe(const std::string &rel, mode_t mode);
+    bool statEntry(const std::string &rel, WalkEntry &e);
+    std::string fullPath(const std::string &p) const;
+    bool collectFiles(const std::string &arg, std::vector<WalkEntry> &files);
+
+    std::string cpath, vcpPath;
+    Reporter console;
+    Reporter *rep;
+    ConnectionPool *pool;
+
+    bool config_loaded = false;
+    HashAlgo hash_algo = HashAlgo::SHA256;
+    uint64_t delta_min = 1 << 20;
+    bool ignore_loaded = false;
+    IgnoreMatcher ignore;
+};
+
+#endif // VCP_H
@@ -0,0 +1,119 @@
+#include <filesystem>
+#include <stdexcept>
+#include "VCPClient.h"
+using namespace std;
+namespace fs = std::filesystem;
+
+// One key per working copy however it's named
+static string repo_key(const string &root) {
+    string key = fs::absolute(root).lexically_normal().string();
+    while(key.size() > 1 && key.back() == '/') key.pop_back();
+    return key;
+}
+
+// Why an operation failed: the last thing it complained about
+static string failure(const Reporter &rep, const string &op) {
+    return rep.last_error().empty() ? op + " failed" : rep.last_error();
+}
+
+VCPClient::VCPClient(unsigned threads) {
+    for(unsigned i = 0; i < max(threads, 1u); ++i) workers.emplace_back([this]() { run(); });
+}
+
+VCPClient::~VCPClient() {
+    {
+        lock_guard<mutex> hold(mutex_);
+        stopping = true;
+    }
+    work.notify_all();
+    for(auto &t : workers) t.join();
+}
+
+void VCPClient::run() {
+    while(true) {
+        function<void()> job;
+        {
+            unique_lock<mutex> hold(mutex_);
+            // Jobs queued behind a running one can't be left waiting, so
+            // stopping waits for those too
+            work.wait(hold, [this]() { return !queue.empty() || (stopping && waiting.empty()); });
+            if(queue.empty()) return;
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        job();
+    }
+}
+
+void VCPClient::schedule(const string &key, function<void()> job) {
+    {
+        lock_guard<mutex> hold(mutex_);
+        if(key.empty()) {
+            queue.push_back(std::move(job));
+        } else {
+            auto wrapped = [this, key, job]() {
+                job();
+                finished(key);
+            };
+            auto it = waiting.find(key);
+            if(it != waiting.end()) {
+                it->second.push_back(wrapped);
+                return;
+            }
+            waiting[key];  // running now, nothing behind it yet
+            queue.push_back(wrapped);
+        }
+    }
+    work.notify_one();
+}
+
+// The running job for key is done: start the next one waiting
+void VCPClient::finished(const string &key) {
+    {
+        lock_guard<mutex> hold(mutex_);
+        auto it = waiting.find(key);
+        if(it->second.empty()) {
+            waiting.erase(it);
+        } else {
+            queue.push_back(std::move(it->second.front()));
+            it->second.pop_front();
+        }
+    }
+    work.notify_all();
+}
+
+future<RepoState> VCPClient::state(const string &root, ProgressFn progress) {
+    return enqueue<RepoState>(repo_key(root), repo_key(root), progress, [](VCP &vcp, Reporter &rep) {
+        RepoState st;
+        if(!vcp.state(st)) throw runtime_error(failure(rep, "state"));
+        return st;
+    });
+}
+
+future<bool> VCPClient::add(const string &root, const vector<string> &paths, ProgressFn progress) {
+    return enqueue<bool>(repo_key(root), repo_key(root), progress, [paths](VCP &vcp, Reporter &) {
+        return vcp.add(paths);
+    });
+}
+
+future<bool> VCPClient::submit(const string &root, ProgressFn progress) {
+    return enqueue<bool>(repo_key(root), repo_key(root), progress, [](VCP &vcp, Reporter &) {
+        return vcp.submit();
+    });
+}
+
+future<bool> VCPClient::clone(const string &dir, const string &project_name, const vector<string> &paths,
+                              bool lazy, ProgressFn progress) {
+    return enqueue<bool>(repo_key(dir + "/" + project_name), repo_key(dir), progress,
+                         [project_name, paths, lazy](VCP &vcp, Reporter &) {
+                             return vcp.clone(project_name, paths, lazy);
+                         });
+}
+
+future<vector<string>> VCPClient::list(ProgressFn progress) {
+    return enqueue<vector<string>>("", "", progress, [](VCP &vcp, Reporter &rep) {
+        vector<string> projects;
+        if(!vcp.list(projects)) throw runtime_error(failure(rep, "list"));
+        return projects;
+    });
+}
@@ -0,0 +1,88 @@
+#ifndef VCP_CLIENT_H
+#define VCP_CLIENT_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FTP.h"
+#include "Progress.h"
+#include "VCP.h"
+
+// libvcp for programs that run many operations from one long-lived
+// process (build systems, IDEs), instead of spawning `vcp` for each.
+//
+//   VCPClient client;
+//   auto sent = client.submit("/src/app", [](const ProgressEvent &e) { ... });
+//   auto projects = client.list();
+//   if(!sent.get()) ...
+//
+// Every call returns at once; operations run on the client's worker
+// threads and the future is ready when one is done. Operations on the same
+// working copy run one after another, in the order they were asked for;
+// others run side by side. Connections to the server are kept open and
+// shared between operations (see ConnectionPool). Each operation's
+// messages and transfer progress go to the ProgressFn given with it,
+// called on the worker thread running it.
+class VCPClient {
+public:
+    // threads: how many operations run at once
+    explicit VCPClient(unsigned threads = 4);
+    // Finishes whatever was asked for first
+    ~VCPClient();
+    VCPClient(const VCPClient &) = delete;
+    VCPClient &operator=(const VCPClient &) = delete;
+
+    // root is a working copy's top directory (where .vcp/ is). state and
+    // list have nothing to give when they fail, so their futures throw
+    // std::runtime_error with the reason; the rest give false.
+    std::future<RepoState> state(const std::string &root, ProgressFn progress = nullptr);
+    std::future<bool> add(const std::string &root, const std::vector<std::string> &paths,
+                          ProgressFn progress = nullptr);
+    std::future<bool> submit(const std::string &root, ProgressFn progress = nullptr);
+    // Into dir/project_name
+    std::future<bool> clone(const std::string &dir, const std::string &project_name,
+                            const std::vector<std::string> &paths = {}, bool lazy = false,
+                            ProgressFn progress = nullptr);
+    std::future<std::vector<std::string>> list(ProgressFn progress = nullptr);
+
+private:
+    // Queue job to run on a VCP for root. Jobs with the same non-empty key
+    // (a working copy's absolute path) run in order, one at a time.
+    template <class T>
+    std::future<T> enqueue(const std::string &key, const std::string &root, ProgressFn progress,
+                           std::function<T(VCP &, Reporter &)> job);
+    void schedule(const std::string &key, std::function<void()> job);
+    void finished(const std::string &key);
+    void run();
+
+    ConnectionPool pool;
+    std::mutex mutex_;
+    std::condition_variable work;
+    std::deque<std::function<void()>> queue;
+    // Per working copy with a job running: the jobs waiting behind it
+    std::map<std::string, std::deque<std::function<void()>>> waiting;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+template <class T>
+std::future<T> VCPClient::enqueue(const std::string &key, const std::string &root, ProgressFn progress,
+                                  std::function<T(VCP &, Reporter &)> job) {
+    auto task = std::make_shared<std::packaged_task<T()>>([this, root, progress, job]() {
+        Reporter rep(progress);
+        VCP vcp(root, &rep, &pool);
+        return job(vcp, rep);
+    });
+    std::future<T> result = task->get_future();
+    schedule(key, [task]() { (*task)(); });
+    return result;
+}
+
+#endif // VCP_CLIENT_H
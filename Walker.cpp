@@ -0,0 +1,259 @@
+// Recursive directory walker used by state/add.
+// Reads directories with getdents64 (readdir elsewhere) relative to one
+// root fd and trusts d_type, so directories and plain files never get
+// stat'ed unless the caller asks for metadata. Subdirectories are
+// spread over worker threads; each worker owns a deque and steals from
+// the others when its own runs dry; a worker with nothing to steal
+// sleeps until a directory is queued or the walk is over.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "Walker.h"
+using namespace std;
+
+#define DENTS_BUF_SIZE (64 * 1024)
+
+namespace {
+
+#ifdef __linux__
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+class Walk {
+public:
+    Walk(int root_fd, const WalkOptions &opts, unsigned nthreads)
+        : root_fd(root_fd), opts(opts), queues(nthreads), results(nthreads) {}
+
+    void run(vector<WalkEntry> &out) {
+        push(0, "");
+        vector<thread> pool;
+        for (unsigned id = 1; id < queues.size(); ++id)
+            pool.emplace_back([this, id]() { worker(id); });
+        worker(0);
+        for (auto &t : pool) t.join();
+
+        size_t total = 0;
+        for (auto &r : results) total += r.size();
+        out.reserve(out.size() + total);
+        for (auto &r : results)
+            for (auto &e : r) out.push_back(std::move(e));
+    }
+
+private:
+    struct Queue {
+        mutex mu;
+        deque<string> dirs;
+    };
+
+    int root_fd;
+    const WalkOptions &opts;
+    vector<Queue> queues;
+    vector<vector<WalkEntry>> results;
+    atomic<size_t> pending{0};  // queued or being scanned
+    atomic<size_t> queued{0};
+    mutex idle_mu;
+    condition_variable idle_cv;
+
+    void push(unsigned id, string dir) {
+        pending.fetch_add(1);
+        {
+            lock_guard<mutex> lock(queues[id].mu);
+            queues[id].dirs.push_back(std::move(dir));
+        }
+        queued.fetch_add(1);
+        wake(false);
+    }
+
+    // Taking idle_mu orders this with a sleeper's predicate check
+    void wake(bool all) {
+        { lock_guard<mutex> lock(idle_mu); }
+        if (all) idle_cv.notify_all();
+        else idle_cv.notify_one();
+    }
+
+    // Own queue from the back (depth first), everyone else's from the front
+    bool take(unsigned id, string &dir) {
+        {
+            Queue &q = queues[id];
+            lock_guard<mutex> lock(q.mu);
+            if (!q.dirs.empty()) {
+                dir = std::move(q.dirs.back());
+                q.dirs.pop_back();
+                queued.fetch_sub(1);
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue &q = queues[(id + i) % queues.size()];
+            lock_guard<mutex> lock(q.mu);
+            if (!q.dirs.empty()) {
+                dir = std::move(q.dirs.front());
+                q.dirs.pop_front();
+                queued.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker(unsigned id) {
+        vector<char> dents(DENTS_BUF_SIZE);
+        string path;
+        string dir;
+        while (true) {
+            if (take(id, dir)) {
+                scan(id, dir, path, dents);
+                if (pending.fetch_sub(1) == 1) wake(true);
+            } else if (pending.load() == 0) {
+                break;
+            } else {
+                unique_lock<mutex> lock(idle_mu);
+                idle_cv.wait(lock, [this]() { return queued.load() > 0 || pending.load() == 0; });
+            }
+        }
+    }
+
+    // One directory entry; path holds "<prefix>/<dir>/<name>"
+    void visit(unsigned id, int dfd, const char *name, unsigned char d_type,
+               string &path, size_t prefix_len) {
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            return;
+        if (opts.skip_hidden && name[0] == '.')
+            return;
+
+        struct stat st;
+        bool have_stat = false;
+        WalkEntry::Type type;
+        bool descend = false;
+        if (d_type == DT_DIR) {
+            type = WalkEntry::DIR;
+            descend = true;
+        } else if (d_type == DT_REG) {
+            type = WalkEntry::FILE;
+        } else if (d_type == DT_UNKNOWN || d_type == DT_LNK) {
+            // Filesystem didn't tell us, or it's a symlink: follow it to see
+            // what it points at, but never descend through a link
+            bool is_link = d_type == DT_LNK;
+            if (!is_link) {
+                if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+                is_link = S_ISLNK(st.st_mode);
+            }
+            if (is_link && fstatat(dfd, name, &st, 0) != 0) return;
+            have_stat = true;
+            if (S_ISREG(st.st_mode)) {
+                type = WalkEntry::FILE;
+            } else if (S_ISDIR(st.st_mode)) {
+                type = WalkEntry::DIR;
+                descend = !is_link;
+            } else {
+                type = WalkEntry::OTHER;
+            }
+        } else {
+            type = WalkEntry::OTHER;
+        }
+
+        size_t base = path.size();
+        path.append(name);
+        if (opts.skip && opts.skip(path, type == WalkEntry::DIR)) {
+            path.resize(base);
+            return;
+        }
+
+        WalkEntry e;
+        e.path = path;
+        e.type = type;
+        if (type == WalkEntry::FILE && opts.want_stat) {
+            if (have_stat || fstatat(dfd, name, &st, 0) == 0) {
+                e.mode = st.st_mode;
+                e.size = st.st_size;
+#ifdef __APPLE__
+                e.mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+                e.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+                e.ino = st.st_ino;
+            }
+        }
+        results[id].push_back(std::move(e));
+
+        if (descend) push(id, path.substr(prefix_len));
+        path.resize(base);
+    }
+
+    void scan(unsigned id, const string &dir, string &path, vector<char> &dents) {
+        int dfd = openat(root_fd, dir.empty() ? "." : dir.c_str(),
+                         O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd < 0) return;  // permission denied etc - skip quietly
+
+        // Reused buffer: "<prefix>/<dir>/" with names appended per entry
+        path.assign(opts.prefix);
+        if (!path.empty()) path += '/';
+        size_t prefix_len = path.size();
+        if (!dir.empty()) {
+            path += dir;
+            path += '/';
+        }
+
+#ifdef __linux__
+        while (true) {
+            long n = syscall(SYS_getdents64, dfd, dents.data(), dents.size());
+            if (n <= 0) break;
+            for (long off = 0; off < n;) {
+                auto *d = reinterpret_cast<linux_dirent64*>(dents.data() + off);
+                visit(id, dfd, d->d_name, d->d_type, path, prefix_len);
+                off += d->d_reclen;
+            }
+        }
+        close(dfd);
+#else
+        (void)dents;
+        DIR *dp = fdopendir(dfd);
+        if (!dp) {
+            close(dfd);
+            return;
+        }
+        while (struct dirent *d = readdir(dp)) {
+            visit(id, dfd, d->d_name, d->d_type, path, prefix_len);
+        }
+        closedir(dp);
+#endif
+    }
+};
+
+} // namespace
+
+bool walk_tree(const string &root, vector<WalkEntry> &out, const WalkOptions &opts) {
+    int root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return false;
+
+    unsigned nthreads = opts.threads;
+    if (nthreads == 0) nthreads = thread::hardware_concurrency();
+    if (nthreads == 0) nthreads = 1;
+
+    size_t first = out.size();
+    Walk(root_fd, opts, nthreads).run(out);
+    close(root_fd);
+
+    if (opts.sorted) {
+        sort(out.begin() + first, out.end(),
+             [](const WalkEntry &a, const WalkEntry &b) { return a.path < b.path; });
+    }
+    return true;
+}
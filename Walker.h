@@ -0,0 +1,44 @@
+#ifndef WALKER_H
+#define WALKER_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// One entry found by walk_tree()
+struct WalkEntry {
+    enum Type { FILE, DIR, OTHER };
+
+    std::string path;       // relative, '/' separated, no trailing slash
+    Type type;
+    // Only filled in when WalkOptions::want_stat is set (files only)
+    mode_t mode = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t ino = 0;
+};
+
+struct WalkOptions {
+    // Prepended to every reported path ("src" -> "src/a.cpp")
+    std::string prefix;
+    // Skip names starting with '.' (and don't descend into them)
+    bool skip_hidden = true;
+    // stat() regular files for mode/size/mtime/inode. Directory entries
+    // never need it - the type comes straight from d_type.
+    bool want_stat = false;
+    // Sort output by path so callers get the same order on every run
+    bool sorted = true;
+    // 0 = one per core
+    unsigned threads = 0;
+    // Return true to drop an entry; a dropped directory is never opened
+    std::function<bool(const std::string &path, bool is_dir)> skip;
+};
+
+// Walk root recursively (symlinked directories are reported, not followed).
+// Returns false only if root itself can't be opened.
+bool walk_tree(const std::string &root, std::vector<WalkEntry> &out,
+               const WalkOptions &opts = WalkOptions());
+
+#endif // WALKER_H
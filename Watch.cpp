@@ -0,0 +1,468 @@
+// `vcp watch` - inotify backed change journal so state/add only look at
+// what actually changed. See Watch.h for the journal format.
+
+#include <atomic>
+#include <iostream>
+#include <fstream>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <csignal>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "Watch.h"
+#include "Ignore.h"
+using namespace std;
+
+#define JOURNAL_FILE "/journal"
+#define WATCH_LOG "/watch.log"
+// Sync cookies: "<vcp_dir>/sync-<pid>-<n>", removed by the watcher once
+// the journal covers everything that happened before they were created
+#define COOKIE_PREFIX "sync-"
+#define SYNC_TIMEOUT_MS 2000
+
+bool watch_file(const string &rel) {
+    return rel == ".vcp" JOURNAL_FILE || rel == ".vcp" JOURNAL_FILE ".tmp" || rel == ".vcp" WATCH_LOG ||
+           rel.rfind(".vcp/" COOKIE_PREFIX, 0) == 0;
+}
+
+static bool has_hidden_part(const string &path) {
+    return path[0] == '.' || path.find("/.") != string::npos;
+}
+
+static void load_tracker(const string &vcp_dir, unordered_map<string, string> &files,
+                         unordered_set<string> &dirs) {
+    files.clear();
+    dirs.clear();
+    ifstream tf(vcp_dir + "/tracker.txt");
+    string proj_name, path, hash;
+    getline(tf, proj_name);
+    while (tf >> path >> hash) {
+        if (path.back() == '/') dirs.insert(path);
+        else files[path] = hash;
+    }
+}
+
+// Header of the journal; false if it's missing or malformed
+static bool read_header(const string &vcp_dir, pid_t &pid, string &status, ifstream &in) {
+    in.open(vcp_dir + JOURNAL_FILE);
+    if (!in) return false;
+    string magic;
+    long p = 0;
+    if (!(in >> magic >> p >> status) || magic != "vcpwatch") return false;
+    pid = (pid_t)p;
+    string rest;
+    getline(in, rest);
+    return true;
+}
+
+static bool pid_alive(pid_t pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static bool watcher_live(const string &vcp_dir, ifstream &in) {
+    pid_t pid;
+    string status;
+    return read_header(vcp_dir, pid, status, in) && status == "live" && pid_alive(pid);
+}
+
+// The watcher flushes in batches, so the journal can lag changes made just
+// now. Drop a cookie into .vcp and wait for the watcher to remove it: its
+// inotify queue is ordered, so by then every earlier change is flushed.
+static bool sync_watcher(const string &vcp_dir) {
+    static atomic<unsigned> next{0};
+    string cookie = vcp_dir + "/" COOKIE_PREFIX + to_string(getpid()) + "-" + to_string(next++);
+    int fd = open(cookie.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    close(fd);
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(SYNC_TIMEOUT_MS);
+    struct stat st;
+    while (stat(cookie.c_str(), &st) == 0) {
+        if (chrono::steady_clock::now() >= deadline) {
+            unlink(cookie.c_str());
+            return false;
+        }
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return true;
+}
+
+bool journal_entries(const string &root, const string &vcp_dir, const string &prefix,
+                     bool skip_hidden, vector<WalkEntry> &out) {
+    ifstream in;
+    if (!watcher_live(vcp_dir, in)) return false;
+    in.close();
+    if (!sync_watcher(vcp_dir)) return false;
+    if (!watcher_live(vcp_dir, in)) return false;  // overflowed meanwhile
+
+    string line;
+    while (getline(in, line)) {
+        if (line.empty()) continue;
+        if (!prefix.empty() && line != prefix && line.compare(0, prefix.size() + 1, prefix + "/") != 0)
+            continue;
+        if (skip_hidden && has_hidden_part(line)) continue;
+
+        struct stat st;
+        if (stat((root + "/" + line).c_str(), &st) != 0) continue;  // gone since
+        WalkEntry e;
+        e.path = line;
+        if (S_ISREG(st.st_mode)) {
+            e.type = WalkEntry::FILE;
+            e.mode = st.st_mode;
+            e.size = st.st_size;
+#ifdef __APPLE__
+            e.mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+            e.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+            e.ino = st.st_ino;
+        } else if (S_ISDIR(st.st_mode)) {
+            e.type = WalkEntry::DIR;
+        } else {
+            e.type = WalkEntry::OTHER;
+        }
+        out.push_back(std::move(e));
+    }
+    return true;
+}
+
+int stop_watcher(const string &vcp_dir) {
+    ifstream in;
+    pid_t pid;
+    string status;
+    if (!read_header(vcp_dir, pid, status, in) || !pid_alive(pid)) {
+        cerr << "No watcher running\n";
+        return 1;
+    }
+    if (kill(pid, SIGTERM) != 0) {
+        cerr << "Couldn't stop watcher (pid " << pid << ")\n";
+        return 1;
+    }
+    cout << "Stopped watcher (pid " << pid << ")\n";
+    return 0;
+}
+
+#ifdef __linux__
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void handle_watch_signal(int) {
+    watch_stop = 1;
+}
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | \
+                    IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define FLUSH_IDLE_MS 20
+#define FLUSH_MAX_MS 250
+
+namespace {
+
+class Watcher {
+public:
+    Watcher(const string &root, const string &vcp_dir, HashAlgo algo)
+        : root(root), vcp_dir(vcp_dir), algo(algo) {}
+
+    int run() {
+        ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ifd < 0) {
+            cerr << "inotify_init1 failed (errno " << errno << ")\n";
+            return 1;
+        }
+        // tracker rewrites arrive as CLOSE_WRITE (or MOVED_TO for atomic writes)
+        meta_wd = inotify_add_watch(ifd, vcp_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+
+        if (!rescan()) {
+            close(ifd);
+            return 1;
+        }
+
+        auto last_flush = chrono::steady_clock::now();
+        alignas(inotify_event) char buf[64 * 1024];
+        while (!watch_stop) {
+            pollfd pfd{ifd, POLLIN, 0};
+            int r = poll(&pfd, 1, dirty_pending ? FLUSH_IDLE_MS : 1000);
+            if (r < 0 && errno != EINTR) break;
+
+            bool overflow = false;
+            if (r > 0) {
+                ssize_t n;
+                while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+                    for (char *p = buf; p < buf + n;) {
+                        auto *ev = reinterpret_cast<inotify_event*>(p);
+                        if (ev->mask & IN_Q_OVERFLOW) overflow = true;
+                        else handle(ev);
+                        p += sizeof(inotify_event) + ev->len;
+                    }
+                }
+            }
+
+            if (overflow) {
+                // Lost events - nothing in the set can be trusted until we rescan
+                cerr << "inotify queue overflow, rescanning\n";
+                flush("overflow");
+                if (!rescan()) break;
+                release_cookies();
+                last_flush = chrono::steady_clock::now();
+                continue;
+            }
+            if (reload_ignores) {
+                reload_ignores = false;
+                if (!rescan()) break;
+                release_cookies();
+                last_flush = chrono::steady_clock::now();
+                continue;
+            }
+            if (tracker_changed) {
+                tracker_changed = false;
+                prune_clean();
+            }
+
+            auto now = chrono::steady_clock::now();
+            auto since = chrono::duration_cast<chrono::milliseconds>(now - last_flush).count();
+            if (!cookies.empty() || (dirty_pending && (r == 0 || since >= FLUSH_MAX_MS))) {
+                flush("live");
+                release_cookies();
+                last_flush = now;
+            }
+        }
+
+        unlink((vcp_dir + JOURNAL_FILE).c_str());
+        close(ifd);
+        return 0;
+    }
+
+private:
+    string root, vcp_dir;
+    HashAlgo algo;
+    IgnoreMatcher ig;
+    int ifd = -1;
+    int meta_wd = -1;
+    unordered_map<int, string> wd_dir;
+    set<string> dirty;
+    bool dirty_pending = false;
+    bool tracker_changed = false;
+    bool reload_ignores = false;
+    vector<string> cookies;  // seen, waiting for the next flush
+
+    void release_cookies() {
+        for (const auto &c : cookies) unlink((vcp_dir + "/" + c).c_str());
+        cookies.clear();
+    }
+
+    bool skipped(const string &rel, bool is_dir) const {
+        return rel == ".vcp" || ig.match(rel, is_dir);
+    }
+
+    void watch_dir(const string &rel) {
+        string full = rel.empty() ? root : root + "/" + rel;
+        int wd = inotify_add_watch(ifd, full.c_str(), WATCH_MASK);
+        if (wd < 0) {
+            if (errno == ENOSPC)
+                cerr << "Out of inotify watches - raise fs.inotify.max_user_watches\n";
+            return;
+        }
+        wd_dir[wd] = rel;
+    }
+
+    // Full walk: (re)register watches and seed the dirty set by comparing
+    // against the tracker. Expensive, but only at startup / after overflow.
+    bool rescan() {
+        flush("scanning");
+        ig = IgnoreMatcher();
+        ig.load(root + "/.vcpignore");
+        dirty.clear();
+
+        WalkOptions opts;
+        opts.skip_hidden = false;
+        opts.skip = [this](const string &p, bool is_dir) { return skipped(p, is_dir); };
+        vector<WalkEntry> entries;
+        if (!walk_tree(root, entries, opts)) {
+            cerr << "Can't scan " << root << endl;
+            return false;
+        }
+
+        unordered_map<string, string> tracked;
+        unordered_set<string> tracked_dirs;
+        load_tracker(vcp_dir, tracked, tracked_dirs);
+
+        watch_dir("");
+        vector<string> files, abs_paths;
+        for (const auto &e : entries) {
+            if (e.type == WalkEntry::DIR) {
+                watch_dir(e.path);
+                if (!tracked_dirs.count(e.path + "/")) dirty.insert(e.path);
+            } else if (e.type == WalkEntry::FILE) {
+                if (!tracked.count(e.path)) {
+                    dirty.insert(e.path);
+                } else {
+                    files.push_back(e.path);
+                    abs_paths.push_back(root + "/" + e.path);
+                }
+            }
+        }
+        vector<string> hashes = hash_files(abs_paths, algo);
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (hashes[i].empty() || hashes[i] != tracked[files[i]]) dirty.insert(files[i]);
+        }
+
+        flush("live");
+        return true;
+    }
+
+    // A directory showed up (created or moved in): watch it and everything below
+    void add_subtree(const string &rel) {
+        watch_dir(rel);
+        WalkOptions opts;
+        opts.prefix = rel;
+        opts.skip_hidden = false;
+        opts.sorted = false;
+        opts.skip = [this](const string &p, bool is_dir) { return skipped(p, is_dir); };
+        vector<WalkEntry> entries;
+        walk_tree(root + "/" + rel, entries, opts);
+        for (const auto &e : entries) {
+            if (e.type == WalkEntry::DIR) watch_dir(e.path);
+            dirty.insert(e.path);
+        }
+    }
+
+    // A directory moved away: its watches would report under a stale path
+    void drop_subtree(const string &rel) {
+        string sub = rel + "/";
+        for (auto it = wd_dir.begin(); it != wd_dir.end();) {
+            if (it->second == rel || it->second.compare(0, sub.size(), sub) == 0) {
+                inotify_rm_watch(ifd, it->first);
+                it = wd_dir.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void handle(const inotify_event *ev) {
+        if (ev->wd == meta_wd) {
+            if (!ev->len) return;
+            string name = ev->name;
+            if (name == "tracker.txt") tracker_changed = true;
+            else if (name.rfind(COOKIE_PREFIX, 0) == 0) cookies.push_back(name);
+            return;
+        }
+        if (ev->mask & IN_IGNORED) {
+            wd_dir.erase(ev->wd);
+            return;
+        }
+        auto it = wd_dir.find(ev->wd);
+        if (it == wd_dir.end() || ev->len == 0) return;
+
+        string rel = it->second.empty() ? string(ev->name) : it->second + "/" + ev->name;
+        bool is_dir = (ev->mask & IN_ISDIR) != 0;
+        if (rel == ".vcpignore") reload_ignores = true;
+        if (skipped(rel, is_dir)) return;
+
+        dirty.insert(rel);
+        dirty_pending = true;
+        if (is_dir && (ev->mask & (IN_CREATE | IN_MOVED_TO))) add_subtree(rel);
+        if (is_dir && (ev->mask & IN_MOVED_FROM)) drop_subtree(rel);
+    }
+
+    // Tracker was rewritten (vcp add): forget entries that now match it
+    void prune_clean() {
+        unordered_map<string, string> tracked;
+        unordered_set<string> tracked_dirs;
+        load_tracker(vcp_dir, tracked, tracked_dirs);
+
+        vector<string> files, abs_paths;
+        for (auto it = dirty.begin(); it != dirty.end();) {
+            struct stat st;
+            string full = root + "/" + *it;
+            if (stat(full.c_str(), &st) != 0) {
+                it = dirty.erase(it);
+                continue;
+            }
+            if (S_ISDIR(st.st_mode) && tracked_dirs.count(*it + "/")) {
+                it = dirty.erase(it);
+                continue;
+            }
+            if (S_ISREG(st.st_mode) && tracked.count(*it)) {
+                files.push_back(*it);
+                abs_paths.push_back(full);
+            }
+            ++it;
+        }
+        vector<string> hashes = hash_files(abs_paths, algo);
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (!hashes[i].empty() && hashes[i] == tracked[files[i]]) dirty.erase(files[i]);
+        }
+        dirty_pending = true;
+    }
+
+    // Atomic rewrite so readers never see half a journal
+    void flush(const char *status) {
+        string path = vcp_dir + JOURNAL_FILE;
+        string tmp = path + ".tmp";
+        {
+            ofstream out(tmp, ios::trunc);
+            if (!out) return;
+            out << "vcpwatch " << getpid() << " " << status << "\n";
+            if (string(status) == "live") {
+                for (const auto &p : dirty) out << p << "\n";
+            }
+        }
+        rename(tmp.c_str(), path.c_str());
+        dirty_pending = false;
+    }
+};
+
+} // namespace
+
+int run_watcher(const string &root, const string &vcp_dir, HashAlgo algo, bool foreground) {
+    {
+        ifstream in;
+        pid_t pid;
+        string status;
+        if (read_header(vcp_dir, pid, status, in) && pid_alive(pid)) {
+            cerr << "Already watching (pid " << pid << ")\n";
+            return 1;
+        }
+    }
+
+    if (!foreground) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            cerr << "fork failed\n";
+            return 1;
+        }
+        if (pid > 0) {
+            cout << "Watching " << root << " (pid " << pid << ")\n";
+            return 0;
+        }
+        setsid();
+        int devnull = open("/dev/null", O_RDWR);
+        int log = open((vcp_dir + WATCH_LOG).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(log >= 0 ? log : devnull, STDERR_FILENO);
+        if (devnull > STDERR_FILENO) close(devnull);
+        if (log > STDERR_FILENO) close(log);
+    }
+
+    std::signal(SIGTERM, handle_watch_signal);
+    std::signal(SIGINT, handle_watch_signal);
+    return Watcher(root, vcp_dir, algo).run();
+}
+
+#else
+
+int run_watcher(const string &, const string &, HashAlgo, bool) {
+    cerr << "vcp watch needs inotify (Linux only)\n";
+    return 1;
+}
+
+#endif
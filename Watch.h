@@ -0,0 +1,39 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <string>
+#include <vector>
+#include "Hash.h"
+#include "Walker.h"
+
+// `vcp watch` keeps an inotify watch on every directory of the working tree
+// and records which paths may differ from the tracker in .vcp/journal:
+//
+//   vcpwatch <pid> <live|scanning|overflow>
+//   <relative path>
+//   ...
+//
+// On startup (and after a queue overflow) it does one full scan to seed the
+// set with every untracked or modified path, then only adds what inotify
+// reports. When the tracker is rewritten it drops entries that became clean.
+
+// Start watching root. Forks into the background unless foreground is set.
+int run_watcher(const std::string &root, const std::string &vcp_dir,
+                HashAlgo algo, bool foreground);
+// Ask a running watcher to exit
+int stop_watcher(const std::string &vcp_dir);
+
+// True for the files vcp watch keeps in .vcp (journal, log, sync cookies):
+// they belong to this machine and are never tracked
+bool watch_file(const std::string &rel);
+
+// Dirty paths under prefix ("" for everything) as walker entries, stat'ed
+// the way walk_tree() would with want_stat. Waits for the watcher to flush
+// everything changed before the call. Returns false when there is no live
+// watcher (not running, still scanning, overflowed, not answering) - do a
+// full scan.
+bool journal_entries(const std::string &root, const std::string &vcp_dir,
+                     const std::string &prefix, bool skip_hidden,
+                     std::vector<WalkEntry> &out);
+
+#endif // WATCH_H
@@ -0,0 +1,178 @@
+// vcp: the command line on top of libvcp (VCP.h)
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Manifest.h"
+#include "VCP.h"
+
+namespace fs = std::filesystem;
+
+using namespace std;
+
+static void help() {
+    cout << "VCP - Version Control Program\n";
+    cout << "Commands:\n"
+         << "  init     - Start new project (--hash=blake3 for BLAKE3)\n"
+         << "  state    - Show changes\n"
+         << "  diff     - Show what changed in modified files (optionally only <path>...)\n"
+         << "  add      - Track files: paths, directories, globs, or --stdin (NUL separated)\n"
+         << "  submit   - Send to server\n"
+         << "  clone    - Clone project from server (--path <dir>... for part of it, --lazy to fetch files on use)\n"
+         << "  fetch    - Check out files a lazy clone hasn't fetched yet (optionally only <path>...)\n"
+         << "  list     - List available projects on server\n"
+         << "  status   - Show server role and replication lag\n"
+         << "  admin    - Server settings: show | set global|client|burst <rate> | set weight <class> <n>\n"
+         << "  watch    - Keep state hot in the background (--foreground, --stop)\n";
+}
+
+// Repo paths from the arguments after the command; "." = everything
+static vector<string> path_args(const VCP &vcp, int argc, char *argv[]) {
+    vector<string> paths;
+    for(int i = 2; i < argc; ++i) {
+        string p = vcp.repoPath(argv[i]);
+        if(p.empty()) return {};
+        paths.push_back(p);
+    }
+    return paths;
+}
+
+int main(int argc, char *argv[]) {
+    VCP vcp(fs::current_path().string());
+
+    if(argc < 2) {
+        help();
+        return 1;
+    }
+
+    string cmd = argv[1];
+
+    if(cmd == "init") {
+        HashAlgo algo = HashAlgo::SHA256;
+        if(argc >= 3) {
+            string opt = argv[2];
+            if(opt.rfind("--hash=", 0) != 0 || !parse_hash_algo(opt.substr(7), algo)) {
+                cerr << "Usage: init [--hash=sha256|blake3]\n";
+                return 1;
+            }
+        }
+        if(fs::exists(".vcp/tracker.txt")) {
+            cerr << "Existing project found!\n";
+            return 1;
+        }
+        // Get project name from user
+        string proj_name;
+        cout << "Enter project name (no spaces): ";
+        getline(cin, proj_name);
+        return vcp.init(proj_name, algo) ? 0 : 1;
+    }
+    else if(cmd == "state") {
+        RepoState st;
+        if(!vcp.state(st)) return 1;
+        if(!st.added.empty()) {
+            cout << "** New items **\n";
+            for(const auto& item : st.added) cout << "  + " << item << endl;
+        }
+        if(!st.modified.empty()) {
+            cout << "\n** Modified files **\n";
+            for(const auto& file : st.modified) cout << "  * " << file << endl;
+        }
+        if(st.added.empty() && st.modified.empty()) {
+            cout << "No changes detected\n";
+        }
+    }
+    else if(cmd == "diff") {
+        return vcp.diff(path_args(vcp, argc, argv), cout);
+    }
+    else if(cmd == "add") {
+        // Paths from the command line, or NUL separated on stdin
+        // (find ... -print0 | vcp add --stdin)
+        vector<string> paths;
+        for(int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if(arg != "--stdin") {
+                paths.push_back(arg);
+                continue;
+            }
+            string p;
+            while(getline(cin, p, '\0')) {
+                if(!p.empty()) paths.push_back(p);
+            }
+        }
+        if(paths.empty()) {
+            cerr << "Missing file to add!\n";
+            return 1;
+        }
+        return vcp.add(paths) ? 0 : 1;
+    }
+    else if(cmd == "submit") {
+        return vcp.submit() ? 0 : 1;
+    }
+    else if(cmd == "clone") {
+        string project;
+        vector<string> paths;
+        bool lazy = false;
+        for(int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if(arg == "--lazy") lazy = true;
+            else if(arg == "--path" && i + 1 < argc) {
+                string p = vcp.repoPath(argv[++i]);
+                if(!safe_relative_path(p)) {
+                    cerr << "--path must be inside the project: " << argv[i] << "\n";
+                    return 1;
+                }
+                paths.push_back(p);
+            }
+            else if(project.empty() && arg[0] != '-') project = arg;
+            else {
+                cerr << "Usage: clone <project> [--path <dir>]... [--lazy]\n";
+                return 1;
+            }
+        }
+        if(project.empty()) {
+            cerr << "Missing project name to clone!\n";
+            return 1;
+        }
+        if(!vcp.clone(project, paths, lazy)) return 1;
+        if(fs::exists(project + "/.vcp")) {
+            cout << "Project '" << project << "' cloned successfully!\n";
+            cout << "Navigate to the project directory with: cd " << project << endl;
+        }
+    }
+    else if(cmd == "fetch") {
+        return vcp.fetch(path_args(vcp, argc, argv));
+    }
+    else if(cmd == "list") {
+        vector<string> projects;
+        if(!vcp.list(projects)) return 1;
+        cout << "Available projects on server:\n";
+        for(const auto& p : projects) cout << "  - " << p << endl;
+    }
+    else if(cmd == "status") {
+        string text;
+        if(!vcp.status(text)) return 1;
+        cout << text;
+    }
+    else if(cmd == "admin") {
+        string command, reply;
+        for(int i = 2; i < argc; ++i) command += (i > 2 ? " " : "") + string(argv[i]);
+        if(!vcp.admin(command, reply)) return 1;
+        cout << reply;
+    }
+    else if(cmd == "watch") {
+        string opt = argc >= 3 ? argv[2] : "";
+        if(opt != "" && opt != "--foreground" && opt != "--stop") {
+            cerr << "Usage: watch [--foreground|--stop]\n";
+            return 1;
+        }
+        return vcp.watch(opt == "--foreground", opt == "--stop");
+    }
+    else {
+        cerr << "Unknown command '" << cmd << "'\n";
+        help();
+        return 1;
+    }
+
+    return 0;
+}